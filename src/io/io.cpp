@@ -96,7 +96,8 @@ IIOService::IIOService( uint8_t nthreads, uint32_t nclients, bool immediately )
     : m_IOLayer( NULL ),
       m_ThreadsCount( nthreads ),
       m_SessionsCount( nclients ),
-      m_IOContextGroup( NULL )
+      m_IOContextGroup( NULL ),
+      m_IsContextInited( false )
 {
     pthread_cond_init( &m_Cond, NULL );
     pthread_mutex_init( &m_Lock, NULL );
@@ -106,38 +107,24 @@ IIOService::IIOService( uint8_t nthreads, uint32_t nclients, bool immediately )
     if ( m_IOLayer != NULL )
     {
         m_IOContextGroup = new void * [ m_ThreadsCount ];
-        if ( m_IOContextGroup != NULL )
+        for ( uint8_t i = 0; i < m_ThreadsCount; ++i )
         {
-            for ( uint8_t i = 0; i < m_ThreadsCount; ++i )
-            {
-                m_IOContextGroup[ i ] = initIOContext();
-            }
+            m_IOContextGroup[ i ] = NULL;
         }
 
         iolayer_set_transform( m_IOLayer, onTransformService, this );
-        iolayer_set_iocontext( m_IOLayer, m_IOContextGroup, m_ThreadsCount );
     }
 }
 
 IIOService::~IIOService()
 {
-    if ( m_IOLayer != NULL )
-    {
-        iolayer_destroy( m_IOLayer );
-        m_IOLayer = NULL;
-    }
+    this->destroy();
 
     if ( m_IOContextGroup != NULL )
     {
-        for ( uint8_t i = 0; i < m_ThreadsCount; ++i )
-        {
-            if ( m_IOContextGroup != NULL )
-            {
-                finalIOContext( m_IOContextGroup[i] );
-            }
-        }
-
+        // 派生类的IO上下文已经在派生类的析构函数中销毁
         delete [] m_IOContextGroup;
+        m_IOContextGroup = NULL;
     }
 
     pthread_cond_destroy( &m_Cond );
@@ -157,11 +144,14 @@ sid_t IIOService::id( const char * host, uint16_t port )
 
 bool IIOService::listen( const char * host, uint16_t port )
 {
+    this->initIOContextGroup();
     return ( iolayer_listen( m_IOLayer, host, port, onAcceptSession, this ) == 0 );
 }
 
 bool IIOService::connect( const char * host, uint16_t port, int32_t seconds, bool isblock )
 {
+    this->initIOContextGroup();
+
     if ( iolayer_connect( m_IOLayer, host, port, seconds, onConnectSession, this ) != 0 )
     {
         return false;
@@ -205,6 +195,50 @@ void IIOService::stop()
     }
 }
 
+void IIOService::destroy()
+{
+    if ( m_IOLayer != NULL )
+    {
+        iolayer_destroy( m_IOLayer );
+        m_IOLayer = NULL;
+    }
+
+    // 网络线程已经退出, 不会再使用IO上下文
+    this->finalIOContextGroup();
+}
+
+void IIOService::initIOContextGroup()
+{
+    pthread_mutex_lock( &m_Lock );
+    if ( !m_IsContextInited && m_IOContextGroup != NULL )
+    {
+        for ( uint8_t i = 0; i < m_ThreadsCount; ++i )
+        {
+            m_IOContextGroup[ i ] = initIOContext();
+        }
+
+        m_IsContextInited = true;
+        iolayer_set_iocontext( m_IOLayer, m_IOContextGroup, m_ThreadsCount );
+    }
+    pthread_mutex_unlock( &m_Lock );
+}
+
+void IIOService::finalIOContextGroup()
+{
+    pthread_mutex_lock( &m_Lock );
+    if ( m_IsContextInited )
+    {
+        for ( uint8_t i = 0; i < m_ThreadsCount; ++i )
+        {
+            finalIOContext( m_IOContextGroup[i] );
+            m_IOContextGroup[ i ] = NULL;
+        }
+
+        m_IsContextInited = false;
+    }
+    pthread_mutex_unlock( &m_Lock );
+}
+
 int32_t IIOService::send( sid_t id, const std::string & buffer )
 {
     return send( id, static_cast<const char *>(buffer.data()), static_cast<uint32_t>(buffer.size()) );
@@ -225,13 +259,15 @@ int32_t IIOService::broadcast( const std::string & buffer )
 
 int32_t IIOService::broadcast( const std::vector<sid_t> & ids, const std::string & buffer )
 {
-    uint32_t nbytes = static_cast<uint32_t>(buffer.size());
-    const char * buf = static_cast<const char *>( buffer.data() );
+    return broadcast( ids, static_cast<const char *>(buffer.data()), static_cast<uint32_t>(buffer.size()) );
+}
 
+int32_t IIOService::broadcast( const std::vector<sid_t> & ids, const char * buffer, uint32_t nbytes )
+{
     uint32_t count = (uint32_t)ids.size();
     std::vector<sid_t>::const_iterator start = ids.begin();
 
-    return iolayer_broadcast( m_IOLayer, const_cast<sid_t *>( &(*start) ), count, buf, nbytes );
+    return iolayer_broadcast( m_IOLayer, const_cast<sid_t *>( &(*start) ), count, buffer, nbytes );
 }
 
 int32_t IIOService::shutdown( sid_t id )
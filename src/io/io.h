@@ -100,7 +100,8 @@ public :
     virtual ~IIOService();
 
 public :
-    // 初始化/销毁IO上下文
+    // 初始化/销毁IO上下文, 每个网络线程一个
+    // 在第一次listen()/connect()时初始化, 在destroy()中网络线程退出后销毁
     virtual void * initIOContext() { return NULL; }
     virtual void finalIOContext( void * context ) { return; }
 
@@ -137,11 +138,17 @@ public :
     // 广播数据
     int32_t broadcast( const std::string & buffer );
     int32_t broadcast( const std::vector<sid_t> & ids, const std::string & buffer );
+    int32_t broadcast( const std::vector<sid_t> & ids, const char * buffer, uint32_t nbytes );
 
     // 终止会话
     int32_t shutdown( sid_t id );
     int32_t shutdown( const std::vector<sid_t> & ids );
 
+protected :
+    // 销毁网络层, 等待网络线程退出后再销毁IO上下文
+    // 使用IO上下文的派生类需要在析构函数中调用
+    void destroy();
+
 private :
     struct RemoteHost
     {
@@ -168,6 +175,11 @@ private :
             IIOSession * session, void * iocontext,
             const std::string & host, uint16_t port );
 
+    // 初始化/销毁每个网络线程的IO上下文
+    // 构造和析构函数中无法调用派生类的虚函数
+    void initIOContextGroup();
+    void finalIOContextGroup();
+
     sid_t getConnectedSid( const char * host, uint16_t port ) const;
     void setConnectedSid( const char * host, uint16_t port, sid_t sid );
 
@@ -181,6 +193,7 @@ private :
     uint8_t             m_ThreadsCount;
     uint32_t            m_SessionsCount;
     void **             m_IOContextGroup;
+    bool                m_IsContextInited;
 
 private :
     pthread_cond_t      m_Cond;
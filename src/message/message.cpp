@@ -33,30 +33,54 @@ bool CacheItem::checkDataChunk()
 
 CacheMessage::CacheMessage()
     : m_Sid( 0 ),
+      m_Context( NULL ),
+      m_Timestamp( 0 ),
       m_Error( NULL ),
-      m_Command( NULL ),
+      m_KeyCount( 0 ),
+      m_HasItem( false ),
       m_Item( NULL ),
-      m_Delta(0)
+      m_Delta(0),
+      m_Limit( 0 ),
+      m_MaxStale( 0 ),
+      m_Durability(0),
+      m_IsBinary( false ),
+      m_IsQuiet( false ),
+      m_Opcode( 0 ),
+      m_Opaque( 0 ),
+      m_Next( NULL )
 {}
 
 CacheMessage::~CacheMessage()
 {
-    if ( m_Error != NULL )
+    if ( m_Item != NULL )
     {
-        ::free( m_Error );
-        m_Error = NULL;
+        delete m_Item;
+        m_Item = NULL;
     }
+}
 
-    if ( m_Command != NULL )
-    {
-        ::free( m_Command );
-        m_Command = NULL;
-    }
+void CacheMessage::reset()
+{
+    m_Sid = 0;
+    m_Context = NULL;
+    m_Timestamp = 0;
+    m_Error = NULL;
+    m_Command.clear();
+    m_KeyCount = 0;
+    m_HasItem = false;
+    m_Delta = 0;
+    m_Limit = 0;
+    m_MaxStale = 0;
+    m_Durability = 0;
+    m_IsBinary = false;
+    m_IsQuiet = false;
+    m_Opcode = 0;
+    m_Opaque = 0;
+    m_Next = NULL;
 
     if ( m_Item != NULL )
     {
-        delete m_Item;
-        m_Item = NULL;
+        m_Item->clear();
     }
 }
 
@@ -64,7 +88,7 @@ bool CacheMessage::isComplete()
 {
     if ( m_Error == NULL )
     {
-        if ( m_Item != NULL )
+        if ( m_HasItem )
         {
             return m_Item->getValueSize() == m_Item->getValueCapacity();
         }
@@ -77,7 +101,7 @@ bool CacheMessage::checkDataChunk()
 {
     if ( m_Error == NULL )
     {
-        if ( m_Item != NULL )
+        if ( m_HasItem )
         {
             return m_Item->checkDataChunk();
         }
@@ -86,46 +110,111 @@ bool CacheMessage::checkDataChunk()
     return true;
 }
 
-void CacheMessage::setCmd( const char * command )
+void CacheMessage::setCmd( const char * command, uint32_t len )
+{
+    m_Command.assign( command, len );
+}
+
+bool CacheMessage::isCommand( const char * command ) const
 {
-    if ( m_Command != NULL )
+    return ( m_Command.compare( command ) == 0 );
+}
+
+CacheItem * CacheMessage::fetchItem()
+{
+    if ( m_Item == NULL )
     {
-        ::free( m_Command );
-        m_Command = NULL;
+        m_Item = new CacheItem;
     }
 
-    m_Command = ::strdup( command );
+    m_HasItem = true;
+    return m_Item;
 }
 
-bool CacheMessage::isCommand( const char * command ) const
+void CacheMessage::addKey( const char * key, uint32_t len )
 {
-    return ( ::strcmp( command, m_Command ) == 0 );
+    if ( m_KeyCount < m_Keys.size() )
+    {
+        m_Keys[ m_KeyCount ].assign( key, len );
+    }
+    else
+    {
+        m_Keys.push_back( std::string( key, len ) );
+    }
+
+    ++m_KeyCount;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+CacheMessagePool::CacheMessagePool( uint32_t capacity )
+    : m_Capacity( capacity ),
+      m_Size( 0 ),
+      m_FreeList( NULL ),
+      m_Recycled( NULL )
+{}
+
+CacheMessagePool::~CacheMessagePool()
+{
+    destroy( m_FreeList );
+    destroy( m_Recycled );
+
+    m_FreeList = NULL;
+    m_Recycled = NULL;
 }
 
-void CacheMessage::setError( const char * error )
+CacheMessage * CacheMessagePool::acquire()
 {
-    if ( m_Error != NULL )
+    if ( m_FreeList == NULL )
+    {
+        // 取走所有回收的消息
+        m_FreeList = __sync_lock_test_and_set( &m_Recycled, (CacheMessage *)NULL );
+    }
+
+    if ( m_FreeList == NULL )
     {
-        ::free( m_Error );
-        m_Error = NULL;
+        return new CacheMessage;
     }
 
-    m_Error = ::strdup( error );
+    CacheMessage * msg = m_FreeList;
+    m_FreeList = msg->m_Next;
+    msg->m_Next = NULL;
+    __sync_sub_and_fetch( &m_Size, 1 );
+
+    return msg;
 }
 
-CacheItem * CacheMessage::fetchItem()
+void CacheMessagePool::recycle( CacheMessage * msg )
 {
-    if ( m_Item == NULL )
+    // 超过容量直接释放
+    if ( __sync_add_and_fetch( &m_Size, 1 ) > m_Capacity )
     {
-        m_Item = new CacheItem;
+        __sync_sub_and_fetch( &m_Size, 1 );
+        delete msg;
+        return;
     }
 
-    return m_Item;
+    msg->reset();
+
+    CacheMessage * head = NULL;
+    do
+    {
+        head = m_Recycled;
+        msg->m_Next = head;
+    }
+    while ( !__sync_bool_compare_and_swap( &m_Recycled, head, msg ) );
 }
 
-void CacheMessage::addKey( const char * key )
+void CacheMessagePool::destroy( CacheMessage * list )
 {
-    m_Keys.push_back( key );
+    while ( list != NULL )
+    {
+        CacheMessage * next = list->m_Next;
+        delete list;
+        list = next;
+    }
 }
 
 }
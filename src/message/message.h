@@ -19,27 +19,30 @@ typedef uint16_t                MessageID;      // 消息ID
 class CacheItem
 {
 public :
-    CacheItem() {}
+    CacheItem() : m_Capacity( 0 ) {}
     ~CacheItem() {}
 
 public :
     // 检查数据块
     bool checkDataChunk();
 
-    // 追加长度
-    void appendValue( const std::string & value ) { m_Value += value; }
+    // 追加数据
+    void appendValue( const char * data, uint32_t len ) { m_Value.append( data, len ); }
+
+    // 清空, 保留已经分配的内存
+    void clear() { m_Capacity = 0; m_Key.clear(); m_Value.clear(); }
 
 public :
     // Key
-    void setKey( const char * key ) { m_Key = key; }
+    void setKey( const char * key, uint32_t len ) { m_Key.assign( key, len ); }
     const std::string & getKey() const { return m_Key; }
 
     // Value
     const std::string & getValue() const { return m_Value; }
     uint32_t getValueSize() const { return m_Value.size(); }
 
-    // Value Capacity
-    void setValueCapacity( uint32_t c ) { m_Capacity = c; }
+    // Value Capacity, 一次分配足够的内存
+    void reserveValue( uint32_t c ) { m_Capacity = c; m_Value.reserve( c ); }
     uint32_t getValueCapacity() const { return m_Capacity; }
 
 
@@ -61,40 +64,126 @@ public :
     bool isComplete();
     bool checkDataChunk();
 
+    // 重置, 保留已经分配的内存以便复用
+    void reset();
+
     sid_t getSid() const { return m_Sid; }
     void setSid( sid_t id ) { m_Sid = id; }
 
+    // 会话上下文
+    void * getContext() const { return m_Context; }
+    void setContext( void * context ) { m_Context = context; }
+
+    // 提交时间(微秒)
+    int64_t getTimestamp() const { return m_Timestamp; }
+    void setTimestamp( int64_t timestamp ) { m_Timestamp = timestamp; }
+
 public :
     //
-    void setCmd( const char * command );
+    void setCmd( const char * command, uint32_t len );
     bool isCommand( const char * command ) const;
-    const char * getCmd() const { return m_Command; }
+    const char * getCmd() const { return m_Command.c_str(); }
 
-    // 错误
-    void setError( const char * error );
+    // 错误, 必须是常量字符串
+    void setError( const char * error ) { m_Error = error; }
     const char * getError() const { return m_Error; }
 
     //
     CacheItem * fetchItem();
-    CacheItem * getItem() const { return m_Item; }
+    CacheItem * getItem() const { return m_HasItem ? m_Item : NULL; }
 
-    void addKey( const char * key );
-    Keys & getKeyList() { return m_Keys; }
+    void addKey( const char * key, uint32_t len );
+    size_t getKeyCount() const { return m_KeyCount; }
+    const std::string & getKey( size_t i ) const { return m_Keys[i]; }
 
     //
-    uint32_t getDelta() const { return m_Delta; }
-    void setDelta( uint32_t delta ) { m_Delta = delta; }
+    uint64_t getDelta() const { return m_Delta; }
+    void setDelta( uint64_t delta ) { m_Delta = delta; }
+
+    // 通配符查询最多返回的个数, 0表示不限制
+    uint32_t getLimit() const { return m_Limit; }
+    void setLimit( uint32_t limit ) { m_Limit = limit; }
+
+    // 读请求能接受的数据延迟(毫秒), 备机的数据过旧时返回错误, 0表示不限制
+    uint32_t getMaxStale() const { return m_MaxStale; }
+    void setMaxStale( uint32_t msecs ) { m_MaxStale = msecs; }
+
+    // 请求指定的持久化方式, 0表示使用服务器的配置
+    int8_t getDurability() const { return m_Durability; }
+    void setDurability( int8_t durability ) { m_Durability = durability; }
+
+    // 二进制协议的请求, 回应时需要原样带回操作码和opaque
+    // quiet - 成功时(get系列是未命中时)不回应
+    void setBinary( uint8_t opcode, uint32_t opaque, bool quiet )
+    {
+        m_IsBinary = true;
+        m_Opcode = opcode;
+        m_Opaque = opaque;
+        m_IsQuiet = quiet;
+    }
+    bool isBinary() const { return m_IsBinary; }
+    bool isQuiet() const { return m_IsQuiet; }
+    uint8_t getOpcode() const { return m_Opcode; }
+    uint32_t getOpaque() const { return m_Opaque; }
 
 private :
+    friend class CacheMessagePool;
+
     sid_t       m_Sid;
+    void *      m_Context;
+    int64_t     m_Timestamp;
 
-    char *      m_Error;        // 消息解析出错
-    char *      m_Command;      // 命令字
+    const char * m_Error;       // 消息解析出错
+    std::string m_Command;      // 命令字
 
-    Keys        m_Keys;
+    Keys        m_Keys;         // 复用时不释放, 有效的个数是m_KeyCount
+    size_t      m_KeyCount;
+    bool        m_HasItem;
     CacheItem * m_Item;
 
-    uint32_t    m_Delta;
+    uint64_t    m_Delta;
+    uint32_t    m_Limit;
+    uint32_t    m_MaxStale;
+    int8_t      m_Durability;
+
+    bool        m_IsBinary;
+    bool        m_IsQuiet;
+    uint8_t     m_Opcode;
+    uint32_t    m_Opaque;
+
+    CacheMessage * m_Next;      // 消息池的链表
+};
+
+//
+// 消息池
+// 网络线程申请, 工作线程处理完成后回收
+// 回收的消息压入无锁栈, 申请时网络线程一次取走整个栈, 不存在ABA问题
+//
+class CacheMessagePool
+{
+public :
+    CacheMessagePool( uint32_t capacity = eDefaultCapacity );
+    ~CacheMessagePool();
+
+public :
+    // 申请, 只能在网络线程中调用
+    CacheMessage * acquire();
+    // 回收, 可以在任意线程中调用
+    void recycle( CacheMessage * msg );
+
+private :
+    enum
+    {
+        eDefaultCapacity    = 64,       // 每个会话最多缓存的消息个数
+    };
+
+    static void destroy( CacheMessage * list );
+
+private :
+    uint32_t                    m_Capacity;
+    volatile uint32_t           m_Size;
+    CacheMessage *              m_FreeList;     // 网络线程私有
+    CacheMessage * volatile     m_Recycled;     // 回收的消息
 };
 
 #pragma pack(1)
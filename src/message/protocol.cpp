@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "utils/endian.h"
+#include "utils/integer.h"
 #include "utils/streambuf.h"
 
 #include "message.h"
@@ -14,15 +16,146 @@
 namespace tinydb
 {
 
+// 命令行中的一个字段, 直接指向网络缓冲区
+struct Token
+{
+    const char *    data;
+    uint32_t        size;
+};
+
+// 取下一个字段, 以空格分隔
+static inline bool next_token( const char *& p, const char * end, Token & token )
+{
+    while ( p < end && *p == ' ' )
+    {
+        ++p;
+    }
+
+    if ( p == end )
+    {
+        return false;
+    }
+
+    token.data = p;
+    while ( p < end && *p != ' ' )
+    {
+        ++p;
+    }
+    token.size = p - token.data;
+
+    return true;
+}
+
+static inline bool is_token( const Token & token, const char * s, uint32_t len )
+{
+    return token.size == len && strncasecmp( token.data, s, len ) == 0;
+}
+
+#define IS_TOKEN( t, s )    is_token( (t), (s), sizeof(s)-1 )
+
+// 解析无符号整数
+static inline bool parse_uint( const Token & token, uint64_t & value )
+{
+    value = 0;
+
+    if ( token.size == 0 || token.size > 20 )
+    {
+        return false;
+    }
+
+    for ( uint32_t i = 0; i < token.size; ++i )
+    {
+        char c = token.data[i];
+        if ( c < '0' || c > '9' )
+        {
+            return false;
+        }
+
+        // 溢出
+        uint64_t d = c - '0';
+        if ( value > ( 0xffffffffffffffffULL - d ) / 10 )
+        {
+            return false;
+        }
+        value = value * 10 + d;
+    }
+
+    return true;
+}
+
+//
+// 请求的选项, 以"--"开头, 在所有的KEY之后
+// 读请求:
+//      --limit=<count>     通配符查询最多返回的个数
+//      --maxstale=<msecs>  能接受的数据延迟(毫秒)
+// 写请求:
+//      --durability=<sync|group|async>     持久化方式
+// 文本协议中"--"开头的KEY是非法的, 选项不会和KEY混淆
+//
+static inline bool is_option( const Token & token )
+{
+    return token.size >= 2 && token.data[0] == '-' && token.data[1] == '-';
+}
+
+// 解析选项的值, --name=value
+static bool parse_option( const Token & token, const char * name, uint32_t len, uint64_t & value )
+{
+    if ( token.size <= len + 3
+            || strncasecmp( token.data + 2, name, len ) != 0
+            || token.data[ len + 2 ] != '=' )
+    {
+        return false;
+    }
+
+    Token v = { token.data + len + 3, token.size - len - 3 };
+    return parse_uint( v, value );
+}
+
+#define PARSE_OPTION( t, s, v )     parse_option( (t), (s), sizeof(s)-1, (v) )
+
+// 解析持久化方式, --durability=sync/group/async
+// 不是合法的持久化方式时返回Durability::DEFAULT
+static int8_t parse_durability( const Token & token )
+{
+    static const char name[] = "--durability=";
+    const uint32_t len = sizeof(name) - 1;
+
+    if ( token.size <= len || strncasecmp( token.data, name, len ) != 0 )
+    {
+        return Durability::DEFAULT;
+    }
+
+    Token v = { token.data + len, token.size - len };
+    if ( IS_TOKEN( v, "sync" ) )
+    {
+        return Durability::SYNC;
+    }
+    else if ( IS_TOKEN( v, "group" ) )
+    {
+        return Durability::GROUP;
+    }
+    else if ( IS_TOKEN( v, "async" ) )
+    {
+        return Durability::ASYNC;
+    }
+
+    return Durability::DEFAULT;
+}
+
 CacheProtocol::CacheProtocol()
+    : m_Message( NULL ),
+      m_Pool( NULL )
 {}
 
 CacheProtocol::~CacheProtocol()
-{}
+{
+    this->discard();
+}
 
-void CacheProtocol::init()
+void CacheProtocol::init( CacheMessagePool * pool )
 {
     m_Message = NULL;
+    m_Pool = pool;
 }
 
 void CacheProtocol::clear()
@@ -30,6 +163,22 @@ void CacheProtocol::clear()
     m_Message = NULL;
 }
 
+void CacheProtocol::discard()
+{
+    if ( m_Message != NULL )
+    {
+        if ( m_Pool != NULL )
+        {
+            m_Pool->recycle( m_Message );
+        }
+        else
+        {
+            delete m_Message;
+        }
+        m_Message = NULL;
+    }
+}
+
 CacheMessage * CacheProtocol::getMessage() const
 {
     return m_Message;
@@ -41,184 +190,501 @@ int32_t CacheProtocol::decode( const char * buffer, uint32_t nbytes )
 
     if ( m_Message == NULL )
     {
-        char * line = getline( buffer, nbytes, length );
-        if ( line == NULL )
+        // 命令行以\r\n结尾, 兼容只有\n的情况
+        const char * eol = (const char *)memchr( buffer, '\n', nbytes );
+        if ( eol == NULL )
         {
             return 0;
         }
 
-        char * params = line;
-        char * cmd = strsep( &params, " " );
+        const char * end = eol;
+        if ( end > buffer && *(end-1) == '\r' )
+        {
+            --end;
+        }
+        length = eol - buffer + 1;
+
+        m_Message = m_Pool != NULL ? m_Pool->acquire() : new CacheMessage;
+        this->parse( buffer, end );
+    }
+
+    // 数据块直接追加到预留的内存中
+    CacheItem * item = m_Message->getItem();
+    if ( item != NULL && m_Message->getError() == NULL && nbytes > (uint32_t)length )
+    {
+        const char * buf = buffer + length;
+        uint32_t nleft = nbytes - length;
+        uint32_t bytes = item->getValueCapacity() - item->getValueSize();
 
-        if ( cmd == NULL )
+        if ( bytes > 0 )
         {
-            return 0;
+            bytes = bytes > nleft ? nleft : bytes;
+            item->appendValue( buf, bytes );
+
+            length += bytes;
+
+            // 检查DataChunk
+            if ( m_Message->isComplete()
+                    && !m_Message->checkDataChunk() )
+            {
+                m_Message->setError("CLIENT_ERROR bad data chunk");
+            }
+        }
+    }
+
+    return length;
+}
+
+void CacheProtocol::parse( const char * line, const char * end )
+{
+    Token cmd = { line, 0 };
+    const char * p = line;
+
+    next_token( p, end, cmd );
+    m_Message->setCmd( cmd.data, cmd.size );
+
+    if ( IS_TOKEN( cmd, "add" ) || IS_TOKEN( cmd, "set" )
+            || IS_TOKEN( cmd, "replace" ) || IS_TOKEN( cmd, "cas" )
+            || IS_TOKEN( cmd, "append" ) || IS_TOKEN( cmd, "prepend" ) )
+    {
+        // 协议定义
+        // [key] [flags] [expire] [bytes] <casunique> <--durability=mode>\r\n
+        // fields说明如下:
+        //      0 - key
+        //      1 - flags
+        //      2 - expire
+        //      3 - value size
+        //      4 - cas(可选)
+        //      5 - 持久化方式(可选), --durability=sync/group/async
+
+        uint64_t bytes = 0;
+        int32_t nfields = 0;
+        Token fields[ 6 ];
+
+        while ( nfields < 6 && next_token( p, end, fields[nfields] ) )
+        {
+            ++nfields;
         }
 
-        m_Message = new CacheMessage;
-        m_Message->setCmd( cmd );
+        // 持久化方式总是在最后
+        bool valid = true;
+        if ( nfields > 4 && is_option( fields[nfields-1] ) )
+        {
+            int8_t durability = parse_durability( fields[nfields-1] );
+            valid = ( durability != Durability::DEFAULT );
+            --nfields;
+            m_Message->setDurability( durability );
+        }
 
-        if ( strcasecmp( cmd, "add" ) == 0 || strcasecmp( cmd, "set" ) == 0
-                || strcasecmp( cmd, "replace" ) == 0 || strcasecmp( cmd, "cas" ) == 0
-                || strcasecmp( cmd, "append" ) == 0 || strcasecmp( cmd, "prepend" ) == 0 )
+        if ( valid && nfields >= 4
+                && fields[0].size <= eMaxKeyLength && !is_option( fields[0] )
+                && parse_uint( fields[3], bytes ) && bytes < 0xfffffff0ULL )
         {
-            // 协议定义
-            // [key] [flags] [expire] [bytes] <casunique>\r\n
-            // fields说明如下:
-            //      0 - key
-            //      1 - flags
-            //      2 - expire
-            //      3 - value size
-            //      4 - cas(可选)
-
-            int32_t nfields = 0;
-            char * fields[ 5 ] = { 0 };
-
-            const char * sep = " ";
-            char * word = NULL, * brkt = NULL;
-            for ( word = strtok_r(params, sep, &brkt);
-                    word;
-                    word = strtok_r(NULL, sep, &brkt) )
+            // key datasize 合法
+            CacheItem * item = m_Message->fetchItem();
+            item->setKey( fields[0].data, fields[0].size );
+            item->reserveValue( (uint32_t)bytes + 2 );     // DataChunk\r\n
+
+            if ( !IS_TOKEN( fields[1], "0" ) )
+            {
+                LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : the %s-%s not support the Flags feature .\n",
+                        m_Message->getCmd(), item->getKey().c_str(), __APPNAME__, __APPVERSION__ );
+            }
+            if ( !IS_TOKEN( fields[2], "0" ) )
+            {
+                LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : this %s-%s not support the ExpireTime feature .\n",
+                        m_Message->getCmd(), item->getKey().c_str(), __APPNAME__, __APPVERSION__ );
+            }
+            if ( nfields == 5 )
             {
-                fields[nfields++] = word;
+                LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : this %s-%s not support the CasUnique feature .\n",
+                        m_Message->getCmd(), item->getKey().c_str(), __APPNAME__, __APPVERSION__ );
             }
 
-            if ( nfields >= 4
-                    && fields[0] != NULL && fields[3] != NULL )
+            // TODO: cas
+        }
+        else
+        {
+            m_Message->setError( "CLIENT_ERROR bad command line format" );
+        }
+    }
+    else if ( IS_TOKEN( cmd, "get" ) || IS_TOKEN( cmd, "gets" ) )
+    {
+        // [cmd] [key1] [key2] [key3] ... [keyn] <--limit=count> <--maxstale=msecs>
+
+        Token key;
+        uint64_t value = 0;
+        bool options = false;
+        while ( next_token( p, end, key ) )
+        {
+            if ( is_option( key ) )
             {
-                // key datasize 合法
-                m_Message->fetchItem()->setKey( fields[0] );
-                m_Message->fetchItem()->setValueCapacity( atoi(fields[3]) + 2 );     // DataChunk\r\n
+                options = true;
 
-                if ( fields[ 1 ] != NULL )
-                {
-                    LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : the %s-%s not support the Flags feature .\n",
-                            cmd, fields[0], __APPNAME__, __APPVERSION__ );
-                }
-                if ( fields[ 2 ] != NULL )
+                // 通配符查询最多返回的个数
+                if ( PARSE_OPTION( key, "limit", value ) )
                 {
-                    LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : this %s-%s not support the ExpireTime feature .\n",
-                            cmd, fields[0], __APPNAME__, __APPVERSION__ );
+                    m_Message->setLimit( value > 0xffffffffULL ? 0xffffffffU : (uint32_t)value );
+                    continue;
                 }
-                if ( nfields == 5 && fields[4] != NULL )
+                // 能接受的数据延迟
+                if ( PARSE_OPTION( key, "maxstale", value ) )
                 {
-                    LOG_WARN( "CacheProtocol::decode(CMD:'%s', KEY:'%s') : this %s-%s not support the CasUnique feature .\n",
-                            cmd, fields[0], __APPNAME__, __APPVERSION__ );
+                    m_Message->setMaxStale( value > 0xffffffffULL ? 0xffffffffU : (uint32_t)value );
+                    continue;
                 }
 
-                // TODO: cas
+                m_Message->setError( "CLIENT_ERROR bad command line format" );
+                break;
             }
-            else
+
+            // 选项之后不能再有KEY
+            if ( options || key.size > eMaxKeyLength )
             {
                 m_Message->setError( "CLIENT_ERROR bad command line format" );
+                break;
             }
+
+            m_Message->addKey( key.data, key.size );
         }
-        else if ( strcasecmp( cmd, "get" ) == 0 || strcasecmp( cmd, "gets" ) == 0 )
-        {
-            // [cmd] [key1] [key2] [key3] ... [keyn]
+    }
+    else if ( IS_TOKEN( cmd, "incr" ) || IS_TOKEN( cmd, "decr" ) )
+    {
+        // [key] [value] <--durability=mode>
 
-            const char * sep = " ";
-            char * word = NULL, *brkt = NULL;
-            for ( word = strtok_r(params, sep, &brkt);
-                    word;
-                    word = strtok_r(NULL, sep, &brkt) )
+        uint64_t delta = 0;
+        Token key, value, option;
+
+        if ( next_token( p, end, key ) && key.size <= eMaxKeyLength && !is_option( key )
+                && next_token( p, end, value ) && parse_uint( value, delta ) )
+        {
+            m_Message->fetchItem()->setKey( key.data, key.size );
+            m_Message->setDelta( (uint32_t)delta );
+            if ( next_token( p, end, option ) && is_option( option ) )
             {
-                m_Message->addKey( word );
+                int8_t durability = parse_durability( option );
+                if ( durability == Durability::DEFAULT )
+                {
+                    m_Message->setError("CLIENT_ERROR bad command line format");
+                }
+                m_Message->setDurability( durability );
             }
         }
-        else if ( strcasecmp( cmd, "incr" ) == 0 || strcasecmp( cmd, "decr" ) == 0 )
+        else
         {
-            char key[ 256 ] = { 0 };
-            char bytes[ 16 ] = { 0 };
-
-            int32_t rc = sscanf( params, "%250s %15s", key, bytes );
-            if ( rc == 2 && key[0] != '\0' )
-            {
-                m_Message->fetchItem()->setKey( key );
-                m_Message->setDelta( (uint32_t)atoi(bytes) );
-            }
-            else
-            {
-                m_Message->setError("CLIENT_ERROR bad command line format");
-            }
+            m_Message->setError("CLIENT_ERROR bad command line format");
         }
-        else if ( strcasecmp( cmd, "delete" ) == 0 )
+    }
+    else if ( IS_TOKEN( cmd, "delete" ) )
+    {
+        // [key] <expire> <--durability=mode>
+
+        Token key, option;
+
+        if ( next_token( p, end, key ) && key.size <= eMaxKeyLength && !is_option( key ) )
         {
-            char key[ 256 ] = { 0 };
-            char expire[ 16 ] = { 0 };
+            m_Message->fetchItem()->setKey( key.data, key.size );
 
-            sscanf( params, "%250s %15s", key, expire );
-            if ( key[0] != '\0' )
-            {
-                m_Message->fetchItem()->setKey( key );
-            }
-            else
+            // 持久化方式在最后
+            int8_t durability = Durability::DEFAULT;
+            while ( next_token( p, end, option ) )
             {
-                m_Message->setError("CLIENT_ERROR bad command line format");
+                if ( !is_option( option ) )
+                {
+                    continue;
+                }
+
+                durability = parse_durability( option );
+                if ( durability == Durability::DEFAULT )
+                {
+                    m_Message->setError("CLIENT_ERROR bad command line format");
+                    break;
+                }
             }
+            m_Message->setDurability( durability );
+        }
+        else
+        {
+            m_Message->setError("CLIENT_ERROR bad command line format");
         }
-
-        free ( line );
     }
-
-    if ( m_Message != NULL && m_Message->getError() == NULL && nbytes > (uint32_t)length )
+    else if ( IS_TOKEN( cmd, "stats" ) )
     {
-        char * buf = (char *)buffer + length;
-        size_t nleft = nbytes - length;
-        size_t bytes = m_Message->fetchItem()->getValueCapacity() - m_Message->fetchItem()->getValueSize();
+        // <group>
 
-        if ( bytes > 0 )
+        Token group;
+        if ( next_token( p, end, group ) && group.size <= eMaxKeyLength )
         {
-            bytes = bytes > nleft ? nleft : bytes;
-            m_Message->fetchItem()->appendValue( std::string(buf, bytes) );
-
-            length += bytes;
-
-            // 检查DataChunk
-            if ( m_Message->isComplete()
-                    && !m_Message->checkDataChunk() )
-            {
-                m_Message->setError("CLIENT_ERROR bad data chunk");
-            }
+            m_Message->addKey( group.data, group.size );
         }
     }
+}
 
-    return length;
+/////////////////////////////////////////////////////////////////////////////////
+
+BinaryProtocol::BinaryProtocol()
+    : m_Message( NULL ),
+      m_Pool( NULL )
+{}
+
+BinaryProtocol::~BinaryProtocol()
+{
+    this->discard();
 }
 
+void BinaryProtocol::init( CacheMessagePool * pool )
+{
+    m_Message = NULL;
+    m_Pool = pool;
+}
 
-char * CacheProtocol::getline( const char * buffer, uint32_t nbytes, int32_t & length )
+void BinaryProtocol::clear()
 {
-    uint32_t len = 0;
-    char * line = NULL;
+    m_Message = NULL;
+}
 
-    for ( len = 0; len < nbytes; ++len )
+void BinaryProtocol::discard()
+{
+    if ( m_Message != NULL )
     {
-        if ( buffer[ len ] == '\r'
-                && buffer[ len+1 ] == '\n' )
+        if ( m_Pool != NULL )
         {
-            break;
+            m_Pool->recycle( m_Message );
+        }
+        else
+        {
+            delete m_Message;
         }
+        m_Message = NULL;
+    }
+}
+
+CacheMessage * BinaryProtocol::getMessage() const
+{
+    return m_Message;
+}
+
+int32_t BinaryProtocol::decode( const char * buffer, uint32_t nbytes )
+{
+    if ( nbytes < eHeaderLength )
+    {
+        return 0;
     }
 
-    if ( len == nbytes )
+    // 包头
+    // 0 magic, 1 opcode, 2-3 key length, 4 extras length, 5 data type,
+    // 6-7 vbucket, 8-11 body length, 12-15 opaque, 16-23 cas
+    uint16_t nkey = 0;
+    uint32_t nbody = 0, opaque = 0;
+    const uint8_t * header = (const uint8_t *)buffer;
+
+    if ( header[0] != eMagic_Request )
     {
-        return NULL;
+        return -1;
     }
 
-    line = (char *)::malloc( len + 1 );
-    if ( line == NULL )
+    std::memcpy( &nkey, header+2, 2 );
+    std::memcpy( &nbody, header+8, 4 );
+    std::memcpy( &opaque, header+12, 4 );       // opaque原样带回, 不需要转换字节序
+    nkey = be16toh( nkey );
+    nbody = be32toh( nbody );
+
+    if ( nbody > eMaxBodyLength
+            || (uint32_t)header[4] + nkey > nbody )
     {
-        return NULL;
+        return -1;
+    }
+
+    // 等待完整的包
+    if ( nbytes < eHeaderLength + nbody )
+    {
+        return 0;
+    }
+
+    const char * extras = buffer + eHeaderLength;
+    const char * key = extras + header[4];
+    const char * value = key + nkey;
+
+    m_Message = m_Pool != NULL ? m_Pool->acquire() : new CacheMessage;
+    m_Message->setBinary( header[1], opaque, false );
+    this->parse( header[1], extras, header[4], key, nkey, value, nbody - header[4] - nkey );
+
+    return eHeaderLength + nbody;
+}
+
+void BinaryProtocol::parse( uint8_t opcode, const char * extras, uint8_t nextras,
+        const char * key, uint16_t nkey, const char * value, uint32_t nvalue )
+{
+    bool quiet = false;
+
+    switch ( opcode )
+    {
+        case eOpcode_GetQ :
+        case eOpcode_GetKQ :
+            quiet = true;
+        case eOpcode_Get :
+        case eOpcode_GetK :
+            {
+                m_Message->setCmd( "get", 3 );
+                if ( nkey == 0 || nkey > eMaxKeyLength )
+                {
+                    m_Message->setError( "Invalid arguments" );
+                    break;
+                }
+                m_Message->addKey( key, nkey );
+
+                // 扩展, extras是能接受的数据延迟(毫秒)
+                if ( nextras == 4 )
+                {
+                    uint32_t msecs = 0;
+                    std::memcpy( &msecs, extras, 4 );
+                    m_Message->setMaxStale( be32toh( msecs ) );
+                }
+            }
+            break;
+
+        case eOpcode_SetQ :
+        case eOpcode_AddQ :
+        case eOpcode_ReplaceQ :
+            quiet = true;
+        case eOpcode_Set :
+        case eOpcode_Add :
+        case eOpcode_Replace :
+            {
+                // extras: flags(4) expiration(4)
+                if ( opcode == eOpcode_Set || opcode == eOpcode_SetQ )
+                {
+                    m_Message->setCmd( "set", 3 );
+                }
+                else if ( opcode == eOpcode_Add || opcode == eOpcode_AddQ )
+                {
+                    m_Message->setCmd( "add", 3 );
+                }
+                else
+                {
+                    m_Message->setCmd( "replace", 7 );
+                }
+
+                if ( nextras != 8 || nkey == 0 || nkey > eMaxKeyLength )
+                {
+                    m_Message->setError( "Invalid arguments" );
+                    break;
+                }
+
+                CacheItem * item = m_Message->fetchItem();
+                item->setKey( key, nkey );
+                item->reserveValue( nvalue );
+                item->appendValue( value, nvalue );
+            }
+            break;
+
+        case eOpcode_DeleteQ :
+            quiet = true;
+        case eOpcode_Delete :
+            {
+                m_Message->setCmd( "delete", 6 );
+                if ( nextras != 0 || nkey == 0 || nkey > eMaxKeyLength )
+                {
+                    m_Message->setError( "Invalid arguments" );
+                    break;
+                }
+                m_Message->fetchItem()->setKey( key, nkey );
+            }
+            break;
+
+        case eOpcode_IncrementQ :
+        case eOpcode_DecrementQ :
+            quiet = true;
+        case eOpcode_Increment :
+        case eOpcode_Decrement :
+            {
+                // extras: delta(8) initial(8) expiration(4)
+                if ( opcode == eOpcode_Increment || opcode == eOpcode_IncrementQ )
+                {
+                    m_Message->setCmd( "incr", 4 );
+                }
+                else
+                {
+                    m_Message->setCmd( "decr", 4 );
+                }
+
+                if ( nextras != 20 || nkey == 0 || nkey > eMaxKeyLength )
+                {
+                    m_Message->setError( "Invalid arguments" );
+                    break;
+                }
+
+                uint64_t delta = 0;
+                std::memcpy( &delta, extras, 8 );
+                m_Message->fetchItem()->setKey( key, nkey );
+                m_Message->setDelta( be64toh( delta ) );
+            }
+            break;
+
+        case eOpcode_QuitQ :
+            quiet = true;
+        case eOpcode_Quit :
+            m_Message->setCmd( "quit", 4 );
+            break;
+
+        case eOpcode_Noop :
+            m_Message->setCmd( "noop", 4 );
+            break;
+
+        case eOpcode_Version :
+            m_Message->setCmd( "version", 7 );
+            break;
+
+        case eOpcode_Stat :
+            // KEY是统计的分组
+            m_Message->setCmd( "stats", 5 );
+            if ( nkey > 0 && nkey <= eMaxKeyLength )
+            {
+                m_Message->addKey( key, nkey );
+            }
+            break;
+
+        default :
+            // 工作线程回应UnknownCommand
+            m_Message->setCmd( "", 0 );
+            break;
+    }
+
+    if ( quiet )
+    {
+        m_Message->setBinary( opcode, m_Message->getOpaque(), true );
     }
+}
 
-    //
-    ::memcpy( line, buffer, len );
-    //
-    length = len + 2;
-    line[ len ] = '\0';
+void BinaryProtocol::encode( std::string & buf, const CacheMessage * msg, uint16_t status,
+        const Slice & extras, const Slice & key, const Slice & value )
+{
+    char header[ eHeaderLength ] = { 0 };
+
+    uint16_t nkey = htobe16( (uint16_t)key.size() );
+    uint16_t nstatus = htobe16( status );
+    uint32_t nbody = htobe32( (uint32_t)( extras.size() + key.size() + value.size() ) );
+    uint32_t opaque = msg->getOpaque();
+
+    header[0] = (char)eMagic_Response;
+    header[1] = (char)msg->getOpcode();
+    std::memcpy( header+2, &nkey, 2 );
+    header[4] = (char)extras.size();
+    std::memcpy( header+6, &nstatus, 2 );
+    std::memcpy( header+8, &nbody, 4 );
+    std::memcpy( header+12, &opaque, 4 );
+
+    // 包头和包体一次拼接到同一块内存中, 由一次send发出
+    buf.reserve( buf.size() + sizeof(header) + extras.size() + key.size() + value.size() );
+    buf.append( header, sizeof(header) );
+    buf.append( extras.data(), extras.size() );
+    buf.append( key.data(), key.size() );
+    buf.append( value.data(), value.size() );
+}
 
-    return line;
+void BinaryProtocol::encode( std::string & buf, const CacheMessage * msg, uint16_t status, const Slice & value )
+{
+    encode( buf, msg, status, Slice(), Slice(), value );
 }
 
 /////////////////////////////////////////////////////////////////////////////////
@@ -236,6 +702,18 @@ SSMessage * GeneralDecoder( sid_t sid, const SSHead & head, const Slice & body )
         case eSSCommand_SyncResponse :
             msg = new SyncResponse();
             break;
+
+        case eSSCommand_SyncBatch :
+            msg = new SyncBatchResponse();
+            break;
+
+        case eSSCommand_SyncAck :
+            msg = new SyncAckCommand();
+            break;
+
+        case eSSCommand_SyncStatus :
+            msg = new SyncStatusCommand();
+            break;
     }
 
     if ( msg == NULL )
@@ -356,6 +834,8 @@ Slice SyncRequest::encode()
     // BODY
     pack.encode( lastseq );
     pack.encode( lastkey );
+    pack.encode( bounds );
+    pack.encode( lastkeys );
 
     // 计算长度
     space = pack.data();
@@ -376,6 +856,96 @@ bool SyncRequest::decode( const Slice & data )
             data.data(), data.size() );
     unpack.decode( lastseq );
     unpack.decode( lastkey );
+    // 兼容没有区间的请求
+    if ( unpack.position() < data.size() )
+    {
+        unpack.decode( bounds );
+        unpack.decode( lastkeys );
+    }
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+SyncAckCommand::SyncAckCommand()
+    : seq( 0ULL ),
+      bytes( 0ULL )
+{
+    head.cmd = eSSCommand_SyncAck;
+}
+
+SyncAckCommand::~SyncAckCommand()
+{}
+
+Slice SyncAckCommand::encode()
+{
+    StreamBuf pack( 64, sizeof(SSHead) );
+
+    // BODY
+    pack.encode( seq );
+    pack.encode( bytes );
+
+    // 计算长度
+    space = pack.data();
+    length = pack.length();
+    head.size = pack.size();
+
+    // 重置并且编码HEAD
+    pack.reset();
+    pack.encode( head.cmd );
+    pack.encode( head.size );
+
+    return pack.slice();
+}
+
+bool SyncAckCommand::decode( const Slice & data )
+{
+    StreamBuf unpack(
+            data.data(), data.size() );
+    unpack.decode( seq );
+    unpack.decode( bytes );
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+
+SyncStatusCommand::SyncStatusCommand()
+    : lastseq( 0ULL ),
+      timestamp( 0LL )
+{
+    head.cmd = eSSCommand_SyncStatus;
+}
+
+SyncStatusCommand::~SyncStatusCommand()
+{}
+
+Slice SyncStatusCommand::encode()
+{
+    StreamBuf pack( 64, sizeof(SSHead) );
+
+    // BODY
+    pack.encode( lastseq );
+    pack.encode( timestamp );
+
+    // 计算长度
+    space = pack.data();
+    length = pack.length();
+    head.size = pack.size();
+
+    // 重置并且编码HEAD
+    pack.reset();
+    pack.encode( head.cmd );
+    pack.encode( head.size );
+
+    return pack.slice();
+}
+
+bool SyncStatusCommand::decode( const Slice & data )
+{
+    StreamBuf unpack(
+            data.data(), data.size() );
+    unpack.decode( lastseq );
+    unpack.decode( timestamp );
     return true;
 }
 
@@ -421,4 +991,97 @@ bool SyncResponse::decode( const Slice & data )
 
     return true;
 }
+/////////////////////////////////////////////////////////////////////////////////////////
+
+SyncBatchResponse::SyncBatchResponse()
+    : count( 0 )
+{
+    head.cmd = eSSCommand_SyncBatch;
+}
+
+SyncBatchResponse::~SyncBatchResponse()
+{}
+
+void SyncBatchResponse::append( uint8_t method, const std::string & binlog, const std::string & value )
+{
+    char buf[ 16 ];
+    char * end = NULL;
+
+    entries.push_back( (char)method );
+    end = utils::Varint::encode( buf, (uint32_t)binlog.size() );
+    entries.append( buf, end - buf );
+    entries.append( binlog );
+    end = utils::Varint::encode( buf, (uint32_t)value.size() );
+    entries.append( buf, end - buf );
+    entries.append( value );
+
+    ++count;
+}
+
+bool SyncBatchResponse::next( size_t & offset, uint8_t & method, Slice & binlog, Slice & value ) const
+{
+    uint32_t len = 0;
+    const char * p = entries.data() + offset;
+    const char * limit = entries.data() + entries.size();
+
+    if ( p >= limit )
+    {
+        return false;
+    }
+
+    method = (uint8_t)*p++;
+
+    p = utils::Varint::decode( p, limit, len );
+    if ( p == NULL || (size_t)( limit - p ) < len )
+    {
+        return false;
+    }
+    binlog = Slice( p, len );
+    p += len;
+
+    p = utils::Varint::decode( p, limit, len );
+    if ( p == NULL || (size_t)( limit - p ) < len )
+    {
+        return false;
+    }
+    value = Slice( p, len );
+    p += len;
+
+    offset = p - entries.data();
+    return true;
+}
+
+Slice SyncBatchResponse::encode()
+{
+    StreamBuf pack( entries.size() + 64, sizeof(SSHead) );
+
+    // BODY
+    pack.encode( count );
+    pack.append( entries );
+
+    // 计算长度
+    space = pack.data();
+    length = pack.length();
+    head.size = pack.size();
+
+    // 重置并且编码HEAD
+    pack.reset();
+    pack.encode( head.cmd );
+    pack.encode( head.size );
+
+    return pack.slice();
+}
+
+bool SyncBatchResponse::decode( const Slice & data )
+{
+    StreamBuf unpack(
+            data.data(), data.size() );
+    if ( !unpack.decode( count ) )
+    {
+        return false;
+    }
+
+    entries.assign( data.data() + unpack.position(), data.size() - unpack.position() );
+    return true;
+}
 }
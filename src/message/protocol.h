@@ -4,6 +4,9 @@
 
 #include <stdint.h>
 
+#include <string>
+#include <vector>
+
 #include "utils/slice.h"
 
 #include "message.h"
@@ -19,8 +22,11 @@ public :
     ~CacheProtocol();
 
 public :
-    void init();
+    // pool - 消息池, NULL表示每次都分配新的消息
+    void init( CacheMessagePool * pool = NULL );
     void clear();
+    // 丢弃未解析完的消息
+    void discard();
 
     // 获取解析得到的消息
     CacheMessage * getMessage() const;
@@ -29,14 +35,111 @@ public :
     int32_t decode( const char * buffer, uint32_t nbytes );
 
 private :
-    // length - 包括换行符的长度
-    char * getline( const char * buffer, uint32_t nbytes, int32_t & length );
+    enum
+    {
+        eMaxKeyLength   = 250,      // KEY的最大长度
+    };
+
+    // 解析命令行, 不包括换行符
+    void parse( const char * line, const char * end );
 
 private :
     CacheMessage *        m_Message;
+    CacheMessagePool *    m_Pool;
 
 };
 
+//
+// memcache二进制协议
+// 包头24字节, 网络字节序, 包体依次是extras, key, value
+//
+class BinaryProtocol
+{
+public :
+    BinaryProtocol();
+    ~BinaryProtocol();
+
+    enum
+    {
+        eMagic_Request      = 0x80,
+        eMagic_Response     = 0x81,
+        eHeaderLength       = 24,
+        eMaxKeyLength       = 250,                      // KEY的最大长度
+        eMaxBodyLength      = ( 64 * 1024 * 1024 ),     // 包体的最大长度
+    };
+
+    // 操作码
+    enum
+    {
+        eOpcode_Get         = 0x00,
+        eOpcode_Set         = 0x01,
+        eOpcode_Add         = 0x02,
+        eOpcode_Replace     = 0x03,
+        eOpcode_Delete      = 0x04,
+        eOpcode_Increment   = 0x05,
+        eOpcode_Decrement   = 0x06,
+        eOpcode_Quit        = 0x07,
+        eOpcode_GetQ        = 0x09,
+        eOpcode_Noop        = 0x0a,
+        eOpcode_Version     = 0x0b,
+        eOpcode_GetK        = 0x0c,
+        eOpcode_GetKQ       = 0x0d,
+        eOpcode_Stat        = 0x10,
+        eOpcode_SetQ        = 0x11,
+        eOpcode_AddQ        = 0x12,
+        eOpcode_ReplaceQ    = 0x13,
+        eOpcode_DeleteQ     = 0x14,
+        eOpcode_IncrementQ  = 0x15,
+        eOpcode_DecrementQ  = 0x16,
+        eOpcode_QuitQ       = 0x17,
+    };
+
+    // 状态码
+    enum
+    {
+        eStatus_OK                  = 0x0000,
+        eStatus_KeyNotFound         = 0x0001,
+        eStatus_KeyExists           = 0x0002,
+        eStatus_ValueTooLarge       = 0x0003,
+        eStatus_InvalidArguments    = 0x0004,
+        eStatus_NotStored           = 0x0005,
+        eStatus_NonNumeric          = 0x0006,
+        eStatus_NotMyVbucket        = 0x0007,   // 备机的数据过旧, 需要到主机读取
+        eStatus_UnknownCommand      = 0x0081,
+        eStatus_OutOfMemory         = 0x0082,
+        eStatus_InternalError       = 0x0084,
+    };
+
+public :
+    void init( CacheMessagePool * pool = NULL );
+    void clear();
+    void discard();
+
+    // 获取解析得到的消息
+    CacheMessage * getMessage() const;
+
+    // 解析消息, 等待完整的包
+    // 返回-1表示数据流已经无法解析
+    int32_t decode( const char * buffer, uint32_t nbytes );
+
+    // 编码回应, 包头和包体依次追加到buf中
+    static void encode( std::string & buf, const CacheMessage * msg, uint16_t status,
+            const Slice & extras, const Slice & key, const Slice & value );
+
+    // 只有状态码和可选的错误信息
+    static void encode( std::string & buf, const CacheMessage * msg, uint16_t status,
+            const Slice & value = Slice() );
+
+private :
+    // 解析包体
+    void parse( uint8_t opcode, const char * extras, uint8_t nextras,
+            const char * key, uint16_t nkey, const char * value, uint32_t nvalue );
+
+private :
+    CacheMessage *        m_Message;
+    CacheMessagePool *    m_Pool;
+};
+
 // 服务器间通信
 
 // 命令
@@ -48,6 +151,9 @@ enum
 
     eSSCommand_SyncRequest  = 0x0101,   // 同步请求
     eSSCommand_SyncResponse = 0x0102,   // 同步回应
+    eSSCommand_SyncBatch    = 0x0103,   // 批量同步回应
+    eSSCommand_SyncAck      = 0x0104,   // 备机确认
+    eSSCommand_SyncStatus   = 0x0105,   // 主机的同步位置
 };
 
 // 消息基类
@@ -101,6 +207,39 @@ public :
 public :
     uint64_t        lastseq;
     std::string     lastkey;
+    // 并行复制中断时, 每个区间的起始KEY和已经复制的KEY
+    std::vector<std::string>    bounds;
+    std::vector<std::string>    lastkeys;
+};
+
+// 备机确认, 同步状态写入之后发送
+struct SyncAckCommand : SSMessage
+{
+public :
+    SyncAckCommand();
+    virtual ~SyncAckCommand();
+
+    virtual Slice encode();
+    virtual bool decode( const Slice & data );
+
+public :
+    uint64_t        seq;        // 已经写入的最后一条binlog
+    uint64_t        bytes;      // 本次连接已经写入的同步消息的字节数, 主机据此控制发送窗口
+};
+
+// 主机定期发送当前提交的位置, 备机据此计算数据的新旧
+struct SyncStatusCommand : SSMessage
+{
+public :
+    SyncStatusCommand();
+    virtual ~SyncStatusCommand();
+
+    virtual Slice encode();
+    virtual bool decode( const Slice & data );
+
+public :
+    uint64_t        lastseq;    // 主机最后提交的binlog
+    int64_t         timestamp;  // 主机发送的时间(毫秒)
 };
 
 // 同步回应
@@ -119,5 +258,34 @@ public :
     std::string     value;
 };
 
+//
+// 批量同步回应, 一个消息中带有多条同步记录
+// 每条记录:
+//      method(1) + varint(binlog长度) + binlog + varint(value长度) + value
+//
+struct SyncBatchResponse : SSMessage
+{
+public :
+    SyncBatchResponse();
+    virtual ~SyncBatchResponse();
+
+    virtual Slice encode();
+    virtual bool decode( const Slice & data );
+
+public :
+    // 追加一条记录
+    void append( uint8_t method, const std::string & binlog, const std::string & value );
+    // 解析offset处的记录, 并且移动到下一条记录
+    // 没有记录或者格式错误时返回false
+    bool next( size_t & offset, uint8_t & method, Slice & binlog, Slice & value ) const;
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return entries.size(); }
+
+public :
+    uint32_t        count;      // 记录个数
+    std::string     entries;    // 连续存放的记录
+};
+
 }
 #endif
@@ -1,5 +1,6 @@
 
 #include <map>
+#include <string.h>
 #include <unistd.h>
 
 #include "utils/integer.h"
@@ -24,6 +25,18 @@ Binlog::Binlog( uint64_t seq, char cmd, const std::string & key )
 	m_Buf.append( key.c_str(), key.size() );
 }
 
+Binlog::Binlog( uint64_t seq, char cmd, const std::string & key, const std::string & value )
+{
+    uint32_t keylen = key.size();
+
+    m_Buf.reserve( HEADER_LEN + sizeof(uint32_t) + key.size() + value.size() );
+    m_Buf.append( (char *)(&seq), sizeof(uint64_t) );
+	m_Buf.push_back( cmd | VALUE_FLAG );
+	m_Buf.append( (char *)(&keylen), sizeof(uint32_t) );
+	m_Buf.append( key.data(), key.size() );
+	m_Buf.append( value.data(), value.size() );
+}
+
 uint64_t Binlog::seq() const
 {
 	return *( (uint64_t *)( m_Buf.data() ) );
@@ -31,14 +44,51 @@ uint64_t Binlog::seq() const
 
 char Binlog::cmd() const
 {
-	return m_Buf[ sizeof(uint64_t) ];
+	return m_Buf[ sizeof(uint64_t) ] & ~VALUE_FLAG;
+}
+
+bool Binlog::hasValue() const
+{
+	return m_Buf.size() > HEADER_LEN && ( m_Buf[ sizeof(uint64_t) ] & VALUE_FLAG );
 }
 
 const Slice Binlog::key() const
 {
+	if ( this->hasValue() )
+    {
+        uint32_t keylen = *( (uint32_t *)( m_Buf.data() + HEADER_LEN ) );
+        return Slice( m_Buf.data() + HEADER_LEN + sizeof(uint32_t), keylen );
+    }
+
 	return Slice( m_Buf.data() + HEADER_LEN, m_Buf.size() - HEADER_LEN );
 }
 
+const Slice Binlog::value() const
+{
+	if ( !this->hasValue() )
+    {
+        return Slice();
+    }
+
+    size_t offset = HEADER_LEN + sizeof(uint32_t)
+        + *( (uint32_t *)( m_Buf.data() + HEADER_LEN ) );
+	return Slice( m_Buf.data() + offset, m_Buf.size() - offset );
+}
+
+const std::string Binlog::repr() const
+{
+	if ( !this->hasValue() )
+    {
+        return m_Buf;
+    }
+
+    Slice key = this->key();
+	std::string buf( m_Buf.data(), HEADER_LEN );
+	buf[ sizeof(uint64_t) ] = this->cmd();
+	buf.append( key.data(), key.size() );
+	return buf;
+}
+
 int Binlog::load( const leveldb::Slice & value )
 {
 	if( value.size() < HEADER_LEN )
@@ -46,6 +96,21 @@ int Binlog::load( const leveldb::Slice & value )
 		return -1;
 	}
 
+    // 检查带有数据的binlog是否完整
+    if ( value[ sizeof(uint64_t) ] & VALUE_FLAG )
+    {
+        if ( value.size() < HEADER_LEN + sizeof(uint32_t) )
+        {
+            return -1;
+        }
+
+        uint32_t keylen = *( (uint32_t *)( value.data() + HEADER_LEN ) );
+        if ( value.size() < HEADER_LEN + sizeof(uint32_t) + keylen )
+        {
+            return -1;
+        }
+    }
+
     m_Buf.assign( value.data(), value.size() );
 	return 0;
 }
@@ -89,6 +154,15 @@ static inline std::string encode_seq_key( uint64_t seq )
 	return ret;
 }
 
+// 独立存储binlog时, 数据库中记录已经提交的binlog位置
+static inline std::string encode_watermark_key()
+{
+	std::string ret;
+	ret.push_back( DataType::META );
+	ret.append( "binlog" );
+	return ret;
+}
+
 static inline uint64_t decode_seq_key( const leveldb::Slice & key )
 {
 	uint64_t seq = 0;
@@ -101,13 +175,21 @@ static inline uint64_t decode_seq_key( const leveldb::Slice & key )
 	return seq;
 }
 
-BinlogQueue::BinlogQueue( LevelDBEngine * engine )
+BinlogQueue::BinlogQueue( LevelDBEngine * engine, uint32_t capacity, LevelDBEngine * logengine )
 {
     this->m_Engine = engine;
+    this->m_LogEngine = logengine != NULL ? logengine : engine;
 	this->m_MinSeq = 0;
 	this->m_LastSeq = 0;
 	this->m_TranSeq = 0;
-	this->m_Capacity = LOG_QUEUE_SIZE;
+	this->m_Capacity = capacity > 0 ? capacity : LOG_QUEUE_SIZE;
+	this->m_InlineValue = false;
+	this->m_CaptureValues = false;
+	this->m_CompactSeq = 0;
+	this->m_TrimCount = 0;
+	this->m_IndexMin = 0;
+	this->m_File = NULL;
+	this->m_IndexMax = 0;
 
 	Binlog log;
 	if( this->findLast( &log ) == 1 )
@@ -115,17 +197,28 @@ BinlogQueue::BinlogQueue( LevelDBEngine * engine )
 		this->m_LastSeq = log.seq();
 	}
 
-	if( this->m_LastSeq > LOG_QUEUE_SIZE )
+	// 独立存储时, 以数据库中的提交位置为准
+	if ( m_LogEngine != m_Engine )
+    {
+        this->recover();
+    }
+
+	if( this->m_LastSeq > m_Capacity )
     {
-		this->m_MinSeq = this->m_LastSeq - LOG_QUEUE_SIZE;
+		this->m_MinSeq = this->m_LastSeq - m_Capacity;
 	}
     else
     {
 		this->m_MinSeq = 0;
 	}
 
-	// TODO: use binary search to find out min_seq
-	if( this->findNext( this->m_MinSeq, &log ) == 1 )
+	// 二分查找, 不存在时(binlog不连续)再从leveldb中顺序查找
+	uint64_t minseq = this->searchMinSeq( this->m_MinSeq );
+	if ( minseq != 0 && this->get( minseq, &log ) == 1 )
+    {
+        this->m_MinSeq = minseq;
+    }
+	else if( this->findNext( this->m_MinSeq, &log ) == 1 )
     {
 		this->m_MinSeq = log.seq();
 	}
@@ -136,6 +229,14 @@ BinlogQueue::BinlogQueue( LevelDBEngine * engine )
 BinlogQueue::~BinlogQueue()
 {
 	m_Engine = NULL;
+	m_LogEngine = NULL;
+
+	if ( m_File != NULL )
+    {
+        m_File->close();
+        delete m_File;
+        m_File = NULL;
+    }
 	LOG_DEBUG( "BinlogQueue finalized.\n" );
 }
 
@@ -144,59 +245,168 @@ void BinlogQueue::begin()
     m_Engine->start();
 	m_TranSeq = m_LastSeq;
 	m_Engine->txn()->Clear();
+	m_Pending.clear();
+	m_PendingValues.clear();
+
+	// 只有追加分段文件或者有备机时才需要保留写入的数据
+	m_CaptureValues = m_File != NULL
+        || ( g_BackendSync != NULL && g_BackendSync->hasSlaves() );
+
+	if ( m_LogEngine != m_Engine )
+    {
+        m_LogEngine->start();
+        m_LogEngine->txn()->Clear();
+    }
 }
 
 void BinlogQueue::rollback()
 {
 	m_TranSeq = 0;
+	m_Pending.clear();
+	m_PendingValues.clear();
+	m_Engine->rollback();
+
+	if ( m_LogEngine != m_Engine )
+    {
+        m_LogEngine->rollback();
+    }
 }
 
-bool BinlogQueue::commit()
+bool BinlogQueue::commit( bool sync )
 {
-    bool ret = m_Engine->commit();
+    bool ret = true;
+
+    // 独立存储时, 先写binlog, 再写数据和binlog的提交位置
+    // 数据写入失败时, 多出的binlog会被下一次事务覆盖, 或者启动时删除
+    if ( m_LogEngine != m_Engine && m_TranSeq > m_LastSeq )
+    {
+        ret = m_LogEngine->commit( sync );
+        if ( ret )
+        {
+            m_Engine->set( encode_watermark_key(),
+                    std::string( (const char *)&m_TranSeq, sizeof(m_TranSeq) ) );
+        }
+    }
+
     if ( ret )
     {
+        ret = m_Engine->commit( sync );
+    }
+    if ( ret )
+    {
+        // 追加到分段文件, 整个事务编码后每个段只写入一次
+        if ( m_File != NULL )
+        {
+            for ( size_t i = 0; i < m_Pending.size(); ++i )
+            {
+                const Binlog & log = m_Pending[i];
+                m_File->append( log.seq(), log.cmd(), log.key(), m_PendingValues[i] );
+            }
+            m_File->flush();
+        }
+
+        this->publish();
+
         // 即时同步给备机
+        // 一次事务中的binlog合并成一个消息, 直接使用写入的数据,
+        // 由广播线程序列化一次后发送给所有的备机
         std::vector<uint64_t> slavesids;
-        if ( g_BackendSync != NULL )
+        if ( g_BackendSync != NULL && !m_Pending.empty() )
         {
             g_BackendSync->getSlaveSids( slavesids );
             if ( !slavesids.empty() )
             {
-                Binlog binlog;
-                if ( this->get( m_TranSeq, &binlog ) == 1 )
+                SyncBatchResponse * frame = new SyncBatchResponse();
+                for ( size_t i = 0; i < m_Pending.size(); ++i )
                 {
-                    for ( size_t i = 0; i < slavesids.size(); ++i )
+                    std::string value;
+                    const Binlog & log = m_Pending[i];
+                    if ( log.cmd() == BinlogCommand::SET )
                     {
-                        g_BackendSync->send( slavesids[i], binlog );
-                        LOG_DEBUG( "BinlogQueue::commit(sid:%llu, lastseq:%llu).\n", slavesids[i], m_TranSeq );
+                        this->value( i, value );
                     }
+                    frame->append( BinlogType::SYNC, log.repr(), value );
                 }
+
+                g_BackendSync->publish( m_TranSeq, frame );
+                LOG_DEBUG( "BinlogQueue::commit(seq:%llu-%llu) publish to %lu slaves.\n",
+                        m_LastSeq + 1, m_TranSeq, slavesids.size() );
             }
+
+            // 唤醒调度线程同步追赶中的备机
+            g_BackendSync->notify();
         }
+        m_Pending.clear();
+        m_PendingValues.clear();
 
-        m_LastSeq = m_TranSeq;
+        if ( m_TranSeq > m_LastSeq )
+        {
+            m_LastSeq = m_TranSeq;
+        }
         m_TranSeq = 0;
     }
 
-    // 判断binlog区间
-    if ( m_LastSeq > m_MinSeq + LOG_QUEUE_SIZE )
+	return ret;
+}
+
+void BinlogQueue::recover()
+{
+    std::string value;
+    uint64_t watermark = 0;
+
+    bool found = m_Engine->get( encode_watermark_key(), value )
+        && value.size() == sizeof(uint64_t);
+    if ( found )
     {
-        int ret = this->del( m_MinSeq );
-        if ( ret == 0 )
+        memcpy( &watermark, value.data(), sizeof(uint64_t) );
+    }
+
+    // binlog库为空, 接着数据库中之前的binlog编号
+    if ( m_LastSeq == 0 )
+    {
+        Binlog log;
+        if ( this->findLast( m_Engine, &log ) == 1 )
+        {
+            m_LastSeq = log.seq();
+        }
+        if ( watermark > m_LastSeq )
         {
-            m_MinSeq += 1;
+            m_LastSeq = watermark;
         }
+        return;
     }
 
-	return ret;
+    // 删除数据没有提交成功的binlog
+    if ( found && m_LastSeq > watermark )
+    {
+        LOG_WARN( "BinlogQueue::recover() : discard binlogs (%lu, %lu] .\n", watermark, m_LastSeq );
+        this->delRange( watermark + 1, m_LastSeq );
+        m_LastSeq = watermark;
+    }
 }
 
-void BinlogQueue::addLog( char cmd, const std::string & key )
+bool BinlogQueue::sync()
+{
+    // 先保证binlog落盘
+    if ( m_LogEngine != m_Engine && !m_LogEngine->sync() )
+    {
+        return false;
+    }
+
+    return m_Engine->sync();
+}
+
+void BinlogQueue::addLog( char cmd, const std::string & key, const std::string & value )
 {
 	m_TranSeq ++;
-	Binlog log( m_TranSeq, cmd, key );
-	m_Engine->set( encode_seq_key(m_TranSeq), log.repr() );
+	Binlog log = ( m_InlineValue && cmd == BinlogCommand::SET )
+        ? Binlog( m_TranSeq, cmd, key, value ) : Binlog( m_TranSeq, cmd, key );
+	m_LogEngine->set( encode_seq_key(m_TranSeq), std::string( log.data(), log.size() ) );
+	m_Pending.push_back( log );
+	if ( m_CaptureValues )
+    {
+        m_PendingValues.push_back( value );
+    }
 }
 
 // leveldb put
@@ -213,6 +423,12 @@ void BinlogQueue::Delete( const std::string & key )
 
 int BinlogQueue::findNext( uint64_t next_seq, Binlog *log ) const
 {
+	int rc = this->lookup( next_seq, log );
+	if ( rc >= 0 )
+    {
+        return rc;
+    }
+
 	if( this->get( next_seq, log ) == 1 )
     {
 		return 1;
@@ -221,7 +437,7 @@ int BinlogQueue::findNext( uint64_t next_seq, Binlog *log ) const
 	uint64_t ret = 0;
 	std::string key_str = encode_seq_key( next_seq );
 	leveldb::ReadOptions iterate_options;
-	leveldb::Iterator *it = m_Engine->getDatabase()->NewIterator( iterate_options );
+	leveldb::Iterator *it = m_LogEngine->getDatabase()->NewIterator( iterate_options );
 	it->Seek( key_str );
 	if( it->Valid() )
     {
@@ -245,11 +461,26 @@ int BinlogQueue::findNext( uint64_t next_seq, Binlog *log ) const
 }
 
 int BinlogQueue::findLast( Binlog *log ) const
+{
+    // 最后一条一定在索引中
+    m_IndexLock.lock();
+    if ( m_IndexMax != 0 )
+    {
+        *log = m_Index[ m_IndexMax % eIndex_Capacity ];
+        m_IndexLock.unlock();
+        return 1;
+    }
+    m_IndexLock.unlock();
+
+    return this->findLast( m_LogEngine, log );
+}
+
+int BinlogQueue::findLast( LevelDBEngine * engine, Binlog *log ) const
 {
 	uint64_t ret = 0;
 	std::string key_str = encode_seq_key(UINT64_MAX);
 	leveldb::ReadOptions iterate_options;
-	leveldb::Iterator *it = m_Engine->getDatabase()->NewIterator( iterate_options );
+	leveldb::Iterator *it = engine->getDatabase()->NewIterator( iterate_options );
 	it->Seek(key_str);
 	if( !it->Valid() )
     {
@@ -285,8 +516,14 @@ int BinlogQueue::findLast( Binlog *log ) const
 
 int BinlogQueue::get( uint64_t seq, Binlog *log ) const
 {
+	int rc = this->lookup( seq, log );
+	if ( rc >= 0 )
+    {
+        return rc;
+    }
+
 	std::string value;
-    if ( m_Engine->get( encode_seq_key(seq), value ) )
+    if ( m_LogEngine->get( encode_seq_key(seq), value ) )
     {
         if ( log->load( value ) != -1 )
         {
@@ -300,9 +537,16 @@ int BinlogQueue::get( uint64_t seq, Binlog *log ) const
 int BinlogQueue::update( uint64_t seq, char cmd, const std::string &key )
 {
     Binlog log( seq, cmd, key );
-    leveldb::Status s = m_Engine->getDatabase()->Put( leveldb::WriteOptions(), encode_seq_key(seq), log.repr() );
+    leveldb::Status s = m_LogEngine->getDatabase()->Put( leveldb::WriteOptions(), encode_seq_key(seq), log.repr() );
     if( s.ok() )
     {
+        // 同时修改索引
+        m_IndexLock.lock();
+        if ( m_IndexMax != 0 && seq >= m_IndexMin && seq <= m_IndexMax )
+        {
+            m_Index[ seq % eIndex_Capacity ] = log;
+        }
+        m_IndexLock.unlock();
         return 0;
     }
 
@@ -311,7 +555,7 @@ int BinlogQueue::update( uint64_t seq, char cmd, const std::string &key )
 
 int BinlogQueue::del( uint64_t seq )
 {
-    leveldb::Status s = m_Engine->getDatabase()->Delete( leveldb::WriteOptions(), encode_seq_key(seq) );
+    leveldb::Status s = m_LogEngine->getDatabase()->Delete( leveldb::WriteOptions(), encode_seq_key(seq) );
     if( !s.ok() )
     {
         return -1;
@@ -323,6 +567,86 @@ int BinlogQueue::del( uint64_t seq )
 void BinlogQueue::flush()
 {
 	delRange( this->m_MinSeq, this->m_LastSeq );
+	if ( m_File != NULL )
+    {
+        m_File->truncate( 0 );
+    }
+
+    m_IndexLock.lock();
+    m_IndexMin = 0;
+    m_IndexMax = 0;
+    m_IndexLock.unlock();
+}
+
+bool BinlogQueue::openFile( const std::string & path, size_t segmentsize )
+{
+    m_File = new BinlogFile( path, segmentsize );
+    if ( m_File == NULL || !m_File->open() )
+    {
+        return false;
+    }
+
+    // 丢弃数据没有提交成功的binlog, 以及已经过期的段
+    m_File->truncate( m_LastSeq );
+    m_File->trim( m_MinSeq );
+
+    uint64_t first = 0, last = 0;
+    if ( m_File->range( first, last ) )
+    {
+        LOG_INFO( "binlog segments: %s, min: %lu, max: %lu\n", path.c_str(), first, last );
+    }
+
+    return true;
+}
+
+void BinlogQueue::trim()
+{
+    // 只删除已经提交的区间
+    this->lock();
+    uint64_t start = m_MinSeq;
+    uint64_t lastseq = m_LastSeq;
+    this->unlock();
+
+    if ( lastseq <= start + m_Capacity )
+    {
+        return;
+    }
+
+    uint64_t end = lastseq - m_Capacity - 1;
+
+    // 删除失败时保留原来的范围, 下次重新删除
+    if ( this->delRange( start, end ) != 0 )
+    {
+        LOG_ERROR( "BinlogQueue::trim(%lu, %lu) failed .\n", start, end );
+        return;
+    }
+
+    // 删除成功后再缩小范围和索引
+    this->lock();
+    m_MinSeq = end + 1;
+    this->unlock();
+    this->trimIndex( end + 1 );
+
+    // 分段文件按段删除
+    if ( m_File != NULL )
+    {
+        m_File->trim( end + 1 );
+    }
+
+    // 删除的区间全是tombstone, 累计到一定数量后只压缩这个区间
+    if ( m_TrimCount == 0 )
+    {
+        m_CompactSeq = start;
+    }
+    m_TrimCount += end - start + 1;
+    if ( m_TrimCount >= eTrim_CompactCount )
+    {
+        m_LogEngine->compactdb( encode_seq_key(m_CompactSeq), encode_seq_key(end) );
+
+        LOG_DEBUG( "BinlogQueue::trim() compact binlogs [%lu, %lu] .\n", m_CompactSeq, end );
+        m_CompactSeq = 0;
+        m_TrimCount = 0;
+    }
 }
 
 int BinlogQueue::delRange( uint64_t start, uint64_t end )
@@ -330,12 +654,12 @@ int BinlogQueue::delRange( uint64_t start, uint64_t end )
 	while( start <= end )
     {
 		leveldb::WriteBatch batch;
-		for( int count = 0; start <= end && count < 1000; start++, count++ )
+		for( int count = 0; start <= end && count < eTrim_BatchSize; start++, count++ )
         {
 			batch.Delete( encode_seq_key(start) );
 		}
 
-		leveldb::Status s = m_Engine->getDatabase()->Write( leveldb::WriteOptions(), &batch );
+		leveldb::Status s = m_LogEngine->getDatabase()->Write( leveldb::WriteOptions(), &batch );
 		if( !s.ok() )
         {
 			return -1;
@@ -345,4 +669,132 @@ int BinlogQueue::delRange( uint64_t start, uint64_t end )
 	return 0;
 }
 
+uint64_t BinlogQueue::searchMinSeq( uint64_t start ) const
+{
+    uint64_t low = start, high = m_LastSeq;
+
+    if ( high == 0 )
+    {
+        return 0;
+    }
+
+    // 从最小的seq开始连续存在, 找到第一个存在的seq
+    while ( low < high )
+    {
+        std::string value;
+        uint64_t middle = low + ( high - low ) / 2;
+
+        if ( m_LogEngine->get( encode_seq_key(middle), value ) )
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+
+    return low;
+}
+
+int BinlogQueue::lookup( uint64_t seq, Binlog *log ) const
+{
+    int rc = -1;
+
+    m_IndexLock.lock();
+    if ( m_IndexMax != 0 )
+    {
+        if ( seq > m_IndexMax )
+        {
+            rc = 0;
+        }
+        else if ( seq >= m_IndexMin )
+        {
+            *log = m_Index[ seq % eIndex_Capacity ];
+            rc = 1;
+        }
+    }
+    m_IndexLock.unlock();
+
+    return rc;
+}
+
+void BinlogQueue::publish()
+{
+    if ( m_Pending.empty() )
+    {
+        return;
+    }
+
+    m_IndexLock.lock();
+    if ( m_Index.empty() )
+    {
+        m_Index.resize( eIndex_Capacity );
+    }
+    for ( size_t i = 0; i < m_Pending.size(); ++i )
+    {
+        uint64_t seq = m_Pending[i].seq();
+
+        // 不连续时重新开始
+        if ( m_IndexMax == 0 || seq != m_IndexMax + 1 )
+        {
+            m_IndexMin = seq;
+        }
+
+        m_IndexMax = seq;
+
+        // 索引中不保存数据, 同步时从分段文件或者数据库中读取
+        const Binlog & log = m_Pending[i];
+        if ( log.hasValue() )
+        {
+            m_Index[ seq % eIndex_Capacity ] = Binlog( seq, log.cmd(), log.key().ToString() );
+        }
+        else
+        {
+            m_Index[ seq % eIndex_Capacity ] = log;
+        }
+
+        // 覆盖了最旧的
+        if ( m_IndexMax - m_IndexMin >= eIndex_Capacity )
+        {
+            m_IndexMin = m_IndexMax - eIndex_Capacity + 1;
+        }
+    }
+    m_IndexLock.unlock();
+}
+
+void BinlogQueue::value( size_t i, std::string & value ) const
+{
+    const Binlog & log = m_Pending[i];
+
+    if ( i < m_PendingValues.size() )
+    {
+        value = m_PendingValues[i];
+    }
+    else if ( log.hasValue() )
+    {
+        value = log.value().ToString();
+    }
+    else
+    {
+        // 事务开始时还没有备机, 已经提交, 直接读取
+        m_Engine->get( log.key().ToString(), value );
+    }
+}
+
+void BinlogQueue::trimIndex( uint64_t minseq )
+{
+    m_IndexLock.lock();
+    if ( m_IndexMax != 0 && m_IndexMin < minseq )
+    {
+        m_IndexMin = minseq;
+        if ( m_IndexMin > m_IndexMax )
+        {
+            m_IndexMin = 0;
+            m_IndexMax = 0;
+        }
+    }
+    m_IndexLock.unlock();
+}
+
 };
@@ -3,32 +3,47 @@
 #define __SRC_TINYDB_BINLOG_H__
 
 #include <string>
+#include <vector>
 #include <pthread.h>
 
 #include "leveldbengine.h"
+#include "binlogfile.h"
 #include "utils/slice.h"
+#include "utils/thread.h"
 
 namespace tinydb
 {
 
+//
+// binlog格式:
+//      seq(8) + cmd(1) + key
+// 带有数据时, cmd中设置VALUE_FLAG:
+//      seq(8) + cmd(1) + keylen(4) + key + value
+//
 class Binlog
 {
 public:
     Binlog(){}
     Binlog( uint64_t seq, char cmd, const std::string & key );
+    Binlog( uint64_t seq, char cmd, const std::string & key, const std::string & value );
 
     int load( const leveldb::Slice & value );
     uint64_t seq() const;
     char cmd() const;
     const Slice key() const;
+    // 是否带有写入的数据
+    bool hasValue() const;
+    const Slice value() const;
     const char* data() const { return m_Buf.data(); }
     size_t size() const { return m_Buf.size(); }
-    const std::string repr() const { return this->m_Buf;}
+    // 发送给备机的格式, 不带数据
+    const std::string repr() const;
     std::string dumps() const;
 
 private:
     std::string     m_Buf;
     static const unsigned int HEADER_LEN = sizeof(uint64_t) + 1;
+    static const char VALUE_FLAG = 0x40;
 };
 
 // circular queue
@@ -42,25 +57,49 @@ public :
 #endif
 
 public :
-    BinlogQueue( LevelDBEngine * engine );
+    // capacity : 保留的binlog个数
+    // logengine : 独立存储binlog的数据库, NULL表示和数据存放在一起
+    BinlogQueue( LevelDBEngine * engine,
+            uint32_t capacity = LOG_QUEUE_SIZE, LevelDBEngine * logengine = NULL );
     ~BinlogQueue();
 
+    // 多个工作线程共享, 事务期间加锁
+    void lock() { m_Lock.lock(); }
+    void unlock() { m_Lock.unlock(); }
+
     void begin();
     void rollback();
-    bool commit();
+    bool commit( bool sync = false );
+    // fsync之前所有的写入
+    bool sync();
 
     // leveldb put
     void Put( const std::string & key, const std::string & value );
     // leveldb delete
     void Delete( const std::string & key );
 
-    void addLog( char cmd, const std::string & key );
+    // binlog中是否记录SET写入的数据, 同步备机时不需要再读取数据库
+    void setInlineValue( bool enable ) { m_InlineValue = enable; }
+
+    // value : SET写入的数据, 记录到binlog或者追加到分段文件中
+    void addLog( char cmd, const std::string & key, const std::string & value = "" );
 
     int get( uint64_t seq, Binlog *log ) const;
     int update( uint64_t seq, char cmd, const std::string &key );
 
     void flush();
 
+    // 同时追加到分段文件, 同步线程直接从文件中读取数据
+    bool openFile( const std::string & path, size_t segmentsize );
+    BinlogFile * getFile() const { return m_File; }
+
+    // 最后提交的seq
+    uint64_t getLastSeq() const { return m_LastSeq; }
+
+    // 删除超出容量的binlog, 由后台线程定期调用
+    // 批量删除, 累计一定数量后压缩binlog的区间
+    void trim();
+
     /** @returns
 1 : log.seq greater than or equal to seq
 0 : not found
@@ -70,16 +109,58 @@ public :
     int findLast( Binlog *log ) const;
 
 private :
+    int findLast( LevelDBEngine * engine, Binlog *log ) const;
+    // 独立存储时, 按照数据库中记录的提交位置修复binlog
+    void recover();
+
     int del(uint64_t seq);
     // [start, end] includesive
     int delRange(uint64_t start, uint64_t end);
 
+    // binlog是连续的, 二分查找[start, m_LastSeq]中最小的seq
+    uint64_t searchMinSeq( uint64_t start ) const;
+
+    // 内存索引
+    // 1 : 命中
+    // 0 : 比索引中最大的seq还大, 还没有产生
+    // -1: 不在索引范围内, 需要读取leveldb
+    int lookup( uint64_t seq, Binlog *log ) const;
+    // 事务提交后加入内存索引, m_Pending由commit()清空
+    void publish();
+    // 索引不能包含已经删除的binlog
+    void trimIndex( uint64_t minseq );
+    // 事务中第i条SET写入的数据
+    void value( size_t i, std::string & value ) const;
+
 private:
+    utils::Mutex    m_Lock;
     LevelDBEngine * m_Engine;
+    LevelDBEngine * m_LogEngine;
     uint64_t        m_MinSeq;
     uint64_t        m_LastSeq;
     uint64_t        m_TranSeq;
     uint32_t        m_Capacity;
+    bool            m_InlineValue;
+    bool            m_CaptureValues;    // 事务中是否保留写入的数据
+
+private :
+    enum
+    {
+        eIndex_Capacity     = 65536,    // 内存索引的容量
+        eTrim_BatchSize     = 10000,    // 每个WriteBatch删除的binlog个数
+        eTrim_CompactCount  = 100000,   // 删除多少个binlog之后压缩
+    };
+
+    uint64_t                m_CompactSeq;   // 已经删除但是还没有压缩的起始seq
+    uint64_t                m_TrimCount;    // 已经删除但是还没有压缩的个数
+
+    std::vector<Binlog>     m_Pending;      // 事务中的binlog, 提交后加入索引
+    std::vector<std::string> m_PendingValues;   // 事务中binlog对应的数据, m_CaptureValues时才保留
+    BinlogFile *            m_File;         // 分段文件
+    mutable utils::Mutex    m_IndexLock;    // 同步线程并发读取
+    std::vector<Binlog>     m_Index;        // 最近的binlog, 按照seq循环存放
+    uint64_t                m_IndexMin;     // 索引中最小的seq
+    uint64_t                m_IndexMax;     // 索引中最大的seq, 0表示为空
 };
 
 class Transaction
@@ -88,6 +169,7 @@ public:
 	Transaction( BinlogQueue *logs )
     {
 		this->m_Logs = logs;
+		m_Logs->lock();
 		m_Logs->begin();
 	}
 
@@ -95,6 +177,7 @@ public:
     {
 		// it is safe to call rollback after commit
 		m_Logs->rollback();
+		m_Logs->unlock();
 	}
 
 private:
@@ -0,0 +1,565 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "base.h"
+#include "utils/utility.h"
+#include "utils/hashfunc.h"
+
+#include "binlogfile.h"
+
+namespace tinydb
+{
+
+static inline void encode_fixed32( std::string & buf, uint32_t value )
+{
+    buf.append( (const char *)&value, sizeof(value) );
+}
+
+static inline void encode_fixed64( std::string & buf, uint64_t value )
+{
+    buf.append( (const char *)&value, sizeof(value) );
+}
+
+static inline uint32_t decode_fixed32( const char * p )
+{
+    uint32_t value = 0;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+static inline uint64_t decode_fixed64( const char * p )
+{
+    uint64_t value = 0;
+    memcpy( &value, p, sizeof(value) );
+    return value;
+}
+
+BinlogFile::BinlogFile( const std::string & path, size_t segmentsize )
+    : m_Path( path ),
+      m_SegmentSize( segmentsize )
+{}
+
+BinlogFile::~BinlogFile()
+{
+    this->close();
+}
+
+bool BinlogFile::open()
+{
+    utils::Utility::mkdirp( m_Path.c_str() );
+
+    DIR * dir = opendir( m_Path.c_str() );
+    if ( dir == NULL )
+    {
+        LOG_ERROR( "BinlogFile::open('%s') failed, %s .\n", m_Path.c_str(), strerror(errno) );
+        return false;
+    }
+
+    // 段文件以第一条记录的seq命名
+    std::vector<uint64_t> seqs;
+    struct dirent * entry = NULL;
+    while ( ( entry = readdir( dir ) ) != NULL )
+    {
+        char * end = NULL;
+        uint64_t seq = strtoull( entry->d_name, &end, 10 );
+        if ( end != entry->d_name && strcmp( end, ".log" ) == 0 )
+        {
+            seqs.push_back( seq );
+        }
+    }
+    closedir( dir );
+    std::sort( seqs.begin(), seqs.end() );
+
+    for ( size_t i = 0; i < seqs.size(); ++i )
+    {
+        char name[ 64 ];
+        snprintf( name, sizeof(name), "/%020lu.log", seqs[i] );
+
+        Segment * s = this->load( m_Path + name, seqs[i] );
+        if ( s == NULL )
+        {
+            continue;
+        }
+
+        // 空的段直接删除
+        if ( s->count == 0 )
+        {
+            unlink( s->path.c_str() );
+            this->release( s );
+            continue;
+        }
+
+        m_Segments.push_back( s );
+    }
+
+    return true;
+}
+
+void BinlogFile::close()
+{
+    m_Lock.lock();
+    std::deque<Segment *> segments;
+    segments.swap( m_Segments );
+    m_Lock.unlock();
+
+    for ( size_t i = 0; i < segments.size(); ++i )
+    {
+        this->release( segments[i] );
+    }
+}
+
+void BinlogFile::append( uint64_t seq, char cmd, const Slice & key, const Slice & value )
+{
+    // 编码
+    size_t start = m_Buffer.size();
+    encode_fixed32( m_Buffer, 0 );
+    encode_fixed32( m_Buffer, 0 );
+    encode_fixed64( m_Buffer, seq );
+    m_Buffer.push_back( cmd );
+    encode_fixed32( m_Buffer, key.size() );
+    m_Buffer.append( key.data(), key.size() );
+    m_Buffer.append( value.data(), value.size() );
+
+    uint32_t length = m_Buffer.size() - start - 8;
+    uint32_t checksum = utils::HashFunction::murmur32( m_Buffer.data() + start + 8, length );
+    memcpy( &m_Buffer[start], &length, sizeof(length) );
+    memcpy( &m_Buffer[start + 4], &checksum, sizeof(checksum) );
+
+    m_Records.push_back( std::make_pair( seq, m_Buffer.size() - start ) );
+}
+
+bool BinlogFile::flush()
+{
+    bool rc = true;
+    size_t offset = 0;
+
+    for ( size_t i = 0; i < m_Records.size(); )
+    {
+        uint64_t seq = m_Records[i].first;
+        size_t length = m_Records[i].second;
+
+        m_Lock.lock();
+        Segment * s = m_Segments.empty() ? NULL : m_Segments.back();
+        m_Lock.unlock();
+
+        // 不连续或者空间不足时创建新的段
+        if ( s == NULL
+                || seq != s->firstseq + s->count
+                || s->size + length > s->capacity )
+        {
+            s = this->create( seq, std::max( m_SegmentSize, length ) );
+            if ( s == NULL )
+            {
+                rc = false;
+                break;
+            }
+
+            m_Lock.lock();
+            m_Segments.push_back( s );
+            m_Lock.unlock();
+        }
+
+        // 能够连续写入这个段的记录
+        size_t n = i, bytes = 0;
+        while ( n < m_Records.size()
+                && m_Records[n].first == seq + ( n - i )
+                && s->size + bytes + m_Records[n].second <= s->capacity )
+        {
+            bytes += m_Records[n].second;
+            ++n;
+        }
+
+        ssize_t nwrite = pwrite( s->fd, m_Buffer.data() + offset, bytes, s->size );
+        if ( nwrite != (ssize_t)bytes )
+        {
+            LOG_ERROR( "BinlogFile::flush(SEQ:%lu-%lu) : write '%s' failed, %s .\n",
+                    seq, seq + ( n - i ) - 1, s->path.c_str(), strerror(errno) );
+            rc = false;
+            break;
+        }
+
+        // 写入完成后才对同步线程可见
+        m_Lock.lock();
+        for ( ; i < n; ++i )
+        {
+            if ( s->count % eIndex_Interval == 0 )
+            {
+                s->offsets.push_back( s->size );
+            }
+            s->size += m_Records[i].second;
+            s->count += 1;
+        }
+        m_Lock.unlock();
+
+        offset += bytes;
+    }
+
+    m_Buffer.clear();
+    m_Records.clear();
+
+    return rc;
+}
+
+void BinlogFile::truncate( uint64_t seq )
+{
+    std::vector<Segment *> removed;
+
+    m_Lock.lock();
+    while ( !m_Segments.empty() )
+    {
+        Segment * s = m_Segments.back();
+
+        if ( s->firstseq > seq )
+        {
+            removed.push_back( s );
+            m_Segments.pop_back();
+            continue;
+        }
+
+        if ( s->firstseq + s->count > seq + 1 )
+        {
+            // 从索引处向后定位
+            uint32_t count = seq + 1 - s->firstseq;
+            size_t offset = s->offsets[ count / eIndex_Interval ];
+            for ( uint32_t i = count / eIndex_Interval * eIndex_Interval; i < count; ++i )
+            {
+                offset += 8 + decode_fixed32( s->data + offset );
+            }
+
+            // 之后的记录清零, 重新打开时不会再加载
+            std::string zero( s->size - offset, 0 );
+            if ( pwrite( s->fd, zero.data(), zero.size(), offset ) != (ssize_t)zero.size() )
+            {
+                LOG_ERROR( "BinlogFile::truncate(SEQ:%lu) : write '%s' failed .\n", seq, s->path.c_str() );
+            }
+
+            s->size = offset;
+            s->count = count;
+            s->offsets.resize( ( count + eIndex_Interval - 1 ) / eIndex_Interval );
+        }
+        break;
+    }
+    m_Lock.unlock();
+
+    for ( size_t i = 0; i < removed.size(); ++i )
+    {
+        unlink( removed[i]->path.c_str() );
+        this->release( removed[i] );
+    }
+}
+
+void BinlogFile::trim( uint64_t seq )
+{
+    std::vector<Segment *> removed;
+
+    // 保留最后一个段, 继续追加
+    m_Lock.lock();
+    while ( m_Segments.size() > 1 )
+    {
+        Segment * s = m_Segments.front();
+        if ( s->firstseq + s->count > seq )
+        {
+            break;
+        }
+
+        removed.push_back( s );
+        m_Segments.pop_front();
+    }
+    m_Lock.unlock();
+
+    // 正在读取的同步线程持有引用, 释放后才解除映射
+    for ( size_t i = 0; i < removed.size(); ++i )
+    {
+        unlink( removed[i]->path.c_str() );
+        this->release( removed[i] );
+    }
+}
+
+bool BinlogFile::range( uint64_t & first, uint64_t & last )
+{
+    bool rc = false;
+
+    m_Lock.lock();
+    if ( !m_Segments.empty() && m_Segments.back()->count > 0 )
+    {
+        first = m_Segments.front()->firstseq;
+        last = m_Segments.back()->firstseq + m_Segments.back()->count - 1;
+        rc = true;
+    }
+    m_Lock.unlock();
+
+    return rc;
+}
+
+BinlogFile::Segment * BinlogFile::create( uint64_t seq, size_t capacity )
+{
+    char name[ 64 ];
+    snprintf( name, sizeof(name), "/%020lu.log", seq );
+    std::string path = m_Path + name;
+
+    int32_t fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644 );
+    if ( fd == -1 )
+    {
+        LOG_ERROR( "BinlogFile::create('%s') failed, %s .\n", path.c_str(), strerror(errno) );
+        return NULL;
+    }
+
+    // 预分配, 映射的区间都在文件之内
+    if ( ftruncate( fd, capacity ) != 0 )
+    {
+        LOG_ERROR( "BinlogFile::create('%s', %lu) failed, %s .\n", path.c_str(), capacity, strerror(errno) );
+        ::close( fd );
+        unlink( path.c_str() );
+        return NULL;
+    }
+
+    void * data = mmap( NULL, capacity, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( data == MAP_FAILED )
+    {
+        LOG_ERROR( "BinlogFile::create('%s', %lu) : mmap failed, %s .\n", path.c_str(), capacity, strerror(errno) );
+        ::close( fd );
+        unlink( path.c_str() );
+        return NULL;
+    }
+
+    Segment * s = new Segment;
+    s->firstseq = seq;
+    s->count = 0;
+    s->size = 0;
+    s->capacity = capacity;
+    s->fd = fd;
+    s->data = (char *)data;
+    s->refcount = 1;
+    s->path = path;
+
+    return s;
+}
+
+BinlogFile::Segment * BinlogFile::load( const std::string & path, uint64_t firstseq )
+{
+    int32_t fd = ::open( path.c_str(), O_RDWR );
+    if ( fd == -1 )
+    {
+        LOG_ERROR( "BinlogFile::load('%s') failed, %s .\n", path.c_str(), strerror(errno) );
+        return NULL;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || st.st_size == 0 )
+    {
+        ::close( fd );
+        unlink( path.c_str() );
+        return NULL;
+    }
+
+    void * data = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    if ( data == MAP_FAILED )
+    {
+        LOG_ERROR( "BinlogFile::load('%s') : mmap failed, %s .\n", path.c_str(), strerror(errno) );
+        ::close( fd );
+        return NULL;
+    }
+
+    Segment * s = new Segment;
+    s->firstseq = firstseq;
+    s->count = 0;
+    s->size = 0;
+    s->capacity = st.st_size;
+    s->fd = fd;
+    s->data = (char *)data;
+    s->refcount = 1;
+    s->path = path;
+
+    // 逐条校验, 遇到不完整的记录时停止
+    BinlogRecord record;
+    for ( ;; )
+    {
+        size_t length = parse( s, s->size, s->capacity, record );
+        if ( length == 0 || record.seq != firstseq + s->count )
+        {
+            break;
+        }
+
+        if ( s->count % eIndex_Interval == 0 )
+        {
+            s->offsets.push_back( s->size );
+        }
+        s->size += length;
+        s->count += 1;
+    }
+
+    return s;
+}
+
+void BinlogFile::release( Segment * s )
+{
+    m_Lock.lock();
+    int32_t refcount = --s->refcount;
+    m_Lock.unlock();
+
+    if ( refcount == 0 )
+    {
+        munmap( s->data, s->capacity );
+        ::close( s->fd );
+        delete s;
+    }
+}
+
+BinlogFile::Segment * BinlogFile::find( uint64_t seq ) const
+{
+    // 二分查找最后一个firstseq不大于seq的段
+    size_t low = 0, high = m_Segments.size();
+    while ( low < high )
+    {
+        size_t middle = low + ( high - low ) / 2;
+        if ( m_Segments[middle]->firstseq <= seq )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    if ( low == 0 )
+    {
+        return NULL;
+    }
+
+    Segment * s = m_Segments[ low-1 ];
+    if ( seq >= s->firstseq + s->count )
+    {
+        return NULL;
+    }
+
+    return s;
+}
+
+size_t BinlogFile::parse( const Segment * s, size_t offset, size_t limit, BinlogRecord & record )
+{
+    if ( offset + eHeader_Length > limit )
+    {
+        return 0;
+    }
+
+    const char * p = s->data + offset;
+    uint32_t length = decode_fixed32( p );
+    if ( length < eHeader_Length - 8
+            || offset + 8 + length > limit )
+    {
+        return 0;
+    }
+
+    if ( decode_fixed32( p + 4 ) != utils::HashFunction::murmur32( p + 8, length ) )
+    {
+        return 0;
+    }
+
+    uint32_t keylen = decode_fixed32( p + 17 );
+    if ( eHeader_Length + keylen > 8 + length )
+    {
+        return 0;
+    }
+
+    record.seq = decode_fixed64( p + 8 );
+    record.cmd = p[16];
+    record.key = Slice( p + eHeader_Length, keylen );
+    record.value = Slice( p + eHeader_Length + keylen, 8 + length - eHeader_Length - keylen );
+
+    return 8 + length;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+BinlogFile::Reader::Reader( BinlogFile * file )
+    : m_File( file ),
+      m_Segment( NULL ),
+      m_Seq( 0 ),
+      m_Offset( 0 )
+{}
+
+BinlogFile::Reader::~Reader()
+{
+    this->release();
+}
+
+void BinlogFile::Reader::release()
+{
+    if ( m_Segment != NULL )
+    {
+        m_File->release( m_Segment );
+        m_Segment = NULL;
+    }
+}
+
+bool BinlogFile::Reader::read( uint64_t seq, BinlogRecord & record )
+{
+    size_t limit = 0;
+
+    m_File->m_Lock.lock();
+    if ( m_Segment == NULL
+            || seq < m_Segment->firstseq
+            || seq >= m_Segment->firstseq + m_Segment->count )
+    {
+        // 切换到包含seq的段
+        if ( m_Segment != NULL )
+        {
+            m_File->m_Lock.unlock();
+            this->release();
+            m_File->m_Lock.lock();
+        }
+
+        m_Segment = m_File->find( seq );
+        if ( m_Segment == NULL )
+        {
+            m_File->m_Lock.unlock();
+            return false;
+        }
+
+        ++m_Segment->refcount;
+        m_Seq = m_Segment->firstseq;
+        m_Offset = 0;
+    }
+
+    // 不是顺序读取时, 从最近的索引开始
+    if ( seq < m_Seq || seq - m_Seq >= eIndex_Interval )
+    {
+        uint32_t index = ( seq - m_Segment->firstseq ) / eIndex_Interval;
+        m_Seq = m_Segment->firstseq + index * eIndex_Interval;
+        m_Offset = m_Segment->offsets[ index ];
+    }
+    limit = m_Segment->size;
+    m_File->m_Lock.unlock();
+
+    // 已经校验过, 直接跳过
+    for ( ; m_Seq < seq; ++m_Seq )
+    {
+        m_Offset += 8 + decode_fixed32( m_Segment->data + m_Offset );
+    }
+
+    size_t length = parse( m_Segment, m_Offset, limit, record );
+    if ( length == 0 || record.seq != seq )
+    {
+        return false;
+    }
+
+    m_Seq += 1;
+    m_Offset += length;
+
+    return true;
+}
+
+}
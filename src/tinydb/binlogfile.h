@@ -0,0 +1,129 @@
+
+#ifndef __SRC_TINYDB_BINLOGFILE_H__
+#define __SRC_TINYDB_BINLOGFILE_H__
+
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "utils/slice.h"
+#include "utils/thread.h"
+
+namespace tinydb
+{
+
+// 分段文件中的一条binlog, 直接指向映射的内存
+struct BinlogRecord
+{
+    uint64_t    seq;
+    char        cmd;
+    Slice       key;
+    Slice       value;
+};
+
+//
+// 分段存储的binlog文件, 只追加
+// 每条记录带有写入的数据, 同步时不需要再读取数据库
+//
+// 记录格式:
+//      length(4) + checksum(4) + seq(8) + cmd(1) + keylen(4) + key + value
+//      length是checksum之后的长度, checksum是之后内容的murmur32
+//
+// 段文件以第一条记录的seq命名, 创建时预分配固定大小,
+// 段内的seq是连续的, 不连续或者空间不足时创建新的段
+// 同步线程通过mmap只读访问, 不需要拷贝
+//
+class BinlogFile
+{
+public :
+    BinlogFile( const std::string & path, size_t segmentsize );
+    ~BinlogFile();
+
+public :
+    // 打开目录下所有的段文件, 丢弃末尾不完整的记录
+    bool open();
+    void close();
+
+    // 追加, 只能在一个线程中调用
+    // 先编码到缓冲区, flush()时每个段只写入一次
+    void append( uint64_t seq, char cmd, const Slice & key, const Slice & value );
+    bool flush();
+
+    // 删除seq之后的记录
+    void truncate( uint64_t seq );
+    // 删除所有记录都在seq之前的段
+    void trim( uint64_t seq );
+
+    // 文件中的seq区间, 为空时返回false
+    bool range( uint64_t & first, uint64_t & last );
+
+private :
+    struct Segment
+    {
+        uint64_t                firstseq;
+        uint32_t                count;      // 记录个数
+        size_t                  size;       // 已经写入的大小
+        size_t                  capacity;   // 文件大小
+        int32_t                 fd;
+        char *                  data;       // 只读映射
+        int32_t                 refcount;
+        std::string             path;
+        std::vector<uint32_t>   offsets;    // 每隔eIndex_Interval条记录的偏移
+    };
+
+public :
+    //
+    // 读取, 每个同步线程一个
+    // 持有当前的段, 返回的记录在下一次读取之前有效
+    //
+    class Reader
+    {
+    public :
+        Reader( BinlogFile * file );
+        ~Reader();
+
+        // 读取指定seq的记录, 不存在时返回false
+        bool read( uint64_t seq, BinlogRecord & record );
+
+    private :
+        void release();
+
+    private :
+        BinlogFile *    m_File;
+        Segment *       m_Segment;
+        uint64_t        m_Seq;          // m_Offset处记录的seq
+        size_t          m_Offset;
+    };
+
+private :
+    friend class Reader;
+
+    enum
+    {
+        eIndex_Interval     = 64,               // 索引的间隔
+        eHeader_Length      = 4 + 4 + 8 + 1 + 4,
+    };
+
+    // 创建/加载/释放段文件
+    Segment * create( uint64_t seq, size_t capacity );
+    Segment * load( const std::string & path, uint64_t firstseq );
+    void release( Segment * s );
+
+    // 查找包含seq的段, 调用者加锁
+    Segment * find( uint64_t seq ) const;
+
+    // 解析offset处的记录, 返回记录的长度, 0表示无效
+    static size_t parse( const Segment * s, size_t offset, size_t limit, BinlogRecord & record );
+
+private :
+    std::string             m_Path;
+    size_t                  m_SegmentSize;
+    utils::Mutex            m_Lock;
+    std::deque<Segment *>   m_Segments;     // 按照seq排序
+    std::string             m_Buffer;       // 追加时复用的缓冲区
+    std::vector< std::pair<uint64_t, size_t> > m_Records;  // 缓冲区中每条记录的seq和长度
+};
+
+}
+
+#endif
@@ -1,43 +1,128 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "types.h"
 #include "version.h"
 
 #include "utils/utility.h"
 #include "utils/timeutils.h"
+#include "utils/endian.h"
 #include "utils/slice.h"
 
 #include "message/message.h"
+#include "message/protocol.h"
 #include "dataserver.h"
 #include "dataservice.h"
 #include "middleware.h"
 #include "binlog.h"
+#include "valuecache.h"
 #include "dumpbackend.h"
+#include "syncbackend.h"
+#include "slaveproxy.h"
 
 #include "clientproxy.h"
 
 namespace tinydb
 {
 
+static inline void append_uint( std::string & buf, uint64_t value )
+{
+    char digits[ 24 ];
+    char * end = digits + sizeof(digits);
+    char * p = end;
+
+    do
+    {
+        *--p = '0' + value % 10;
+        value /= 10;
+    }
+    while ( value != 0 );
+
+    buf.append( p, end - p );
+}
+
+// 文本协议的VALUE, 不需要格式化
+static inline void append_value( std::string & response, const Slice & key, const Slice & value )
+{
+    response.reserve( response.size() + key.size() + value.size() + 40 );
+    response.append( "VALUE ", 6 );
+    response.append( key.data(), key.size() );
+    response.append( " 0 ", 3 );
+    append_uint( response, value.size() );
+    response.append( "\r\n", 2 );
+    response.append( value.data(), value.size() );
+    response.append( "\r\n", 2 );
+}
+
 struct LeveldbFetcher
 {
-    LeveldbFetcher( std::string & data ) : response(data) {}
+    LeveldbFetcher( std::string & data, size_t limit ) : response(data), limit(limit), count(0) {}
     ~LeveldbFetcher() {}
 
-    bool operator () ( const std::string & key, const std::string & value )
+    bool operator () ( const leveldb::Slice & key, const leveldb::Slice & value )
     {
-        std::string prefix;
-        utils::Utility::snprintf( prefix, key.size()+512,
-                "VALUE %s 0 %d\r\n", key.c_str(), value.size() );
-        response += prefix;
-        response += value;
-        response += "\r\n";
-        return true;
+        // 去掉数据类型的前缀
+        append_value( response,
+                Slice( key.data()+1, key.size()-1 ), Slice( value.data(), value.size() ) );
+        ++count;
+
+        // 超过一批的大小时暂停
+        return response.size() < limit;
+    }
+
+    std::string &   response;
+    size_t          limit;
+    uint32_t        count;
+};
+
+// 统计信息, 兼容文本协议和二进制协议
+struct StatWriter
+{
+    StatWriter( CacheMessage * msg, std::string & data ) : message(msg), response(data) {}
+    ~StatWriter() {}
+
+    void add( const char * name, const char * format, ... )
+    {
+        char value[ 128 ];
+        va_list args;
+
+        va_start( args, format );
+        vsnprintf( value, sizeof(value), format, args );
+        va_end( args );
+
+        if ( message->isBinary() )
+        {
+            BinaryProtocol::encode( response, message,
+                    BinaryProtocol::eStatus_OK, Slice(), Slice( name ), Slice( value ) );
+        }
+        else
+        {
+            response += "STAT ";
+            response += name;
+            response += " ";
+            response += value;
+            response += "\r\n";
+        }
+    }
+
+    // 二进制协议以KEY为空的包结束
+    void end()
+    {
+        if ( message->isBinary() )
+        {
+            BinaryProtocol::encode( response, message, BinaryProtocol::eStatus_OK );
+        }
+        else
+        {
+            response += "END\r\n";
+        }
     }
 
+    CacheMessage *  message;
     std::string &   response;
 };
 
@@ -49,60 +134,146 @@ static inline std::string encode_kv_key( const Slice & key )
     return buf;
 }
 
-CClientProxy::CClientProxy( int32_t percision, LevelDBEngine * engine )
-    : m_Percision( percision ),
+CClientProxy::CClientProxy( uint8_t index, int32_t percision, LevelDBEngine * engine, BinlogQueue * binlogs )
+    : m_QueueSize( 0 ),
+      m_IsWaiting( false ),
+      m_BatchSize( 1 ),
+      m_BatchUsecs( 0 ),
+      m_GroupTimestamp( 0 ),
+      m_Durability( Durability::ASYNC ),
+      m_GroupDurability( Durability::ASYNC ),
+      m_SyncWrites( 1 ),
+      m_SyncUsecs( 0 ),
+      m_SyncTimestamp( 0 ),
+      m_AckSlaves( 0 ),
+      m_AckUsecs( 0 ),
+      m_AckDegraded( false ),
+      m_AckDegradedSeq( 0ULL ),
+      m_LastSid( 0 ),
+      m_LastOutput( NULL ),
+      m_Index( index ),
+      m_Percision( percision ),
+      m_SpinUsecs( 0 ),
       m_Engine( engine ),
-      m_Binlogs( NULL ),
+      m_Binlogs( binlogs ),
       m_DumpThread( 0 )
 {
+    pthread_cond_init( &m_QueueCond, NULL );
     pthread_mutex_init( &m_QueueLock, NULL );
+    pthread_mutex_init( &m_StatusLock, NULL );
 }
 
 CClientProxy::~CClientProxy()
 {
     // 销毁队列锁
+    pthread_cond_destroy( &m_QueueCond );
     pthread_mutex_destroy( &m_QueueLock );
+    pthread_mutex_destroy( &m_StatusLock );
 }
 
-bool CClientProxy::start()
+bool CClientProxy::onStart()
 {
-    // 创建binlog处理对象
-    m_Binlogs = new BinlogQueue( m_Engine );
-    assert( m_Binlogs != NULL && "CClientProxy::start new BinlogQueue failed." );
-
     return true;
 }
 
+void CClientProxy::onExecute()
+{
+    this->run();
+}
+
 void CClientProxy::run()
 {
+    // 处理逻辑
+    this->execute();
 
-    int32_t used_msecs = 0;
-    int64_t now = utils::TimeUtils::now();
+    // 队列为空时等待post()唤醒
+    this->wait();
+}
 
+void CClientProxy::wait()
+{
+    // 还有未完成的通配符查询, 继续执行
+    if ( !m_Scans.empty() )
     {
-        // 处理逻辑
-        this->execute();
+        return;
+    }
+
+    // 先自旋一段时间, 避免频繁挂起和唤醒
+    if ( m_SpinUsecs > 0 )
+    {
+        int64_t deadline = utils::TimeUtils::usnow() + m_SpinUsecs;
+
+        while ( m_QueueSize == 0
+                && utils::TimeUtils::usnow() < deadline )
+        {
+            // spin
+        }
+    }
+
+    // 最长等待一帧, 保证能及时响应线程停止
+    // 有等待fsync的写请求时, 不能超过fsync的间隔
+    int64_t usecs = (int64_t)m_Percision * 1000;
+    if ( !m_UnsyncedWrites.empty() )
+    {
+        int64_t remain = m_SyncTimestamp + m_SyncUsecs - utils::TimeUtils::usnow();
+        if ( remain < usecs )
+        {
+            usecs = remain;
+        }
+        if ( usecs <= 0 )
+        {
+            return;
+        }
+    }
+    // 有等待备机确认的写请求时, 不能超过确认的超时时间, 确认由post()唤醒
+    if ( !m_UnackedWrites.empty() )
+    {
+        int64_t remain = m_UnackedWrites.front().timestamp + m_AckUsecs - utils::TimeUtils::usnow();
+        if ( remain < usecs )
+        {
+            usecs = remain;
+        }
+        if ( usecs <= 0 )
+        {
+            return;
+        }
     }
 
-    used_msecs = (int32_t)(utils::TimeUtils::now() - now);
-    if ( used_msecs >= 0 && used_msecs < m_Percision )
+    pthread_mutex_lock( &m_QueueLock );
+    if ( m_TaskQueue.empty() )
     {
-        utils::TimeUtils::sleep( m_Percision - used_msecs );
+        struct timeval now;
+        struct timespec outtime;
+        gettimeofday( &now, NULL );
+        outtime.tv_sec = now.tv_sec + usecs / 1000000;
+        outtime.tv_nsec = ( now.tv_usec + usecs % 1000000 ) * 1000;
+        if ( outtime.tv_nsec >= 1000000000 )
+        {
+            outtime.tv_sec += 1;
+            outtime.tv_nsec -= 1000000000;
+        }
+
+        m_IsWaiting = true;
+        pthread_cond_timedwait( &m_QueueCond, &m_QueueLock, &outtime );
+        m_IsWaiting = false;
     }
+    pthread_mutex_unlock( &m_QueueLock );
 }
 
-void CClientProxy::stop()
+void CClientProxy::onStop()
 {
-    // 处理全部
+    // 处理全部, 不再等待备机确认
     this->execute();
-
-    if ( m_Binlogs != NULL )
+    while ( !m_Scans.empty()
+            || !m_UnsyncedWrites.empty() || !m_UnackedWrites.empty() )
     {
-        delete m_Binlogs;
-        m_Binlogs = NULL;
+        this->syncGroup();
+        this->checkAcks( true );
+        this->execute();
     }
+    this->flush();
 
-    LOG_INFO( "CClientProxy Stoped .\n" );
+    LOG_INFO( "CClientProxy(%d) Stoped .\n", m_Index );
 }
 
 void CClientProxy::post( int32_t type, void * task )
@@ -110,6 +281,11 @@ void CClientProxy::post( int32_t type, void * task )
     pthread_mutex_lock( &m_QueueLock );
     Task tmp( type, task );
     m_TaskQueue.push_back( tmp );
+    m_QueueSize = m_TaskQueue.size();
+    if ( m_IsWaiting )
+    {
+        pthread_cond_signal( &m_QueueCond );
+    }
     pthread_mutex_unlock( &m_QueueLock );
 }
 
@@ -120,6 +296,7 @@ void CClientProxy::execute()
     // swap
     pthread_mutex_lock( &m_QueueLock );
     std::swap( taskqueue, m_TaskQueue );
+    m_QueueSize = 0;
     pthread_mutex_unlock( &m_QueueLock );
 
     // loop, and process
@@ -128,6 +305,29 @@ void CClientProxy::execute()
     {
         this->doTask( *iter );
     }
+
+    // 通配符查询每轮只执行一批, 避免阻塞其他请求
+    this->scan();
+
+    // 提交剩余的写请求
+    this->commitGroup();
+    this->checkSync();
+    this->checkAcks();
+
+    // 发送本轮的回应
+    this->flush();
+
+    // 发布统计的快照
+    pthread_mutex_lock( &m_StatusLock );
+    m_StatusSnapshot = m_ServerStatus;
+    pthread_mutex_unlock( &m_StatusLock );
+}
+
+void CClientProxy::getStatus( ServerStatus & status )
+{
+    pthread_mutex_lock( &m_StatusLock );
+    status = m_StatusSnapshot;
+    pthread_mutex_unlock( &m_StatusLock );
 }
 
 void CClientProxy::doTask( const Task & t )
@@ -138,13 +338,19 @@ void CClientProxy::doTask( const Task & t )
         case eTaskType_Client :
             {
                 CacheMessage * msg = static_cast<CacheMessage *>(t.task);
-                this->process( msg );
-                delete msg;
+                this->dispatch( msg );
             }
             break;
 
+        case eTaskType_SyncAck :
+            // 备机确认, 在execute()中回应
+            break;
+
         case eTaskType_Middleware :
             {
+                this->commitGroup();
+                this->syncGroup();
+
                 IMiddlewareTask * msg = static_cast<IMiddlewareTask *>(t.task);
                 msg->process();
                 delete msg;
@@ -156,270 +362,1213 @@ void CClientProxy::doTask( const Task & t )
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-////////////////////////////////////////////////////////////////////////////////
-
-static const char * MEMCACHED_RESPONSE_STORED       = "STORED\r\n";
-static const char * MEMCACHED_RESPONSE_NOT_STORED   = "NOT_STORED\r\n";
-static const char * MEMCACHED_RESPONSE_UNKNOWN      = "ERROR unknown command:";
-static const char * MEMCACHED_RESPONSE_VALUES_END   = "END\r\n";
-static const char * MEMCACHED_RESPONSE_DELETED      = "DELETED\r\n";
-static const char * MEMCACHED_RESPONSE_NOT_FOUND    = "NOT_FOUND\r\n";
-static const char * MEMCACHED_RESPONSE_VERSION      = "VERSION";
-static const char * MEMCACHED_RESPONSE_ERROR        = "ERROR\r\n";
-static const char * MEMCACHED_RESPONSE_CLIENTERROR  = "CLIENT_ERROR";
-static const char * MEMCACHED_RESPONSE_SERVERERROR  = "SERVER_ERROR";
+void CClientProxy::send( sid_t sid, const std::string & data )
+{
+    this->send( sid, data.data(), data.size() );
+}
 
-void CClientProxy::process( CacheMessage * message )
+void CClientProxy::send( sid_t sid, const char * data, uint32_t len )
 {
-    // TODO:  确保消息中的key确实是在本线程中处理
+    OutputBuffer * output = m_LastOutput;
 
-    if ( message->getItem() != NULL )
+    if ( output == NULL || m_LastSid != sid )
     {
-        if ( message->isCommand( "add" ) )
-        {
-            this->add( message );
-        }
-        else if ( message->isCommand( "set" ) )
-        {
-            this->set( message );
-        }
-        else if ( message->isCommand( "delete" ) )
-        {
-            this->del( message );
-        }
-        else if ( message->isCommand( "incr" ) )
-        {
-            this->calc( message, 1 );
-        }
-        else if ( message->isCommand( "decr" ) )
-        {
-            this->calc( message, -1 );
-        }
-        // TODO: 增加memcache协议
-        else
+        OutputBuffers::iterator it = m_Outputs.find( sid );
+        if ( it == m_Outputs.end() )
         {
-            this->error( message );
+            OutputBuffer buffer = { NULL, 0, 0 };
+            it = m_Outputs.insert( std::make_pair( sid, buffer ) ).first;
         }
+
+        m_LastSid = sid;
+        m_LastOutput = output = &( it->second );
     }
-    else
+
+    if ( output->size + len > output->capacity )
     {
-        if ( message->isCommand( "get" ) || message->isCommand( "gets" ) )
+        uint32_t capacity = output->capacity == 0 ? eOutput_InitialSize : output->capacity;
+        while ( capacity < output->size + len )
         {
-            this->gets( message );
+            capacity <<= 1;
         }
-        else if ( message->isCommand( "version" ) )
-        {
-            this->version( message );
-        }
-        else if ( message->isCommand( "stats" ) )
+
+        char * data = (char *)realloc( output->data, capacity );
+        if ( data == NULL )
         {
-            this->stat( message );
+            LOG_ERROR( "CClientProxy::send(SID:%lu, %u) : out of memory .\n", sid, len );
+            return;
         }
-        else if ( message->isCommand( "dump" ) )
+
+        output->data = data;
+        output->capacity = capacity;
+    }
+
+    memcpy( output->data + output->size, data, len );
+    output->size += len;
+
+    // 缓冲区过大时立即发送
+    if ( output->size >= eOutput_FlushSize )
+    {
+        CDataServer::getInstance().getService()->send( sid, output->data, output->size, true );
+        output->data = NULL;
+        output->size = 0;
+        output->capacity = 0;
+    }
+}
+
+void CClientProxy::flush()
+{
+    OutputBuffers::iterator it;
+
+    for ( it = m_Outputs.begin(); it != m_Outputs.end(); ++it )
+    {
+        OutputBuffer & output = it->second;
+
+        if ( output.size > 0 )
         {
-            this->dump( message );
+            // 网络层负责释放
+            CDataServer::getInstance().getService()->send( it->first, output.data, output.size, true );
         }
-        // TODO: 增加memcache协议
         else
         {
-            this->error( message );
+            free( output.data );
         }
     }
 
+    m_Outputs.clear();
+    m_LastSid = 0;
+    m_LastOutput = NULL;
 }
 
-void CClientProxy::add( CacheMessage * message )
+void CClientProxy::dispatch( CacheMessage * msg )
 {
-    bool rc = false;
+    // 同一个会话的通配符查询还未完成, 保证回应有序
+    ScanCursors::iterator it = m_Scans.find( msg->getSid() );
+    if ( it != m_Scans.end() )
+    {
+        it->second->blocked.push_back( msg );
+        return;
+    }
 
-    Transaction trans( m_Binlogs );
-    std::string key = encode_kv_key( message->getItem()->getKey() );
-    m_Binlogs->Put( key, message->getItem()->getValue() );
-    m_Binlogs->addLog( BinlogCommand::SET, key );
-    rc = m_Binlogs->commit();
-    if( rc )
+    // 同一个会话还有写请求在等待备机确认
+    if ( this->hold( msg ) )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_STORED, strlen(MEMCACHED_RESPONSE_STORED) );
+        return;
     }
-    else
+
+    // 写请求等到批量提交后才回应
+    if ( !this->process( msg ) )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_NOT_STORED, strlen(MEMCACHED_RESPONSE_NOT_STORED) );
-        LOG_ERROR( "CDataServer::add(KEY:'%s') failed .\n", message->getItem()->getKey().c_str() );
+        this->finish( msg );
     }
 }
 
-void CClientProxy::set( CacheMessage * message )
+void CClientProxy::finish( CacheMessage * msg )
 {
-    bool rc = false;
+    // 统计请求的延时
+    m_ServerStatus.addLatency( utils::TimeUtils::usnow() - msg->getTimestamp() );
 
-    Transaction trans( m_Binlogs );
-    std::string key = encode_kv_key( message->getItem()->getKey() );
-    m_Binlogs->Put( key, message->getItem()->getValue() );
-    m_Binlogs->addLog( BinlogCommand::SET, key );
-    rc = m_Binlogs->commit();
-    if ( rc )
+    // 回应已经发出, 会话可以切换工作线程
+    CSessionContext * context = static_cast<CSessionContext *>( msg->getContext() );
+    if ( context == NULL )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_STORED, strlen(MEMCACHED_RESPONSE_STORED) );
+        delete msg;
+        return;
     }
-    else
+
+    // 先回收消息, 上下文可能随最后一个引用释放
+    context->getMessagePool()->recycle( msg );
+    context->release();
+}
+
+void CClientProxy::barrier( CacheMessage * msg )
+{
+    // 读到之前的写入
+    this->commitGroup();
+
+    // 同一个会话还有写请求在等待fsync, 先回应它们
+    for ( size_t i = 0; i < m_UnsyncedWrites.size(); ++i )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_NOT_STORED, strlen(MEMCACHED_RESPONSE_NOT_STORED) );
-        LOG_ERROR( "CDataServer::set(KEY:'%s') failed .\n", message->getItem()->getKey().c_str() );
+        if ( m_UnsyncedWrites[i].message->getSid() == msg->getSid() )
+        {
+            this->syncGroup();
+            break;
+        }
     }
-
-    m_ServerStatus.addSetOps();
 }
 
-void CClientProxy::del( CacheMessage * message )
+void CClientProxy::beginGroup()
 {
-    bool rc = false;
+    if ( m_GroupTimestamp != 0 )
+    {
+        return;
+    }
 
-    Transaction trans( m_Binlogs );
+    m_GroupTimestamp = utils::TimeUtils::usnow();
+}
 
-    std::string key = encode_kv_key( message->getItem()->getKey() );
-    m_Binlogs->begin();
-    m_Binlogs->Delete( key );
-    m_Binlogs->addLog( BinlogCommand::DEL, key );
-    rc = m_Binlogs->commit();
-    if ( rc )
+void CClientProxy::appendGroup( char cmd, const std::string & key, const std::string & value )
+{
+    m_GroupLogs.push_back( GroupLog() );
+    m_GroupLogs.back().cmd = cmd;
+    m_GroupLogs.back().key = key;
+    m_GroupLogs.back().value = value;
+}
+
+void CClientProxy::deferGroup( CacheMessage * msg, const char * succeed, const char * failed, const std::string & value, bool locked )
+{
+    m_PendingWrites.push_back( PendingWrite() );
+    m_PendingWrites.back().message = msg;
+    m_PendingWrites.back().succeed = succeed;
+    m_PendingWrites.back().failed = failed;
+    m_PendingWrites.back().value = value;
+    m_PendingWrites.back().seq = 0;
+    m_PendingWrites.back().committed = false;
+    m_PendingWrites.back().timestamp = 0;
+
+    // 批量事务按照要求最高的持久化方式提交
+    int8_t durability = msg->getDurability();
+    if ( durability == Durability::DEFAULT )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_DELETED, strlen(MEMCACHED_RESPONSE_DELETED) );
+        durability = m_Durability;
     }
-    else
+    if ( durability > m_GroupDurability )
+    {
+        m_GroupDurability = durability;
+    }
+
+    // 达到批量的上限
+    if ( locked
+            || m_PendingWrites.size() >= m_BatchSize
+            || utils::TimeUtils::usnow() - m_GroupTimestamp >= m_BatchUsecs )
     {
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_NOT_FOUND, strlen(MEMCACHED_RESPONSE_NOT_FOUND) );
-        LOG_ERROR( "CDataServer::del(KEY:'%s') failed .\n", message->getItem()->getKey().c_str() );
+        this->commitGroup( locked );
     }
 }
 
-void CClientProxy::gets( CacheMessage * message )
+void CClientProxy::commitGroup( bool locked )
 {
-    std::string response;
-    CacheMessage::Keys::iterator iter;
+    bool rc = false;
+    bool sync = false;
+    uint64_t seq = 0;
+
+    if ( m_GroupTimestamp == 0 )
+    {
+        return;
+    }
 
-    for ( iter = message->getKeyList().begin(); iter != message->getKeyList().end(); ++iter )
+    // 所有写请求一次写入leveldb, 只在提交时独占binlog, 保证seq是连续的
+    if ( !m_PendingWrites.empty() )
     {
-        std::string key = encode_kv_key( *iter );
-        int32_t npos = key.find( "*" );
-        if ( npos != -1 )
+        if ( !locked )
         {
-            std::string prefix = key.substr( 0, npos );
+            m_Binlogs->lock();
+        }
 
-            LeveldbFetcher fetcher( response );
-            CDataServer::getInstance().getStorageEngine()->foreach( prefix, fetcher );
+        int64_t start = utils::TimeUtils::usnow();
 
-            continue;
+        m_Binlogs->begin();
+        for ( size_t i = 0; i < m_GroupLogs.size(); ++i )
+        {
+            const GroupLog & log = m_GroupLogs[i];
+            if ( log.cmd == BinlogCommand::DEL )
+            {
+                m_Binlogs->Delete( log.key );
+            }
+            else
+            {
+                m_Binlogs->Put( log.key, log.value );
+            }
+            m_Binlogs->addLog( log.cmd, log.key, log.value );
         }
 
-        Value value;
-        bool rc = CDataServer::getInstance().getStorageEngine()->get( key, value );
-        if ( rc )
+        sync = ( m_GroupDurability == Durability::SYNC );
+        rc = m_Binlogs->commit( sync );
+        seq = m_Binlogs->getLastSeq();
+        m_Binlogs->rollback();
+        m_Binlogs->unlock();
+
+        if ( sync )
         {
-            std::string prefix;
-            utils::Utility::snprintf( prefix, key.size()+512,
-                    "VALUE %s 0 %d\r\n", key.c_str(), value.size() );
-            response += prefix;
-            response += value;
-            response += "\r\n";
+            m_ServerStatus.addSync( utils::TimeUtils::usnow() - start );
         }
+    }
+    else if ( locked )
+    {
+        m_Binlogs->unlock();
+    }
+    m_GroupLogs.clear();
+    m_GroupTimestamp = 0;
 
-        m_ServerStatus.addGetOps();
+    if ( m_PendingWrites.empty() )
+    {
+        return;
     }
 
-    response += MEMCACHED_RESPONSE_VALUES_END;
-    CDataServer::getInstance().getService()->send( message->getSid(), response );
-}
+    // 先回应之前等待fsync的写请求, 保证有序
+    if ( !rc )
+    {
+        this->syncGroup();
+    }
+    else if ( sync )
+    {
+        // 本次fsync已经覆盖了它们
+        this->replyUnsynced( true );
+    }
 
-void CClientProxy::stat( CacheMessage * message )
-{
-    char data[ 512 ];
-    std::string response;
-    uint64_t sec = 0, usec = 0;
+    for ( size_t i = 0; i < m_PendingWrites.size(); ++i )
+    {
+        PendingWrite & w = m_PendingWrites[i];
+        w.seq = seq;
 
-    m_ServerStatus.refresh();
+        // GROUP方式, 或者之前还有写请求在等待fsync时, fsync之后再回应
+        if ( rc && !sync
+                && ( m_GroupDurability == Durability::GROUP || !m_UnsyncedWrites.empty() ) )
+        {
+            if ( m_UnsyncedWrites.empty() )
+            {
+                m_SyncTimestamp = utils::TimeUtils::usnow();
+            }
+            m_UnsyncedWrites.push_back( w );
+            continue;
+        }
 
-    sprintf( data, "STAT pid %u\r\n", m_ServerStatus.getPid() );
-    response += data;
+        this->confirm( w, rc );
+    }
 
-    sprintf( data, "STAT uptime %ld\r\n", m_ServerStatus.getNowTime() - m_ServerStatus.getStartTime() );
-    response += data;
+    m_PendingWrites.clear();
+    m_GroupDurability = Durability::ASYNC;
 
-    sprintf( data, "STAT time %ld\r\n", m_ServerStatus.getNowTime() );
-    response += data;
+    this->checkSync();
+}
 
-    m_ServerStatus.getUserUsage( sec, usec );
-    sprintf( data, "STAT rusage_user %ld.%06ld\r\n", sec, usec );
-    response += data;
+void CClientProxy::checkSync()
+{
+    if ( m_UnsyncedWrites.empty() )
+    {
+        return;
+    }
 
-    m_ServerStatus.getSystemUsage( sec, usec );
-    sprintf( data, "STAT rusage_system %ld.%06ld\r\n", sec, usec );
-    response += data;
+    if ( m_UnsyncedWrites.size() >= m_SyncWrites
+            || utils::TimeUtils::usnow() - m_SyncTimestamp >= m_SyncUsecs )
+    {
+        this->syncGroup();
+    }
+}
 
-    response += "STAT curr_items 0\r\n";
-    response += "STAT total_items 0\r\n";
+void CClientProxy::syncGroup()
+{
+    if ( m_UnsyncedWrites.empty() )
+    {
+        return;
+    }
 
-    sprintf( data, "STAT cmd_get %ld\r\n", m_ServerStatus.getGetOps() );
-    response += data;
-    sprintf( data, "STAT cmd_set %ld\r\n", m_ServerStatus.getSetOps() );
-    response += data;
+    int64_t start = utils::TimeUtils::usnow();
+    bool rc = m_Binlogs->sync();
+    m_ServerStatus.addSync( utils::TimeUtils::usnow() - start );
 
-    response += "STAT get_hits 0\r\n";
-    response += "STAT get_misses 0\r\n";
-    response += "END\r\n";
+    if ( !rc )
+    {
+        LOG_ERROR( "CClientProxy::syncGroup(%lu) failed .\n", m_UnsyncedWrites.size() );
+    }
 
-    CDataServer::getInstance().getService()->send( message->getSid(), response );
+    this->replyUnsynced( rc );
 }
 
-void CClientProxy::error( CacheMessage * message )
+void CClientProxy::replyUnsynced( bool succeed )
 {
-    std::string err = MEMCACHED_RESPONSE_UNKNOWN;
-    err += message->getCmd();
-    err += "\r\n";
+    for ( size_t i = 0; i < m_UnsyncedWrites.size(); ++i )
+    {
+        this->confirm( m_UnsyncedWrites[i], succeed );
+    }
 
-    CDataServer::getInstance().getService()->send( message->getSid(), err );
+    m_SyncTimestamp = 0;
+    m_UnsyncedWrites.clear();
 }
 
-void CClientProxy::version( CacheMessage * message )
+void CClientProxy::confirm( const PendingWrite & w, bool succeed )
 {
-    std::string version = MEMCACHED_RESPONSE_VERSION;
+    sid_t sid = w.message->getSid();
 
-    version += " ";
-    version += __APPVERSION__;
+    std::map<sid_t, uint32_t>::iterator it = m_UnackedSessions.find( sid );
+    if ( it == m_UnackedSessions.end() )
+    {
+        BackendSync * backend = CDataServer::getInstance().getBackendSync();
+
+        // 没有开启半同步, 失败, 已经退化为异步, 或者已经确认
+        if ( m_AckSlaves == 0 || backend == NULL
+                || !succeed || m_AckDegraded || w.seq <= backend->getAckedSeq() )
+        {
+            this->reply( w, succeed );
+            return;
+        }
+
+        it = m_UnackedSessions.insert( std::make_pair( sid, 0U ) ).first;
+    }
+
+    // 同一个会话之前的写请求还没有回应时, 失败的也需要排队
+    ++it->second;
+    m_UnackedWrites.push_back( w );
+    m_UnackedWrites.back().committed = succeed;
+    m_UnackedWrites.back().timestamp = utils::TimeUtils::usnow();
+}
+
+void CClientProxy::checkAcks( bool force )
+{
+    if ( m_AckSlaves == 0 )
+    {
+        return;
+    }
+
+    BackendSync * backend = CDataServer::getInstance().getBackendSync();
+    uint64_t ackedseq = backend != NULL ? backend->getAckedSeq() : 0;
+    int64_t now = utils::TimeUtils::usnow();
+
+    // 备机追上之后恢复半同步
+    if ( m_AckDegraded && ackedseq >= m_AckDegradedSeq )
+    {
+        LOG_INFO( "CClientProxy(%d) semi-sync resumed at seq %llu .\n", m_Index, ackedseq );
+        m_AckDegraded = false;
+    }
+
+    while ( !m_UnackedWrites.empty() )
+    {
+        PendingWrite w = m_UnackedWrites.front();
+
+        if ( !force && !m_AckDegraded
+                && w.committed && w.seq > ackedseq )
+        {
+            if ( now - w.timestamp < m_AckUsecs )
+            {
+                break;
+            }
+
+            // 超时, 退化为异步
+            m_AckDegraded = true;
+            m_AckDegradedSeq = w.seq;
+            m_ServerStatus.addAckTimeouts();
+            LOG_WARN( "CClientProxy(%d) semi-sync timeout at seq %llu, acked seq %llu .\n",
+                    m_Index, w.seq, ackedseq );
+        }
+
+        m_UnackedWrites.pop_front();
+
+        sid_t sid = w.message->getSid();
+        this->reply( w, w.committed );
+
+        std::map<sid_t, uint32_t>::iterator it = m_UnackedSessions.find( sid );
+        if ( it != m_UnackedSessions.end() && --it->second == 0 )
+        {
+            m_UnackedSessions.erase( it );
+            this->resume( sid );
+        }
+    }
+}
+
+bool CClientProxy::hold( CacheMessage * msg )
+{
+    if ( m_AckSlaves == 0 )
+    {
+        return false;
+    }
+
+    BlockedMessages::iterator it = m_AckBlocked.find( msg->getSid() );
+    if ( it == m_AckBlocked.end() )
+    {
+        // 写请求的回应在队列中排队, 不需要阻塞
+        if ( msg->getItem() != NULL )
+        {
+            return false;
+        }
+
+        // 之前的写请求提交之后才知道是否需要等待
+        this->barrier( msg );
+        if ( m_UnackedSessions.find( msg->getSid() ) == m_UnackedSessions.end() )
+        {
+            return false;
+        }
+
+        it = m_AckBlocked.insert(
+                std::make_pair( msg->getSid(), std::deque<CacheMessage *>() ) ).first;
+    }
+
+    it->second.push_back( msg );
+    return true;
+}
+
+void CClientProxy::resume( sid_t sid )
+{
+    BlockedMessages::iterator it = m_AckBlocked.find( sid );
+    if ( it == m_AckBlocked.end() )
+    {
+        return;
+    }
+
+    std::deque<CacheMessage *> blocked;
+    blocked.swap( it->second );
+    m_AckBlocked.erase( it );
+
+    // 按照顺序处理, 遇到新的等待时重新阻塞
+    while ( !blocked.empty() )
+    {
+        CacheMessage * msg = blocked.front();
+        blocked.pop_front();
+        this->dispatch( msg );
+    }
+}
+
+void CClientProxy::reply( const PendingWrite & w, bool succeed )
+{
+    if ( !succeed )
+    {
+        LOG_ERROR( "CClientProxy::reply(CMD:'%s', KEY:'%s') failed .\n",
+                w.message->getCmd(), w.message->getItem()->getKey().c_str() );
+    }
+
+    if ( w.message->isBinary() )
+    {
+        // quiet请求成功时不回应
+        if ( !succeed || !w.message->isQuiet() )
+        {
+            std::string response = w.value;
+            if ( !succeed || response.empty() )
+            {
+                response.clear();
+                BinaryProtocol::encode( response, w.message,
+                        succeed ? BinaryProtocol::eStatus_OK : BinaryProtocol::eStatus_InternalError );
+            }
+            this->send( w.message->getSid(), response );
+        }
+    }
+    else if ( !succeed )
+    {
+        this->send( w.message->getSid(), w.failed, strlen(w.failed) );
+    }
+    else if ( !w.value.empty() )
+    {
+        this->send( w.message->getSid(), w.value );
+    }
+    else
+    {
+        this->send( w.message->getSid(), w.succeed, strlen(w.succeed) );
+    }
+
+    this->finish( w.message );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+static const char * MEMCACHED_RESPONSE_STORED       = "STORED\r\n";
+static const char * MEMCACHED_RESPONSE_NOT_STORED   = "NOT_STORED\r\n";
+static const char * MEMCACHED_RESPONSE_UNKNOWN      = "ERROR unknown command:";
+static const char * MEMCACHED_RESPONSE_VALUES_END   = "END\r\n";
+static const char * MEMCACHED_RESPONSE_DELETED      = "DELETED\r\n";
+static const char * MEMCACHED_RESPONSE_NOT_FOUND    = "NOT_FOUND\r\n";
+static const char * MEMCACHED_RESPONSE_VERSION      = "VERSION";
+static const char * MEMCACHED_RESPONSE_ERROR        = "ERROR\r\n";
+static const char * MEMCACHED_RESPONSE_CLIENTERROR  = "CLIENT_ERROR";
+static const char * MEMCACHED_RESPONSE_SERVERERROR  = "SERVER_ERROR";
+static const char * MEMCACHED_RESPONSE_STALE        = "SERVER_ERROR stale\r\n";
+
+bool CClientProxy::process( CacheMessage * message )
+{
+    if ( message->getItem() != NULL )
+    {
+        if ( message->isCommand( "add" ) )
+        {
+            return this->add( message );
+        }
+        else if ( message->isCommand( "set" ) )
+        {
+            return this->set( message );
+        }
+        else if ( message->isCommand( "delete" ) )
+        {
+            return this->del( message );
+        }
+        else if ( message->isCommand( "incr" ) )
+        {
+            return this->calc( message, 1 );
+        }
+        else if ( message->isCommand( "decr" ) )
+        {
+            return this->calc( message, -1 );
+        }
+        // TODO: 增加memcache协议
+        else
+        {
+            this->barrier( message );
+            this->error( message );
+        }
+    }
+    else
+    {
+        // 读请求之前提交, 保证读到之前的写入并且回应有序
+        this->barrier( message );
+
+        if ( message->isCommand( "get" ) || message->isCommand( "gets" ) )
+        {
+            return this->gets( message );
+        }
+        else if ( message->isCommand( "version" ) )
+        {
+            this->version( message );
+        }
+        else if ( message->isCommand( "noop" ) )
+        {
+            this->noop( message );
+        }
+        else if ( message->isCommand( "stats" ) )
+        {
+            this->stat( message );
+        }
+        else if ( message->isCommand( "dump" ) )
+        {
+            this->dump( message );
+        }
+        // TODO: 增加memcache协议
+        else
+        {
+            this->error( message );
+        }
+    }
+
+    return false;
+}
+
+bool CClientProxy::add( CacheMessage * message )
+{
+    this->beginGroup();
+
+    std::string key = encode_kv_key( message->getItem()->getKey() );
+    this->appendGroup( BinlogCommand::SET, key, message->getItem()->getValue() );
+    this->deferGroup( message, MEMCACHED_RESPONSE_STORED, MEMCACHED_RESPONSE_NOT_STORED );
+
+    return true;
+}
+
+bool CClientProxy::set( CacheMessage * message )
+{
+    this->beginGroup();
+
+    std::string key = encode_kv_key( message->getItem()->getKey() );
+    this->appendGroup( BinlogCommand::SET, key, message->getItem()->getValue() );
+    m_ServerStatus.addSetOps();
+    this->deferGroup( message, MEMCACHED_RESPONSE_STORED, MEMCACHED_RESPONSE_NOT_STORED );
+
+    return true;
+}
+
+bool CClientProxy::del( CacheMessage * message )
+{
+    this->beginGroup();
+
+    std::string key = encode_kv_key( message->getItem()->getKey() );
+    this->appendGroup( BinlogCommand::DEL, key );
+    this->deferGroup( message, MEMCACHED_RESPONSE_DELETED, MEMCACHED_RESPONSE_NOT_FOUND );
+
+    return true;
+}
+
+bool CClientProxy::gets( CacheMessage * message )
+{
+    size_t nkeys = message->getKeyCount();
+    std::string & response = m_Response;
+
+    // 备机的数据超过能接受的延迟时, 由客户端到主机读取
+    CSlaveProxy * slave = CDataServer::getInstance().getSlaveProxy();
+    if ( message->getMaxStale() > 0 && slave != NULL )
+    {
+        int64_t staleness = slave->getStaleness();
+        if ( staleness < 0 || staleness > (int64_t)message->getMaxStale() )
+        {
+            m_ServerStatus.addStaleReads();
+            this->respond( message, MEMCACHED_RESPONSE_STALE, BinaryProtocol::eStatus_NotMyVbucket );
+            return false;
+        }
+    }
+
+    // 通配符只支持文本协议, 按照游标分批查询
+    if ( !message->isBinary() )
+    {
+        for ( size_t i = 0; i < nkeys; ++i )
+        {
+            if ( message->getKey( i ).find( '*' ) == std::string::npos )
+            {
+                continue;
+            }
+
+            ScanCursor * c = new ScanCursor;
+            c->message = message;
+            c->index = 0;
+            c->count = 0;
+
+            // 先执行一批, 结果较少时直接回应
+            if ( this->step( c ) )
+            {
+                delete c;
+                return false;
+            }
+
+            m_Scans.insert( std::make_pair( message->getSid(), c ) );
+            return true;
+        }
+    }
+
+    // GETK/GETKQ的回应带回KEY
+    bool withkey = message->getOpcode() == BinaryProtocol::eOpcode_GetK
+        || message->getOpcode() == BinaryProtocol::eOpcode_GetKQ;
+
+    // 所有KEY一次批量读取
+    m_MultiKeys.resize( nkeys );
+    for ( size_t i = 0; i < nkeys; ++i )
+    {
+        m_MultiKeys[i].assign( 1, DataType::KV );
+        m_MultiKeys[i].append( message->getKey( i ) );
+    }
+
+    m_Engine->multiGet( m_MultiKeys, m_MultiValues, m_MultiFounds );
+
+    // 一次分配回应需要的内存
+    size_t length = 5;
+    for ( size_t i = 0; i < nkeys; ++i )
+    {
+        if ( m_MultiFounds[i] )
+        {
+            length += m_MultiValues[i].size() + message->getKey(i).size() + 48;
+        }
+    }
+    response.clear();
+    response.reserve( length );
+
+    for ( size_t i = 0; i < nkeys; ++i )
+    {
+        bool rc = m_MultiFounds[i];
+        const Value & value = m_MultiValues[i];
+        const std::string & rawkey = message->getKey( i );
+
+        if ( !message->isBinary() )
+        {
+            if ( rc )
+            {
+                append_value( response, rawkey, value );
+            }
+        }
+        else if ( rc )
+        {
+            // extras: flags(4)
+            static const char flags[ 4 ] = { 0 };
+            BinaryProtocol::encode( response, message, BinaryProtocol::eStatus_OK,
+                    Slice( flags, sizeof(flags) ), withkey ? Slice( rawkey ) : Slice(), value );
+        }
+        else if ( !message->isQuiet() )
+        {
+            BinaryProtocol::encode( response, message, BinaryProtocol::eStatus_KeyNotFound,
+                    Slice(), withkey ? Slice( rawkey ) : Slice(), Slice() );
+        }
+
+        m_ServerStatus.addGetOps();
+        if ( rc )
+        {
+            m_ServerStatus.addGetHits();
+        }
+        else
+        {
+            m_ServerStatus.addGetMisses();
+        }
+    }
+
+    if ( !message->isBinary() )
+    {
+        response += MEMCACHED_RESPONSE_VALUES_END;
+    }
+
+    // quiet请求未命中时没有回应
+    if ( !response.empty() )
+    {
+        this->send( message->getSid(), response );
+    }
+
+    // 不长期占用过大的内存
+    if ( response.capacity() > eOutput_FlushSize )
+    {
+        std::string().swap( response );
+    }
+
+    return false;
+}
+
+void CClientProxy::scan()
+{
+    std::vector<ScanCursor *> done;
+
+    for ( ScanCursors::iterator it = m_Scans.begin(); it != m_Scans.end(); ++it )
+    {
+        if ( this->step( it->second ) )
+        {
+            done.push_back( it->second );
+        }
+    }
+
+    for ( size_t i = 0; i < done.size(); ++i )
+    {
+        m_Scans.erase( done[i]->message->getSid() );
+        this->complete( done[i] );
+    }
+}
+
+bool CClientProxy::step( ScanCursor * c )
+{
+    CacheMessage * message = c->message;
+    std::string & response = m_Response;
+
+    response.clear();
+
+    // 按照KEY的顺序回应, 每批不超过eScan_ChunkSize
+    while ( c->index < message->getKeyCount()
+            && response.size() < eScan_ChunkSize )
+    {
+        const std::string & rawkey = message->getKey( c->index );
+        std::string key = encode_kv_key( rawkey );
+
+        KeyPattern pattern( key );
+        if ( !pattern.isWildcard() )
+        {
+            Value value;
+            bool rc = m_Engine->get( key, value );
+            if ( rc )
+            {
+                append_value( response, rawkey, value );
+            }
+
+            m_ServerStatus.addGetOps();
+            if ( rc )
+            {
+                m_ServerStatus.addGetHits();
+            }
+            else
+            {
+                m_ServerStatus.addGetMisses();
+            }
+
+            ++c->index;
+            continue;
+        }
+
+        // 本批最多返回的个数
+        uint32_t count = eScan_ChunkItems;
+        if ( message->getLimit() != 0
+                && message->getLimit() - c->count < count )
+        {
+            count = message->getLimit() - c->count;
+        }
+
+        bool more = false;
+        if ( count > 0 )
+        {
+            LeveldbFetcher fetcher( response, eScan_ChunkSize );
+            more = m_Engine->scan( pattern, c->cursor, count, fetcher );
+            c->count += fetcher.count;
+        }
+
+        if ( more )
+        {
+            // 让出, 下一轮继续
+            break;
+        }
+
+        ++c->index;
+        c->cursor.clear();
+    }
+
+    bool done = c->index >= message->getKeyCount();
+    if ( done )
+    {
+        response += MEMCACHED_RESPONSE_VALUES_END;
+    }
+
+    if ( !response.empty() )
+    {
+        this->send( message->getSid(), response );
+    }
+
+    // 不长期占用过大的内存
+    if ( response.capacity() > eOutput_FlushSize )
+    {
+        std::string().swap( response );
+    }
+
+    return done;
+}
+
+void CClientProxy::complete( ScanCursor * c )
+{
+    std::deque<CacheMessage *> blocked;
+
+    blocked.swap( c->blocked );
+    this->finish( c->message );
+    delete c;
+
+    // 按照顺序处理同一个会话后续的请求
+    while ( !blocked.empty() )
+    {
+        CacheMessage * msg = blocked.front();
+        blocked.pop_front();
+
+        // 可能又开始了新的通配符查询, 或者需要等待备机确认
+        this->dispatch( msg );
+    }
+}
+
+void CClientProxy::collect( uint8_t index, ServerStatus & status )
+{
+    if ( index == m_Index )
+    {
+        status = m_ServerStatus;
+    }
+    else
+    {
+        CDataServer::getInstance().getClientProxy( index )->getStatus( status );
+    }
+}
+
+void CClientProxy::stat( CacheMessage * message )
+{
+    std::string response;
+    uint64_t sec = 0, usec = 0;
+
+    // 分组统计
+    if ( message->getKeyCount() > 0 )
+    {
+        if ( message->getKey( 0 ) == "replication" )
+        {
+            this->statReplication( message );
+        }
+        else
+        {
+            this->error( message );
+        }
+        return;
+    }
+
+    StatWriter writer( message, response );
+    m_ServerStatus.refresh();
+
+    writer.add( "pid", "%u", m_ServerStatus.getPid() );
+    writer.add( "uptime", "%ld", m_ServerStatus.getNowTime() - m_ServerStatus.getStartTime() );
+    writer.add( "time", "%ld", m_ServerStatus.getNowTime() );
+
+    m_ServerStatus.getUserUsage( sec, usec );
+    writer.add( "rusage_user", "%ld.%06ld", sec, usec );
+
+    m_ServerStatus.getSystemUsage( sec, usec );
+    writer.add( "rusage_system", "%ld.%06ld", sec, usec );
+
+    writer.add( "curr_items", "0" );
+    writer.add( "total_items", "0" );
+
+    // 汇总所有工作线程
+    uint64_t getops = 0, setops = 0, syncusecs = 0;
+    uint64_t gethits = 0, getmisses = 0, stalereads = 0;
+    LatencyHistogram latency, synclatency;
+    uint8_t nworkers = CDataServer::getInstance().getClientProxyCount();
+    for ( uint8_t i = 0; i < nworkers; ++i )
+    {
+        ServerStatus status;
+        this->collect( i, status );
+        getops += status.getGetOps();
+        setops += status.getSetOps();
+        gethits += status.getGetHits();
+        getmisses += status.getGetMisses();
+        stalereads += status.getStaleReads();
+        latency.merge( status.getLatency() );
+        synclatency.merge( status.getSyncLatency() );
+        syncusecs += status.getSyncUsecs();
+    }
+
+    writer.add( "threads", "%u", nworkers );
+    writer.add( "cmd_get", "%lu", getops );
+    writer.add( "cmd_set", "%lu", setops );
+
+    writer.add( "get_hits", "%lu", gethits );
+    writer.add( "get_misses", "%lu", getmisses );
+
+    // 备机数据的延迟, 详细的见stats replication
+    CSlaveProxy * slave = CDataServer::getInstance().getSlaveProxy();
+    if ( slave != NULL )
+    {
+        writer.add( "slave_staleness_ms", "%ld", slave->getStaleness() );
+        writer.add( "slave_stale_reads", "%lu", stalereads );
+    }
+
+    // 热点数据缓存
+    ValueCache * cache = CDataServer::getInstance().getValueCache();
+    if ( cache != NULL )
+    {
+        writer.add( "valuecache_limit_bytes", "%lu", cache->getCapacity() );
+        writer.add( "valuecache_bytes", "%lu", cache->getBytes() );
+        writer.add( "valuecache_items", "%lu", cache->getCount() );
+        writer.add( "valuecache_hits", "%lu", cache->getHits() );
+        writer.add( "valuecache_misses", "%lu", cache->getMisses() );
+    }
+
+    // 持久化
+    switch ( m_Durability )
+    {
+        case Durability::SYNC :
+            writer.add( "durability", "sync" );
+            break;
+        case Durability::GROUP :
+            writer.add( "durability", "group" );
+            break;
+        default :
+            writer.add( "durability", "async" );
+            break;
+    }
+    writer.add( "fsync_count", "%lu", synclatency.count() );
+    writer.add( "fsync_total_us", "%lu", syncusecs );
+    writer.add( "fsync_p50_us", "%lu", synclatency.percentile( 0.50 ) );
+    writer.add( "fsync_p99_us", "%lu", synclatency.percentile( 0.99 ) );
+
+    // 延时分布, 单位微秒
+    writer.add( "latency_samples", "%lu", latency.count() );
+    writer.add( "latency_p50_us", "%lu", latency.percentile( 0.50 ) );
+    writer.add( "latency_p90_us", "%lu", latency.percentile( 0.90 ) );
+    writer.add( "latency_p99_us", "%lu", latency.percentile( 0.99 ) );
+    for ( uint32_t i = 0; i < LatencyHistogram::eMaxBuckets; ++i )
+    {
+        if ( latency.bucket( i ) != 0 )
+        {
+            char name[ 64 ];
+            snprintf( name, sizeof(name), "latency_lt_%luus", LatencyHistogram::bound( i ) );
+            writer.add( name, "%lu", latency.bucket( i ) );
+        }
+    }
+
+    writer.end();
+
+    this->send( message->getSid(), response );
+}
+
+void CClientProxy::statReplication( CacheMessage * message )
+{
+    std::string response;
+    StatWriter writer( message, response );
+    int64_t now = utils::TimeUtils::now();
+
+    BackendSync * backend = CDataServer::getInstance().getBackendSync();
+    CSlaveProxy * slave = CDataServer::getInstance().getSlaveProxy();
+
+    if ( backend != NULL )
+    {
+        writer.add( "role", "master" );
+    }
+    else if ( slave != NULL )
+    {
+        writer.add( "role", "slave" );
+    }
+    else
+    {
+        writer.add( "role", "none" );
+    }
+
+    uint64_t lastseq = m_Binlogs->getLastSeq();
+    writer.add( "binlog_lastseq", "%lu", lastseq );
+
+    // 主机, 每个备机的同步状态
+    if ( backend != NULL )
+    {
+        BackendSync::SlaveStatusMap slaves;
+        backend->getSlaveStatus( slaves );
+
+        // 半同步
+        uint64_t timeouts = 0;
+        uint8_t nworkers = CDataServer::getInstance().getClientProxyCount();
+        for ( uint8_t i = 0; i < nworkers; ++i )
+        {
+            ServerStatus status;
+            this->collect( i, status );
+            timeouts += status.getAckTimeouts();
+        }
+        writer.add( "semisync_slaves", "%u", backend->getSemiSyncSlaves() );
+        writer.add( "semisync_acked_seq", "%lu", backend->getAckedSeq() );
+        writer.add( "semisync_timeouts", "%lu", timeouts );
+
+        uint32_t index = 0;
+        writer.add( "connected_slaves", "%lu", slaves.size() );
+
+        BackendSync::SlaveStatusMap::const_iterator it;
+        for ( it = slaves.begin(); it != slaves.end(); ++it, ++index )
+        {
+            char prefix[ 32 ];
+            std::string name;
+            const BackendSync::SlaveStatus & s = it->second;
+
+            snprintf( prefix, sizeof(prefix), "slave%u_", index );
+
+            name = prefix; name += "sid";
+            writer.add( name.c_str(), "%lu", it->first );
+            name = prefix; name += "state";
+            writer.add( name.c_str(), "%s", BackendSync::getStatusName( s.status ) );
+            name = prefix; name += "realtime";
+            writer.add( name.c_str(), "%d", s.state == eSlaveState_Sync ? 1 : 0 );
+            name = prefix; name += "lastseq";
+            writer.add( name.c_str(), "%lu", s.lastseq );
+            name = prefix; name += "ackseq";
+            writer.add( name.c_str(), "%lu", s.ackseq );
+            name = prefix; name += "lag_seqs";
+            writer.add( name.c_str(), "%lu", lastseq > s.lastseq ? lastseq - s.lastseq : 0 );
+            name = prefix; name += "sent_entries";
+            writer.add( name.c_str(), "%lu", s.entries.total() );
+            name = prefix; name += "sent_bytes";
+            writer.add( name.c_str(), "%lu", s.bytes.total() );
+            name = prefix; name += "unacked_bytes";
+            writer.add( name.c_str(), "%lu",
+                    s.bytes.total() > s.ackbytes ? s.bytes.total() - s.ackbytes : 0 );
+            name = prefix; name += "entries_per_sec";
+            writer.add( name.c_str(), "%lu", s.entries.rate( now ) );
+            name = prefix; name += "bytes_per_sec";
+            writer.add( name.c_str(), "%lu", s.bytes.rate( now ) );
+
+            // 全量复制的进度
+            if ( s.partitions > 0 )
+            {
+                name = prefix; name += "copy_keys";
+                writer.add( name.c_str(), "%lu", s.copykeys );
+                name = prefix; name += "copy_partitions";
+                writer.add( name.c_str(), "%u/%u", s.copied, s.partitions );
+                if ( s.copykey.size() > 1 )
+                {
+                    // 去掉数据类型
+                    name = prefix; name += "copy_lastkey";
+                    writer.add( name.c_str(), "%s", s.copykey.c_str() + 1 );
+                }
+            }
+
+            name = prefix; name += "last_ack_ms";
+            writer.add( name.c_str(), "%ld", now - s.lastacktime );
+        }
+    }
+
+    // 备机, 写入的进度
+    if ( slave != NULL )
+    {
+        uint64_t entries = 0, entryrate = 0, byterate = 0;
+        slave->getApplyRate( entries, entryrate, byterate );
+
+        // 数据的延迟, -1表示还没有追上主机
+        uint64_t stalereads = 0;
+        uint8_t nworkers = CDataServer::getInstance().getClientProxyCount();
+        for ( uint8_t i = 0; i < nworkers; ++i )
+        {
+            ServerStatus status;
+            this->collect( i, status );
+            stalereads += status.getStaleReads();
+        }
+
+        uint64_t masterseq = slave->getMasterSeq();
+        uint64_t appliedseq = slave->getAppliedSeq();
+        writer.add( "slave_master_seq", "%lu", masterseq );
+        writer.add( "slave_lag_seqs", "%lu", masterseq > appliedseq ? masterseq - appliedseq : 0 );
+        writer.add( "slave_staleness_ms", "%ld", slave->getStaleness() );
+        writer.add( "slave_stale_reads", "%lu", stalereads );
+        writer.add( "slave_applied_seq", "%lu", appliedseq );
+        writer.add( "slave_applied_entries", "%lu", entries );
+        writer.add( "slave_apply_entries_per_sec", "%lu", entryrate );
+        writer.add( "slave_apply_bytes_per_sec", "%lu", byterate );
+    }
+
+    writer.end();
+
+    this->send( message->getSid(), response );
+}
+
+void CClientProxy::error( CacheMessage * message )
+{
+    if ( message->isBinary() )
+    {
+        this->respond( message, NULL, BinaryProtocol::eStatus_UnknownCommand );
+        return;
+    }
+
+    std::string err = MEMCACHED_RESPONSE_UNKNOWN;
+    err += message->getCmd();
+    err += "\r\n";
+
+    this->send( message->getSid(), err );
+}
+
+void CClientProxy::version( CacheMessage * message )
+{
+    if ( message->isBinary() )
+    {
+        std::string response;
+        BinaryProtocol::encode( response, message, BinaryProtocol::eStatus_OK, __APPVERSION__ );
+        this->send( message->getSid(), response );
+        return;
+    }
+
+    std::string version = MEMCACHED_RESPONSE_VERSION;
+
+    version += " ";
+    version += __APPVERSION__;
     version += "\r\n";
 
-    CDataServer::getInstance().getService()->send( message->getSid(), version );
+    this->send( message->getSid(), version );
 }
 
-void CClientProxy::calc( CacheMessage * message, int32_t value )
+void CClientProxy::noop( CacheMessage * message )
+{
+    // 只有二进制协议有noop, 通常用来结束一组quiet请求
+    if ( !message->isBinary() )
+    {
+        this->error( message );
+        return;
+    }
+
+    this->respond( message, NULL, BinaryProtocol::eStatus_OK );
+}
+
+void CClientProxy::respond( CacheMessage * message, const char * text, uint16_t status )
+{
+    if ( !message->isBinary() )
+    {
+        this->send( message->getSid(), text, strlen(text) );
+        return;
+    }
+
+    std::string response;
+    BinaryProtocol::encode( response, message, status );
+    this->send( message->getSid(), response );
+}
+
+bool CClientProxy::calc( CacheMessage * message, int32_t value )
 {
     Value v;
     bool rc = false;
-    char strvalue[ 64 ] = { 0 };
 
-    rc = CDataServer::getInstance().getStorageEngine()->get( message->getItem()->getKey(), v );
+    // 之前的写请求提交后才能读到
+    this->barrier( message );
+
+    // 读取和修改必须持有binlog的锁, 其他工作线程可能同时修改这个KEY
+    m_Binlogs->lock();
+    std::string key = encode_kv_key( message->getItem()->getKey() );
+
+    rc = CDataServer::getInstance().getStorageEngine()->get( key, v );
     if ( !rc )
     {
         // 未找到
-        CDataServer::getInstance().getService()->send( message->getSid(),
-                MEMCACHED_RESPONSE_NOT_FOUND, strlen(MEMCACHED_RESPONSE_NOT_FOUND) );
-        return;
+        m_Binlogs->unlock();
+        this->respond( message, MEMCACHED_RESPONSE_NOT_FOUND, BinaryProtocol::eStatus_KeyNotFound );
+        return false;
     }
 
-    if ( message->getDelta() == 0 )
-    {
-        strncpy( strvalue, v.c_str(), 63 );
-    }
-    else
+    uint64_t rawvalue = (uint64_t)strtoull( v.c_str(), NULL, 10 );
+
+    if ( message->getDelta() != 0 )
     {
-        uint64_t rawvalue = (uint64_t)atoll( v.c_str() );
         int64_t change = value * (int64_t)message->getDelta();
 
         if ( (change>0 && rawvalue+change<rawvalue)
@@ -429,31 +1578,55 @@ void CClientProxy::calc( CacheMessage * message, int32_t value )
             err += " ";
             err += "cannot increment or decrement non-numeric value";
             err += "\r\n";
-            CDataServer::getInstance().getService()->send( message->getSid(), err );
-            return;
+            m_Binlogs->unlock();
+            this->respond( message, err.c_str(), BinaryProtocol::eStatus_NonNumeric );
+            return false;
         }
 
         rawvalue += change;
-        sprintf( strvalue, "%lu", rawvalue );
-
-        Transaction trans( m_Binlogs );
-        std::string key = encode_kv_key( message->getItem()->getKey() );
-        m_Binlogs->Put( key, std::string( strvalue ) );
-        m_Binlogs->addLog( BinlogCommand::SET, key );
-        rc = m_Binlogs->commit();
-        if ( !rc )
-        {
-            // 未存档
-            CDataServer::getInstance().getService()->send( message->getSid(),
-                    MEMCACHED_RESPONSE_ERROR, strlen(MEMCACHED_RESPONSE_ERROR) );
-            return;
-        }
     }
 
     std::string response;
-    response += strvalue;
-    response += "\r\n";
-    CDataServer::getInstance().getService()->send( message->getSid(), response );
+    if ( message->isBinary() )
+    {
+        uint64_t number = htobe64( rawvalue );
+        BinaryProtocol::encode( response, message, BinaryProtocol::eStatus_OK,
+                Slice( (const char *)&number, sizeof(number) ) );
+    }
+    else if ( message->getDelta() == 0 )
+    {
+        response = v.substr( 0, 63 );
+        response += "\r\n";
+    }
+    else
+    {
+        append_uint( response, rawvalue );
+        response += "\r\n";
+    }
+
+    if ( message->getDelta() != 0 )
+    {
+        std::string strvalue;
+        append_uint( strvalue, rawvalue );
+
+        // 之前的写请求已经提交, 单独提交之后才释放锁
+        this->beginGroup();
+        this->appendGroup( BinlogCommand::SET, key, strvalue );
+
+        // 存档失败时回应ERROR
+        this->deferGroup( message, NULL, MEMCACHED_RESPONSE_ERROR, response, true );
+
+        return true;
+    }
+
+    m_Binlogs->unlock();
+
+    if ( !message->isQuiet() )
+    {
+        this->send( message->getSid(), response );
+    }
+
+    return false;
 }
 
 void CClientProxy::dump( CacheMessage * message )
@@ -466,7 +1639,7 @@ void CClientProxy::dump( CacheMessage * message )
         response += " ";
         response += "the dump of the thread already exists";
         response += "\r\n";
-        CDataServer::getInstance().getService()->send( message->getSid(), response );
+        this->send( message->getSid(), response );
         return;
     }
 
@@ -478,19 +1651,9 @@ void CClientProxy::dump( CacheMessage * message )
         response += MEMCACHED_RESPONSE_SERVERERROR;
         response += " ";
         response += "create the dump of the thread failed";
-        CDataServer::getInstance().getService()->send( message->getSid(), response );
+        this->send( message->getSid(), response );
         delete args;
     }
 }
 
-bool CClientProxy::checkDiskUsage()
-{
-    if ( CDataServer::getInstance().getStorageEngine() != NULL )
-    {
-        return CDataServer::getInstance().getStorageEngine()->check( 5 );
-    }
-
-    return true;
-}
-
 }
@@ -3,9 +3,15 @@
 #define __SRC_TINYDB_CLIENTPROXY_H__
 
 #include <pthread.h>
+#include <map>
 #include <deque>
+#include <vector>
+#include <string>
 
 #include "base.h"
+#include "io/io.h"
+
+#include "utils/thread.h"
 
 #include "status.h"
 
@@ -16,44 +22,123 @@ class LevelDBEngine;
 class CacheMessage;
 class BinlogQueue;
 
-class CClientProxy
+//
+// 客户端代理
+// 每个工作线程一个, 客户端会话按照KEY的哈希值派发请求
+//
+class CClientProxy : public utils::IThread
 {
 public :
-    CClientProxy( int32_t percision, LevelDBEngine * engine );
+    CClientProxy( uint8_t index, int32_t percision, LevelDBEngine * engine, BinlogQueue * binlogs );
     virtual ~CClientProxy();
 
 public :
     // 初始化/运行/销毁
-    bool start();
-    void run();
-    void stop();
+    virtual bool onStart();
+    virtual void onExecute();
+    virtual void onStop();
 
     // 提交请求
     void post( int32_t type, void * task );
 
+    // 设置空闲时自旋等待的时间(微秒), 超时后再挂起
+    void setSpinTime( int32_t usecs ) { m_SpinUsecs = usecs; }
+
+    // 设置批量提交的上限, 写请求个数和等待时间(微秒)
+    void setBatchLimit( uint32_t count, int32_t usecs ) { m_BatchSize = count; m_BatchUsecs = usecs; }
+
+    // 设置持久化方式, 以及GROUP方式下fsync的写请求个数和间隔(微秒)
+    void setDurability( int8_t durability, uint32_t count, int32_t usecs )
+    {
+        m_Durability = durability;
+        m_SyncWrites = count;
+        m_SyncUsecs = usecs;
+    }
+
+    // 设置半同步, 写请求等待slaves个备机确认后再回应, 超时时间(微秒)后退化为异步
+    void setSemiSync( uint32_t slaves, int32_t usecs ) { m_AckSlaves = slaves; m_AckUsecs = usecs; }
+
 public :
-    const BinlogQueue * getBinlog() const { return m_Binlogs; }
+    // 工作线程索引
+    uint8_t getIndex() const { return m_Index; }
 
-    // 检查磁盘
-    bool checkDiskUsage();
+    // 服务器状态, 其他线程读取每轮execute()结束时发布的快照
+    void getStatus( ServerStatus & status );
 
 private :
     // 处理逻辑
+    void run();
     void execute();
 
-    // 消息处理
-    void process( CacheMessage * message );
+    // 等待新的请求
+    void wait();
+
+    // 消息处理, 返回true表示延后回应(等待批量提交或者分批查询)
+    bool process( CacheMessage * message );
+    // 按照会话的顺序处理请求
+    void dispatch( CacheMessage * message );
+    // 请求处理完成
+    void finish( CacheMessage * message );
+    // 读请求之前提交, 并且保证同一个会话的回应有序
+    void barrier( CacheMessage * message );
+
+    // 批量提交, 修改先缓存在工作线程中, 提交时才持有binlog的锁
+    // locked : 调用者已经持有binlog的锁, 立即提交并且释放
+    void beginGroup();
+    void appendGroup( char cmd, const std::string & key, const std::string & value = "" );
+    void deferGroup( CacheMessage * msg,
+            const char * succeed, const char * failed, const std::string & value = "", bool locked = false );
+    void commitGroup( bool locked = false );
+
+    // GROUP方式下等待fsync的写请求
+    void checkSync();
+    void syncGroup();
 
 private :
-    void add( CacheMessage * msg );
-    void set( CacheMessage * msg );
-    void del( CacheMessage * msg );
-    void gets( CacheMessage * msg );
-    void calc( CacheMessage * msg, int32_t value );
+    bool add( CacheMessage * msg );
+    bool set( CacheMessage * msg );
+    bool del( CacheMessage * msg );
+    bool gets( CacheMessage * msg );
+    bool calc( CacheMessage * msg, int32_t value );
 
+    // 工作线程的统计, 本线程直接读取, 其他线程读取快照
+    void collect( uint8_t index, ServerStatus & status );
     void stat( CacheMessage * msg );
+    // stats replication, 主备同步的状态
+    void statReplication( CacheMessage * msg );
     void error( CacheMessage * msg );
     void version( CacheMessage * msg );
+    void noop( CacheMessage * msg );
+
+    // 按照请求的协议回应, text是文本协议的回应, status是二进制协议的状态码
+    void respond( CacheMessage * msg, const char * text, uint16_t status );
+
+    // 回应先合并到会话的输出缓冲区, 每轮execute()结束后一次发送
+    void send( sid_t sid, const std::string & data );
+    void send( sid_t sid, const char * data, uint32_t len );
+    void flush();
+
+private :
+    // 通配符查询, 按照游标分批执行
+    struct ScanCursor
+    {
+        CacheMessage *              message;
+        size_t                      index;      // 正在处理的KEY
+        std::string                 cursor;     // 上一次返回的KEY, 为空时从头开始
+        uint32_t                    count;      // 已经返回的个数
+        std::deque<CacheMessage *>  blocked;    // 同一个会话后续的请求, 查询完成后再处理
+    };
+
+    typedef std::map<sid_t, ScanCursor *> ScanCursors;
+
+    // 每个游标执行一批
+    void scan();
+    // 执行一批, 返回true表示查询完成
+    bool step( ScanCursor * c );
+    // 查询完成, 处理被阻塞的请求
+    void complete( ScanCursor * c );
+
+    ScanCursors                             m_Scans;
 
 private :
     void dump( CacheMessage * msg );
@@ -73,19 +158,118 @@ private :
 
     void doTask( const Task & t );
 
+    pthread_cond_t                          m_QueueCond;
     pthread_mutex_t                         m_QueueLock;
     std::deque<Task>                        m_TaskQueue;
+    volatile uint32_t                       m_QueueSize;
+    bool                                    m_IsWaiting;
+
+private :
+    // 等待批量提交的写请求
+    struct PendingWrite
+    {
+        CacheMessage *  message;
+        const char *    succeed;        // 成功的回应
+        const char *    failed;         // 失败的回应
+        std::string     value;          // 成功的回应(incr/decr的结果)
+        uint64_t        seq;            // 提交后的seq
+        bool            committed;      // 是否提交成功
+        int64_t         timestamp;      // 开始等待备机确认的时间
+    };
+
+    // 批量事务中的修改
+    struct GroupLog
+    {
+        char            cmd;
+        std::string     key;
+        std::string     value;
+    };
+
+    void reply( const PendingWrite & w, bool succeed );
+    void replyUnsynced( bool succeed );
+
+    uint32_t                                m_BatchSize;
+    int32_t                                 m_BatchUsecs;
+    int64_t                                 m_GroupTimestamp;   // 批量事务开始的时间
+    std::vector<PendingWrite>               m_PendingWrites;
+    std::vector<GroupLog>                   m_GroupLogs;        // 还没有写入binlog的修改
+
+    int8_t                                  m_Durability;
+    int8_t                                  m_GroupDurability;  // 批量事务中要求最高的持久化方式
+    uint32_t                                m_SyncWrites;
+    int32_t                                 m_SyncUsecs;
+    int64_t                                 m_SyncTimestamp;    // 第一个等待fsync的写请求提交的时间
+    std::vector<PendingWrite>               m_UnsyncedWrites;
+
+private :
+    //
+    // 半同步, 提交成功的写请求等待备机确认之后再回应
+    // 同一个会话的读请求等到之前的写请求都回应之后再处理, 保证回应有序
+    //
+    typedef std::map<sid_t, std::deque<CacheMessage *> > BlockedMessages;
+
+    // 提交完成, 需要等待确认时加入队列
+    void confirm( const PendingWrite & w, bool succeed );
+    // 回应已经确认或者超时的写请求, force表示不再等待
+    void checkAcks( bool force = false );
+    // 会话还有写请求在等待确认时, 阻塞后续的请求
+    bool hold( CacheMessage * message );
+    // 会话的写请求都已经回应, 处理被阻塞的请求
+    void resume( sid_t sid );
+
+    uint32_t                                m_AckSlaves;
+    int32_t                                 m_AckUsecs;
+    bool                                    m_AckDegraded;      // 超时后退化为异步, 备机追上之后恢复
+    uint64_t                                m_AckDegradedSeq;
+    std::deque<PendingWrite>                m_UnackedWrites;
+    std::map<sid_t, uint32_t>               m_UnackedSessions;  // 每个会话等待确认的写请求个数
+    BlockedMessages                         m_AckBlocked;
+
+private :
+    enum
+    {
+        eOutput_InitialSize     = 4096,             // 输出缓冲区的初始大小
+        eOutput_FlushSize       = ( 256 * 1024 ),   // 超过后立即发送
+    };
+
+    enum
+    {
+        eScan_ChunkItems        = 256,              // 通配符查询每批最多返回的个数
+        eScan_ChunkSize         = ( 64 * 1024 ),    // 通配符查询每批最多返回的字节数
+    };
+
+    // 会话的输出缓冲区, malloc分配, 发送时交给网络层释放
+    struct OutputBuffer
+    {
+        char *      data;
+        uint32_t    size;
+        uint32_t    capacity;
+    };
+
+    typedef std::map<sid_t, OutputBuffer> OutputBuffers;
+
+    OutputBuffers                           m_Outputs;
+    std::string                             m_Response;         // 复用的回应缓冲区
+
+    // 批量查询复用的缓冲区
+    std::vector<std::string>                m_MultiKeys;
+    std::vector<std::string>                m_MultiValues;
+    std::vector<bool>                       m_MultiFounds;
+    sid_t                                   m_LastSid;          // 流水线请求通常来自同一个会话
+    OutputBuffer *                          m_LastOutput;
 
 private :
+    uint8_t             m_Index;
     int32_t             m_Percision;
+    int32_t             m_SpinUsecs;
     LevelDBEngine *     m_Engine;
     BinlogQueue *       m_Binlogs;
     ServerStatus        m_ServerStatus;
+    pthread_mutex_t     m_StatusLock;
+    ServerStatus        m_StatusSnapshot;   // 发布给其他线程的统计
     pthread_t           m_DumpThread;       // 存档线程
 };
 
-#define g_ClientProxy CDataServer::getInstance().getClientProxy()
-
 }
 
 #endif
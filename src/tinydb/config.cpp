@@ -9,7 +9,26 @@
 
 CDatadConfig::CDatadConfig()
     : m_LogLevel( 0 ),
-      m_CacheSize( 0 )
+      m_CacheSize( 0 ),
+      m_ValueCacheSize( 0 ),
+      m_BatchSize( 128 ),
+      m_BatchMicroseconds( 1000 ),
+      m_BinlogCapacity( 0 ),
+      m_SeparateBinlog( false ),
+      m_BinlogCacheSize( 8 * 1024 * 1024 ),
+      m_BinlogWriteBufferSize( 4 * 1024 * 1024 ),
+      m_BinlogFile( false ),
+      m_BinlogSegmentSize( 64 * 1024 * 1024 ),
+      m_BinlogValue( false ),
+      m_Durability( Durability::ASYNC ),
+      m_SyncMilliseconds( 10 ),
+      m_SyncWrites( 256 ),
+      m_ListenPort( 0 ),
+      m_TimeoutSeconds( 0 ),
+      m_IOThreadsCount( 1 ),
+      m_MaxSessions( 1000 ),
+      m_WorkersCount( 1 ),
+      m_SpinMicroseconds( 0 )
 {}
 
 CDatadConfig::~CDatadConfig()
@@ -29,11 +48,70 @@ bool CDatadConfig::load( const char * path )
     // Storage
     raw_file.get( "Storage", "location", m_StorageLocation );
     raw_file.get( "Storage", "cachesize", m_CacheSize );
+    raw_file.get( "Storage", "valuecachesize", m_ValueCacheSize );
+    raw_file.get( "Storage", "batchsize", m_BatchSize );
+    raw_file.get( "Storage", "batchusecs", m_BatchMicroseconds );
+    raw_file.get( "Storage", "binlogcapacity", m_BinlogCapacity );
+    raw_file.get( "Storage", "separatebinlog", m_SeparateBinlog );
+    raw_file.get( "Storage", "binlogcachesize", m_BinlogCacheSize );
+    raw_file.get( "Storage", "binlogwritebuffer", m_BinlogWriteBufferSize );
+    raw_file.get( "Storage", "binlogfile", m_BinlogFile );
+    raw_file.get( "Storage", "binlogsegmentsize", m_BinlogSegmentSize );
+    raw_file.get( "Storage", "binlogvalue", m_BinlogValue );
+    if ( m_BinlogSegmentSize < 1024 * 1024 )
+    {
+        m_BinlogSegmentSize = 1024 * 1024;
+    }
+    if ( m_BatchSize == 0 )
+    {
+        m_BatchSize = 1;
+    }
+    std::string durability;
+    raw_file.get( "Storage", "durability", durability );
+    if ( durability == "sync" )
+    {
+        m_Durability = Durability::SYNC;
+    }
+    else if ( durability == "group" )
+    {
+        m_Durability = Durability::GROUP;
+    }
+    else if ( durability.empty() || durability == "async" )
+    {
+        m_Durability = Durability::ASYNC;
+    }
+    else
+    {
+        LOG_WARN( "CDatadConfig::load('%s') : unknown durability '%s', use 'async' .\n", path, durability.c_str() );
+        m_Durability = Durability::ASYNC;
+    }
+    raw_file.get( "Storage", "syncintervalms", m_SyncMilliseconds );
+    raw_file.get( "Storage", "syncwrites", m_SyncWrites );
+    if ( m_SyncWrites == 0 )
+    {
+        m_SyncWrites = 1;
+    }
 
     // Service
     raw_file.get( "Service", "bindhost", m_BindHost );
     raw_file.get( "Service", "listenport", m_ListenPort );
     raw_file.get( "Service", "timeoutseconds", m_TimeoutSeconds );
+    raw_file.get( "Service", "iothreads", m_IOThreadsCount );
+    if ( m_IOThreadsCount == 0 )
+    {
+        m_IOThreadsCount = 1;
+    }
+    raw_file.get( "Service", "maxsessions", m_MaxSessions );
+    if ( m_MaxSessions == 0 )
+    {
+        m_MaxSessions = 1000;
+    }
+    raw_file.get( "Service", "workers", m_WorkersCount );
+    if ( m_WorkersCount == 0 )
+    {
+        m_WorkersCount = 1;
+    }
+    raw_file.get( "Service", "spinusecs", m_SpinMicroseconds );
 
 
     // Replication
@@ -42,6 +120,13 @@ bool CDatadConfig::load( const char * path )
     raw_file.get( "Replication", "port", m_ReplicationConfig.endpoint.port );
     raw_file.get( "Replication", "timeoutseconds", m_ReplicationConfig.timeoutseconds );
     raw_file.get( "Replication", "keepaliveseconds", m_ReplicationConfig.keepaliveseconds );
+    raw_file.get( "Replication", "applyms", m_ReplicationConfig.applymilliseconds );
+    raw_file.get( "Replication", "syncthreads", m_ReplicationConfig.syncthreads );
+    raw_file.get( "Replication", "copythreads", m_ReplicationConfig.copythreads );
+    raw_file.get( "Replication", "copyratelimit", m_ReplicationConfig.copyratelimit );
+    raw_file.get( "Replication", "semisyncslaves", m_ReplicationConfig.semisyncslaves );
+    raw_file.get( "Replication", "semisynctimeoutms", m_ReplicationConfig.semisynctimeoutms );
+    raw_file.get( "Replication", "heartbeatms", m_ReplicationConfig.heartbeatmilliseconds );
 
     LOG_INFO( "CDatadConfig::load('%s') succeed .\n", path );
     raw_file.close();
@@ -60,5 +145,22 @@ void CDatadConfig::unload()
     m_LogLevel = 0;
     m_StorageLocation.clear();
     m_CacheSize = 0;
+    m_ValueCacheSize = 0;
+    m_BatchSize = 128;
+    m_BatchMicroseconds = 1000;
+    m_BinlogCapacity = 0;
+    m_SeparateBinlog = false;
+    m_BinlogCacheSize = 8 * 1024 * 1024;
+    m_BinlogWriteBufferSize = 4 * 1024 * 1024;
+    m_BinlogFile = false;
+    m_BinlogSegmentSize = 64 * 1024 * 1024;
+    m_BinlogValue = false;
+    m_Durability = Durability::ASYNC;
+    m_SyncMilliseconds = 10;
+    m_SyncWrites = 256;
+    m_IOThreadsCount = 1;
+    m_MaxSessions = 1000;
+    m_WorkersCount = 1;
+    m_SpinMicroseconds = 0;
     m_ReplicationConfig.clear();
 }
@@ -17,6 +17,13 @@ struct ReplicationConfig
     Endpoint        endpoint;
     int32_t         timeoutseconds;
     int32_t         keepaliveseconds;
+    int32_t         applymilliseconds;      // 备机合并写入的间隔
+    uint32_t        syncthreads;            // 主机同步调度的线程数
+    uint32_t        copythreads;            // 主机并行复制的线程数
+    uint64_t        copyratelimit;          // 主机复制的限速(字节/秒)
+    uint32_t        semisyncslaves;         // 半同步时写请求等待确认的备机数
+    int32_t         semisynctimeoutms;      // 半同步等待确认的超时时间
+    int32_t         heartbeatmilliseconds;  // 主机发送同步位置的间隔
 
     ReplicationConfig()
     {
@@ -29,6 +36,13 @@ struct ReplicationConfig
         endpoint.clear();
         timeoutseconds = 0;
         keepaliveseconds = 0;
+        applymilliseconds = 0;
+        syncthreads = 2;
+        copythreads = 4;
+        copyratelimit = 0;
+        semisyncslaves = 0;
+        semisynctimeoutms = 1000;
+        heartbeatmilliseconds = 100;
     }
 };
 
@@ -49,22 +63,71 @@ public :
 
     // 缓存大小
     size_t getCacheSize() const { return m_CacheSize; }
+    // 热点数据缓存大小, 0表示不启用
+    size_t getValueCacheSize() const { return m_ValueCacheSize; }
     const std::string & getStorageLocation() const { return m_StorageLocation; }
 
+    // 批量提交的写请求个数和等待时间(微秒)
+    uint32_t getBatchSize() const { return m_BatchSize; }
+    int32_t getBatchMicroseconds() const { return m_BatchMicroseconds; }
+
+    // 保留的binlog个数, 0表示默认值
+    uint32_t getBinlogCapacity() const { return m_BinlogCapacity; }
+    // binlog是否独立存储, 以及独立存储时的缓存和写缓冲区大小
+    bool isSeparateBinlog() const { return m_SeparateBinlog; }
+    size_t getBinlogCacheSize() const { return m_BinlogCacheSize; }
+    size_t getBinlogWriteBufferSize() const { return m_BinlogWriteBufferSize; }
+    // binlog是否同时写入分段文件, 以及段文件的大小
+    bool isBinlogFile() const { return m_BinlogFile; }
+    size_t getBinlogSegmentSize() const { return m_BinlogSegmentSize; }
+    // binlog中是否记录写入的数据
+    bool isBinlogValue() const { return m_BinlogValue; }
+
+    // 持久化方式, 以及GROUP方式下fsync的间隔(毫秒)和写请求个数
+    int8_t getDurability() const { return m_Durability; }
+    int32_t getSyncMilliseconds() const { return m_SyncMilliseconds; }
+    uint32_t getSyncWrites() const { return m_SyncWrites; }
+
     uint16_t getListenPort() const { return m_ListenPort; }
     const char * getBindHost() const { return m_BindHost.c_str(); }
     int32_t getTimeoutSeconds() const { return m_TimeoutSeconds; }
 
+    // 网络线程个数和最大会话个数
+    uint8_t getIOThreadsCount() const { return m_IOThreadsCount; }
+    uint32_t getMaxSessions() const { return m_MaxSessions; }
+
+    // 客户端代理的工作线程个数
+    uint8_t getWorkersCount() const { return m_WorkersCount; }
+    // 工作线程空闲时自旋的时间(微秒)
+    int32_t getSpinMicroseconds() const { return m_SpinMicroseconds; }
+
     // 主从配置
     ReplicationConfig * getReplicationConfig() { return & m_ReplicationConfig; }
 
 private :
     uint8_t                 m_LogLevel;
     size_t                  m_CacheSize;
+    size_t                  m_ValueCacheSize;       // 热点数据缓存大小
     std::string             m_StorageLocation;
+    uint32_t                m_BatchSize;            // 批量提交的写请求个数
+    int32_t                 m_BatchMicroseconds;    // 批量提交的等待时间
+    uint32_t                m_BinlogCapacity;       // 保留的binlog个数
+    bool                    m_SeparateBinlog;       // binlog独立存储
+    size_t                  m_BinlogCacheSize;
+    size_t                  m_BinlogWriteBufferSize;
+    bool                    m_BinlogFile;           // binlog分段文件
+    size_t                  m_BinlogSegmentSize;
+    bool                    m_BinlogValue;          // binlog带有数据
+    int8_t                  m_Durability;           // 持久化方式
+    int32_t                 m_SyncMilliseconds;     // fsync的间隔
+    uint32_t                m_SyncWrites;           // fsync的写请求个数
     std::string             m_BindHost;             // 绑定的主机地址
     uint16_t                m_ListenPort;
     int32_t                 m_TimeoutSeconds;
+    uint8_t                 m_IOThreadsCount;       // 网络线程个数
+    uint32_t                m_MaxSessions;          // 最大会话个数
+    uint8_t                 m_WorkersCount;         // 工作线程个数
+    int32_t                 m_SpinMicroseconds;     // 自旋时间
     ReplicationConfig       m_ReplicationConfig;    // 主从配置
 };
 
@@ -147,7 +147,7 @@ int main(int argc, char ** argv)
     while ( g_RunStatus != eRunStatus_Stop
             && tinydb::CDataServer::getInstance().isRunning() )
     {
-        if ( !tinydb::CDataServer::getInstance().getClientProxy()->checkDiskUsage() )
+        if ( !tinydb::CDataServer::getInstance().checkDiskUsage() )
         {
             g_RunStatus = eRunStatus_Stop;
             LOG_FATAL( "%s does not have enough Avail DiskSpace .\n", module.c_str() );
@@ -18,7 +18,9 @@
 #include "masterproxy.h"
 #include "slaveproxy.h"
 #include "syncbackend.h"
+#include "binlog.h"
 
+#include "valuecache.h"
 #include "leveldbengine.h"
 
 namespace tinydb
@@ -28,10 +30,12 @@ CDataServer::CDataServer()
     : m_DataService( NULL ),
       m_MasterService( NULL ),
       m_SlaveClient( NULL ),
-      m_ClientProxy( NULL ),
       m_MasterProxy( NULL ),
       m_SlaveProxy( NULL ),
       m_StorageEngine( NULL ),
+      m_BinlogEngine( NULL ),
+      m_ValueCache( NULL ),
+      m_BinlogQueue( NULL ),
       m_BackendSync( NULL )
 {}
 
@@ -55,22 +59,90 @@ bool CDataServer::onStart()
     }
 
     m_StorageEngine->setCacheSize( CDatadConfig::getInstance().getCacheSize() );
+    m_StorageEngine->setSync( CDatadConfig::getInstance().getDurability() == Durability::SYNC );
+
+    // 热点数据缓存, 写入leveldb之后通过事务回调更新
+    size_t valuecachesize = CDatadConfig::getInstance().getValueCacheSize();
+    if ( valuecachesize > 0 )
+    {
+        m_ValueCache = new ValueCache( valuecachesize );
+        m_StorageEngine->setValueCache( m_ValueCache );
+        m_StorageEngine->setBatchHandler( m_ValueCache );
+    }
+
     if ( !m_StorageEngine->initialize() )
     {
         return false;
     }
 
+    // binlog独立存储, 不占用数据库的写缓冲区和缓存
+    if ( CDatadConfig::getInstance().isSeparateBinlog() )
+    {
+        m_BinlogEngine = new LevelDBEngine(
+                CDatadConfig::getInstance().getStorageLocation() + "/binlog" );
+        if ( m_BinlogEngine == NULL )
+        {
+            return false;
+        }
+
+        m_BinlogEngine->setCacheSize( CDatadConfig::getInstance().getBinlogCacheSize() );
+        m_BinlogEngine->setWriteBufferSize( CDatadConfig::getInstance().getBinlogWriteBufferSize() );
+        if ( !m_BinlogEngine->initialize() )
+        {
+            return false;
+        }
+    }
+
+    // binlog, 所有工作线程共享
+    m_BinlogQueue = new BinlogQueue( m_StorageEngine,
+            CDatadConfig::getInstance().getBinlogCapacity(), m_BinlogEngine );
+    assert( m_BinlogQueue != NULL && "CDataServer::onStart new BinlogQueue failed." );
+    m_BinlogQueue->setInlineValue( CDatadConfig::getInstance().isBinlogValue() );
+
+    // binlog分段文件, 同步备机时读取
+    if ( CDatadConfig::getInstance().isBinlogFile() )
+    {
+        std::string path = CDatadConfig::getInstance().getStorageLocation() + "/binlog_segments";
+        if ( !m_BinlogQueue->openFile( path,
+                    CDatadConfig::getInstance().getBinlogSegmentSize() ) )
+        {
+            LOG_FATAL( "CDataServer::onStart open binlog segments('%s') failed .\n", path.c_str() );
+            return false;
+        }
+    }
+
     // 客户端代理
-    m_ClientProxy = new CClientProxy( eClientService_EachFrameSeconds, m_StorageEngine );
-    if ( !m_ClientProxy->start() )
+    uint8_t nworkers = CDatadConfig::getInstance().getWorkersCount();
+    for ( uint8_t i = 0; i < nworkers; ++i )
     {
-        return false;
+        CClientProxy * proxy = new CClientProxy(
+                i, eClientService_EachFrameSeconds, m_StorageEngine, m_BinlogQueue );
+        proxy->setSpinTime( CDatadConfig::getInstance().getSpinMicroseconds() );
+        proxy->setBatchLimit( CDatadConfig::getInstance().getBatchSize(),
+                CDatadConfig::getInstance().getBatchMicroseconds() );
+        proxy->setDurability( CDatadConfig::getInstance().getDurability(),
+                CDatadConfig::getInstance().getSyncWrites(),
+                CDatadConfig::getInstance().getSyncMilliseconds() * 1000 );
+        // 主机的半同步
+        const ReplicationConfig * replication = CDatadConfig::getInstance().getReplicationConfig();
+        if ( replication->type == 0 )
+        {
+            proxy->setSemiSync( replication->semisyncslaves, replication->semisynctimeoutms * 1000 );
+        }
+        m_ClientProxies.push_back( proxy );
+
+        if ( !proxy->start() )
+        {
+            return false;
+        }
     }
 
+    LOG_INFO( "CClientProxy(%d) started .\n", nworkers );
+
     // DataService
-    m_DataService = new CDataService(
-            eDataService_ThreadsCount,
-            eDataService_SessionsCount );
+    uint8_t nthreads = CDatadConfig::getInstance().getIOThreadsCount();
+    uint32_t nsessions = CDatadConfig::getInstance().getMaxSessions();
+    m_DataService = new CDataService( nthreads, nsessions );
     if ( m_DataService == NULL )
     {
         return false;
@@ -79,12 +151,12 @@ bool CDataServer::onStart()
     if ( !m_DataService->listen( host, port ) )
     {
         LOG_FATAL( "CDataService(%d, %d) listen (%s::%d) failure .\n",
-                eDataService_ThreadsCount, eDataService_SessionsCount, host, port );
+                nthreads, nsessions, host, port );
         return false;
     }
 
     LOG_INFO( "CDataService(%d, %d) listen (%s::%d) succeed .\n",
-            eDataService_ThreadsCount, eDataService_SessionsCount, host, port );
+            nthreads, nsessions, host, port );
 
     // 双机热备
     if ( !startReplicationService() )
@@ -94,7 +166,7 @@ bool CDataServer::onStart()
 
     // 数据库同步
     m_BackendSync = new BackendSync();
-    if ( m_BackendSync == NULL )
+    if ( m_BackendSync == NULL || !m_BackendSync->start() )
     {
         return false;
     }
@@ -104,17 +176,22 @@ bool CDataServer::onStart()
 
 void CDataServer::onExecute()
 {
-    // 处理数据服务器客户端
-    g_ClientProxy->run();
+    // 客户端请求由各个工作线程处理
+    utils::TimeUtils::sleep( eClientService_EachFrameSeconds );
+
+    // 后台删除过期的binlog
+    if ( m_BinlogQueue != NULL )
+    {
+        m_BinlogQueue->trim();
+    }
 }
 
 void CDataServer::onStop()
 {
+    // 先停止接收请求, 工作线程处理完剩余的请求后再销毁
     if ( m_DataService != NULL )
     {
         m_DataService->stop();
-        delete m_DataService;
-        m_DataService = NULL;
     }
 
     if ( m_BackendSync != NULL )
@@ -139,11 +216,23 @@ void CDataServer::onStop()
         m_SlaveClient = NULL;
     }
 
-    if ( m_ClientProxy != NULL )
+    for ( size_t i = 0; i < m_ClientProxies.size(); ++i )
+    {
+        m_ClientProxies[i]->stop();
+        delete m_ClientProxies[i];
+    }
+    m_ClientProxies.clear();
+
+    if ( m_DataService != NULL )
+    {
+        delete m_DataService;
+        m_DataService = NULL;
+    }
+
+    if ( m_BinlogQueue != NULL )
     {
-        m_ClientProxy->stop();
-        delete m_ClientProxy;
-        m_ClientProxy = NULL;
+        delete m_BinlogQueue;
+        m_BinlogQueue = NULL;
     }
 
     if ( m_MasterProxy != NULL )
@@ -161,6 +250,13 @@ void CDataServer::onStop()
     }
 
     // 最后关闭
+    if ( m_BinlogEngine != NULL )
+    {
+        m_BinlogEngine->finalize();
+        delete m_BinlogEngine;
+        m_BinlogEngine = NULL;
+    }
+
     if ( m_StorageEngine != NULL )
     {
         m_StorageEngine->finalize();
@@ -168,9 +264,25 @@ void CDataServer::onStop()
         m_StorageEngine = NULL;
     }
 
+    if ( m_ValueCache != NULL )
+    {
+        delete m_ValueCache;
+        m_ValueCache = NULL;
+    }
+
     LOG_INFO( "CDataServer Stoped .\n" );
 }
 
+bool CDataServer::checkDiskUsage() const
+{
+    if ( m_StorageEngine != NULL )
+    {
+        return m_StorageEngine->check( 5 );
+    }
+
+    return true;
+}
+
 bool CDataServer::startReplicationService()
 {
     ReplicationConfig * config = CDatadConfig::getInstance().getReplicationConfig();
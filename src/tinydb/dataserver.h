@@ -2,6 +2,7 @@
 #ifndef __SRC_TINYDB_TINYDB_H__
 #define __SRC_TINYDB_TINYDB_H__
 
+#include <vector>
 #include <pthread.h>
 
 #include "base.h"
@@ -21,6 +22,8 @@ class CMasterProxy;
 class CSlaveProxy;
 
 class LevelDBEngine;
+class ValueCache;
+class BinlogQueue;
 class BackendSync;
 
 class CDataServer : public utils::IThread, public Singleton<CDataServer>
@@ -28,13 +31,7 @@ class CDataServer : public utils::IThread, public Singleton<CDataServer>
 public :
     enum
     {
-        eDataService_ThreadsCount   = 1,            // DataService的线程个数
-        eDataService_SessionsCount  = 1000,         // DataService最大会话个数
-    };
-
-    enum
-    {
-        eClientService_EachFrameSeconds = 20,   // 客户端服务器每帧20ms
+        eClientService_EachFrameSeconds = 20,   // 客户端服务器空闲时最长挂起20ms
         eMasterService_EachFrameSeconds = 12,   // 主服务器每帧12ms
         eSlaveService_EachFrameSeconds  = 20,   // 次服务器每帧20ms
     };
@@ -57,12 +54,18 @@ public :
     CSlaveClient * getSlaveClient() const { return m_SlaveClient; }
 
     // 获取服务器代理
-    CClientProxy * getClientProxy() const { return m_ClientProxy; }
+    uint8_t getClientProxyCount() const { return m_ClientProxies.size(); }
+    CClientProxy * getClientProxy( uint8_t index ) const { return m_ClientProxies[index]; }
     CMasterProxy * getMasterProxy() const { return m_MasterProxy; }
     CSlaveProxy * getSlaveProxy() const { return m_SlaveProxy; }
 
     // 获取存档服务
     LevelDBEngine * getStorageEngine() const { return m_StorageEngine; }
+    ValueCache * getValueCache() const { return m_ValueCache; }
+    BinlogQueue * getBinlogQueue() const { return m_BinlogQueue; }
+
+    // 检查磁盘
+    bool checkDiskUsage() const;
 
     // 获取主库同步对象
     BackendSync * getBackendSync() const { return m_BackendSync; }
@@ -76,11 +79,14 @@ private :
     CMasterService *            m_MasterService;
     CSlaveClient *              m_SlaveClient;
 
-    CClientProxy *              m_ClientProxy;
+    std::vector<CClientProxy *> m_ClientProxies;
     CMasterProxy *              m_MasterProxy;
     CSlaveProxy *               m_SlaveProxy;
 
     LevelDBEngine *             m_StorageEngine;
+    LevelDBEngine *             m_BinlogEngine;     // 独立存储的binlog
+    ValueCache *                m_ValueCache;       // 热点数据缓存
+    BinlogQueue *               m_BinlogQueue;
 
     BackendSync *               m_BackendSync;      // 数据同步
 };
@@ -4,6 +4,9 @@
 
 #include "types.h"
 
+#include "utils/hashfunc.h"
+#include "utils/timeutils.h"
+
 #include "message/message.h"
 #include "dataservice.h"
 #include "dataserver.h"
@@ -13,12 +16,25 @@ namespace tinydb
 {
 
 CClientSession::CClientSession()
+    : m_Protocol( eProtocol_Unknown ),
+      m_Context( NULL )
 {
-    m_MsgDecoder.init();
+    m_Context = new CSessionContext;
+    m_MsgDecoder.init( m_Context->getMessagePool() );
+    m_BinaryDecoder.init( m_Context->getMessagePool() );
 }
 
 CClientSession::~CClientSession()
 {
+    // 消息池随上下文释放
+    m_MsgDecoder.discard();
+    m_BinaryDecoder.discard();
+
+    if ( m_Context != NULL )
+    {
+        m_Context->release();
+        m_Context = NULL;
+    }
 }
 
 int32_t CClientSession::onStart()
@@ -28,6 +44,22 @@ int32_t CClientSession::onStart()
 }
 
 int32_t CClientSession::onProcess( const char * buf, uint32_t nbytes )
+{
+    if ( m_Protocol == eProtocol_Unknown )
+    {
+        // 二进制协议的请求以0x80开头
+        m_Protocol = (uint8_t)buf[0] == BinaryProtocol::eMagic_Request ? eProtocol_Binary : eProtocol_Text;
+    }
+
+    if ( m_Protocol == eProtocol_Binary )
+    {
+        return this->processBinary( buf, nbytes );
+    }
+
+    return this->processText( buf, nbytes );
+}
+
+int32_t CClientSession::processText( const char * buf, uint32_t nbytes )
 {
     int32_t length = 0;
 
@@ -51,20 +83,23 @@ int32_t CClientSession::onProcess( const char * buf, uint32_t nbytes )
         {
             if ( msg->getError() != NULL )
             {
-                std::string error = msg->getError();
+                std::string & error = this->scratch();
+                error = msg->getError();
                 error += "\r\n";
                 this->send( error );
+                m_MsgDecoder.discard();
             }
             else
             {
                 if ( msg->isCommand( "quit" ) )
                 {
+                    m_MsgDecoder.discard();
                     return -1;
                 }
 
-                // 没有出错, 提交给DataThread处理
+                // 没有出错, 提交给工作线程处理
                 msg->setSid( id() );
-                g_ClientProxy->post( eTaskType_Client, static_cast<void *>(msg) );
+                this->dispatch( msg );
             }
 
             m_MsgDecoder.clear();
@@ -74,6 +109,56 @@ int32_t CClientSession::onProcess( const char * buf, uint32_t nbytes )
     return length;
 }
 
+int32_t CClientSession::processBinary( const char * buf, uint32_t nbytes )
+{
+    int32_t length = 0;
+
+    while ( true )
+    {
+        int32_t nprocess = m_BinaryDecoder.decode( buf+length, nbytes-length );
+        if ( nprocess < 0 )
+        {
+            // 无法继续解析, 关闭连接
+            return -1;
+        }
+        else if ( nprocess == 0 )
+        {
+            break;
+        }
+
+        length += nprocess;
+
+        CacheMessage * msg = m_BinaryDecoder.getMessage();
+        if ( msg->getError() != NULL )
+        {
+            std::string & error = this->scratch();
+            BinaryProtocol::encode( error, msg, BinaryProtocol::eStatus_InvalidArguments, msg->getError() );
+            this->send( error );
+            m_BinaryDecoder.discard();
+            continue;
+        }
+
+        if ( msg->isCommand( "quit" ) )
+        {
+            if ( !msg->isQuiet() )
+            {
+                std::string & response = this->scratch();
+                BinaryProtocol::encode( response, msg, BinaryProtocol::eStatus_OK );
+                this->send( response );
+            }
+            m_BinaryDecoder.discard();
+            return -1;
+        }
+
+        // 提交给工作线程处理
+        msg->setSid( id() );
+        this->dispatch( msg );
+        m_BinaryDecoder.clear();
+    }
+
+    return length;
+}
+
 int32_t CClientSession::onTimeout()
 {
     return -1;
@@ -87,12 +172,64 @@ int32_t CClientSession::onError( int32_t result )
 void CClientSession::onShutdown( int32_t way )
 {}
 
+std::string & CClientSession::scratch()
+{
+    CIOContext * context = static_cast<CIOContext *>( iocontext() );
+    context->scratch.clear();
+    return context->scratch;
+}
+
+void CClientSession::dispatch( CacheMessage * msg )
+{
+    uint8_t index = m_Context->getIndex();
+    uint8_t count = CDataServer::getInstance().getClientProxyCount();
+
+    // 存在未处理完的请求时不能切换工作线程, 保证回应的顺序
+    if ( count > 1 && m_Context->isIdle() )
+    {
+        const std::string * key = NULL;
+
+        if ( msg->getItem() != NULL )
+        {
+            key = &( msg->getItem()->getKey() );
+        }
+        else if ( msg->getKeyCount() != 0 )
+        {
+            key = &( msg->getKey( 0 ) );
+        }
+
+        if ( key != NULL )
+        {
+            index = utils::HashFunction::murmur32( key->data(), key->size() ) % count;
+            m_Context->setIndex( index );
+        }
+    }
+
+    m_Context->retain();
+    msg->setContext( static_cast<void *>(m_Context) );
+    msg->setTimestamp( utils::TimeUtils::usnow() );
+    CDataServer::getInstance().getClientProxy( index )->post( eTaskType_Client, static_cast<void *>(msg) );
+}
+
 CDataService::CDataService( uint8_t nthreads, uint32_t nclients )
     : IIOService( nthreads, nclients )
 {}
 
 CDataService::~CDataService()
-{}
+{
+    // 网络线程退出后才能销毁IO上下文
+    this->destroy();
+}
+
+void * CDataService::initIOContext()
+{
+    return new CIOContext;
+}
+
+void CDataService::finalIOContext( void * context )
+{
+    delete static_cast<CIOContext *>( context );
+}
 
 IIOSession * CDataService::onAccept( sid_t id, const char * host, uint16_t port )
 {
@@ -5,11 +5,63 @@
 #include "types.h"
 #include "io/io.h"
 
+#include "message/message.h"
 #include "message/protocol.h"
 
 namespace tinydb
 {
 
+//
+// 会话上下文
+// 网络线程和工作线程共享, 引用计数管理生命周期
+// 会话持有一个引用, 每个未处理完的请求持有一个引用
+// 请求处理完成后回收到会话的消息池
+//
+class CSessionContext
+{
+public :
+    CSessionContext()
+        : m_RefCount( 1 ),
+          m_Index( 0 )
+    {}
+
+    void retain() { __sync_add_and_fetch( &m_RefCount, 1 ); }
+    void release()
+    {
+        if ( __sync_sub_and_fetch( &m_RefCount, 1 ) == 0 )
+        {
+            delete this;
+        }
+    }
+
+    // 是否存在未处理完的请求
+    bool isIdle() const { return m_RefCount == 1; }
+
+    // 当前派发的工作线程
+    uint8_t getIndex() const { return m_Index; }
+    void setIndex( uint8_t index ) { m_Index = index; }
+
+    // 消息池
+    CacheMessagePool * getMessagePool() { return &m_MessagePool; }
+
+private :
+    ~CSessionContext() {}
+
+private :
+    volatile int32_t    m_RefCount;
+    uint8_t             m_Index;
+    CacheMessagePool    m_MessagePool;
+};
+
+//
+// 网络线程的上下文
+// 同一个网络线程中的会话共享, 会话直接回应时复用临时缓冲区
+//
+struct CIOContext
+{
+    std::string         scratch;
+};
+
 class CClientSession : public IIOSession
 {
 public :
@@ -24,7 +76,28 @@ public :
     virtual void    onShutdown( int32_t way );
 
 private :
-    CacheProtocol    m_MsgDecoder;
+    // 文本协议/二进制协议
+    int32_t processText( const char * buf, uint32_t nbytes );
+    int32_t processBinary( const char * buf, uint32_t nbytes );
+
+    // 派发给工作线程
+    void dispatch( CacheMessage * msg );
+
+    // 网络线程的临时缓冲区
+    std::string & scratch();
+
+private :
+    enum
+    {
+        eProtocol_Unknown   = 0,    // 根据第一个包确定
+        eProtocol_Text      = 1,
+        eProtocol_Binary    = 2,
+    };
+
+    int8_t              m_Protocol;
+    CacheProtocol       m_MsgDecoder;
+    BinaryProtocol      m_BinaryDecoder;
+    CSessionContext *   m_Context;
 };
 
 class CDataService : public IIOService
@@ -34,10 +107,10 @@ public :
     virtual ~CDataService();
 
 public :
-    virtual IIOSession * onAccept( sid_t id, const char * host, uint16_t port );
-
-public :
+    virtual void * initIOContext();
+    virtual void finalIOContext( void * context );
 
+    virtual IIOSession * onAccept( sid_t id, const char * host, uint16_t port );
 };
 
 }
@@ -1,20 +1,204 @@
-
+#include <string.h>
+#include <algorithm>
 #include <sys/statfs.h>
 
 #include "base.h"
+#include "utils/endian.h"
 #include "utils/utility.h"
 #include "utils/timeutils.h"
 
+#include "valuecache.h"
 #include "leveldbengine.h"
 
 namespace tinydb
 {
 
+KeyPattern::KeyPattern( const std::string & pattern )
+    : m_IsWildcard( false ),
+      m_IsPrefixOnly( false ),
+      m_Pattern( pattern )
+{
+    // 空表示所有的KEY
+    if ( pattern.empty() )
+    {
+        m_IsWildcard = true;
+        m_IsPrefixOnly = true;
+        return;
+    }
+
+    size_t pos = pattern.find( '*' );
+    if ( pos == std::string::npos )
+    {
+        m_Prefix = pattern;
+        return;
+    }
+
+    m_IsWildcard = true;
+    m_Prefix = pattern.substr( 0, pos );
+
+    // 拆分, 最后一段是后缀(可能为空)
+    for ( size_t start = pos + 1; ; )
+    {
+        size_t end = pattern.find( '*', start );
+        if ( end == std::string::npos )
+        {
+            m_Segments.push_back( pattern.substr( start ) );
+            break;
+        }
+
+        if ( end > start )
+        {
+            m_Segments.push_back( pattern.substr( start, end - start ) );
+        }
+        start = end + 1;
+    }
+
+    m_IsPrefixOnly = ( m_Segments.size() == 1 && m_Segments[0].empty() );
+}
+
+KeyPattern::~KeyPattern()
+{}
+
+bool KeyPattern::match( const leveldb::Slice & key ) const
+{
+    if ( !m_IsWildcard )
+    {
+        return key == leveldb::Slice( m_Pattern );
+    }
+
+    if ( !key.starts_with( m_Prefix ) )
+    {
+        return false;
+    }
+
+    if ( m_IsPrefixOnly )
+    {
+        return true;
+    }
+
+    const char * p = key.data() + m_Prefix.size();
+    const char * end = key.data() + key.size();
+
+    // 后缀
+    const std::string & suffix = m_Segments.back();
+    if ( (size_t)( end - p ) < suffix.size()
+            || memcmp( end - suffix.size(), suffix.data(), suffix.size() ) != 0 )
+    {
+        return false;
+    }
+    end -= suffix.size();
+
+    // 中间的各段依次查找最左边的位置
+    for ( size_t i = 0; i + 1 < m_Segments.size(); ++i )
+    {
+        const std::string & segment = m_Segments[i];
+        const char * found = std::search( p, end, segment.begin(), segment.end() );
+        if ( found == end )
+        {
+            return false;
+        }
+        p = found + segment.size();
+    }
+
+    return true;
+}
+
+//
+// leveldb切换日志文件时直接关闭旧的日志, 不会fsync,
+// 而sync写入只fsync当前的日志, 旧日志中没有fsync的写入就失去了保证,
+// 所以关闭日志文件之前先fsync, 之后的sync写入就能覆盖之前所有的写入
+//
+// 限制: 切换时的fsync发生在leveldb内部的锁中, 触发切换的写入以及
+// 同时进行的写入会等待这次fsync, 旧日志最多有write_buffer_size的数据
+//
+class SyncedLogFile : public leveldb::WritableFile
+{
+public :
+    SyncedLogFile( leveldb::WritableFile * file, LogSyncEnv * env )
+        : m_Closed( false ),
+          m_Env( env ),
+          m_File( file )
+    {}
+
+    virtual ~SyncedLogFile()
+    {
+        // 旧版本的leveldb切换时直接删除日志文件
+        if ( !m_Closed )
+        {
+            this->Close();
+        }
+        delete m_File;
+    }
+
+    virtual leveldb::Status Append( const leveldb::Slice & data ) { return m_File->Append( data ); }
+    virtual leveldb::Status Flush() { return m_File->Flush(); }
+    virtual leveldb::Status Sync() { return m_File->Sync(); }
+    virtual leveldb::Status Close();
+
+private :
+    bool                        m_Closed;
+    LogSyncEnv *                m_Env;
+    leveldb::WritableFile *     m_File;
+};
+
+class LogSyncEnv : public leveldb::EnvWrapper
+{
+public :
+    LogSyncEnv()
+        : leveldb::EnvWrapper( leveldb::Env::Default() ),
+          m_Failed( false )
+    {}
+
+    virtual ~LogSyncEnv()
+    {}
+
+    virtual leveldb::Status NewWritableFile( const std::string & fname, leveldb::WritableFile ** result )
+    {
+        leveldb::Status s = target()->NewWritableFile( fname, result );
+
+        // 只包装日志文件, 其他文件leveldb自己会fsync
+        if ( s.ok() && fname.size() > 4
+                && fname.compare( fname.size() - 4, 4, ".log" ) == 0 )
+        {
+            *result = new SyncedLogFile( *result, this );
+        }
+
+        return s;
+    }
+
+    // 切换日志时fsync失败, 之前的写入不再有保证
+    bool isFailed() const { return m_Failed; }
+    void setFailed() { m_Failed = true; }
+
+private :
+    volatile bool               m_Failed;
+};
+
+leveldb::Status SyncedLogFile::Close()
+{
+    m_Closed = true;
+
+    leveldb::Status s = m_File->Sync();
+    if ( !s.ok() )
+    {
+        m_Env->setFailed();
+        LOG_ERROR( "SyncedLogFile::Close() : sync failed, %s .\n", s.ToString().c_str() );
+    }
+
+    leveldb::Status rc = m_File->Close();
+    return s.ok() ? rc : s;
+}
+
+
 LevelDBEngine::LevelDBEngine( const std::string & location )
     : m_Capacity( 0 ),
+      m_WriteBufferSize( eDBOptions_WriteBufferSize ),
       m_Path( location ),
       m_Cache( NULL ),
+      m_Env( NULL ),
       m_Database( NULL ),
+      m_IsSync( false ),
+      m_ValueCache( NULL ),
       m_TxnTimestamp( 0 ),
       m_Transaction( NULL ),
       m_BatchHandler( NULL )
@@ -53,7 +237,11 @@ bool LevelDBEngine::initialize()
     options.error_if_exists     = false;
     options.create_if_missing   = true;
     options.block_size          = eDBOptions_BlockSize;
-    options.write_buffer_size   = eDBOptions_WriteBufferSize;
+    options.write_buffer_size   = m_WriteBufferSize;
+
+    // 切换日志文件时fsync旧的日志
+    m_Env = new LogSyncEnv;
+    options.env                 = m_Env;
 
     // 打开数据库
     leveldb::Status status = leveldb::DB::Open( options, m_Path, &m_Database );
@@ -70,7 +258,7 @@ void LevelDBEngine::finalize()
 {
     if ( m_Transaction )
     {
-        this->commit();
+        this->commit( m_IsSync );
     }
 
     if ( m_Database )
@@ -79,6 +267,12 @@ void LevelDBEngine::finalize()
         m_Database = NULL;
     }
 
+    if ( m_Env )
+    {
+        delete m_Env;
+        m_Env = NULL;
+    }
+
     if ( m_Cache )
     {
         delete m_Cache;
@@ -109,7 +303,11 @@ bool LevelDBEngine::add( const Key & key, const Value & value )
     }
 
     // 存档
-    rc = m_Database->Put( leveldb::WriteOptions(), dbkey, leveldb::Slice(value) );
+    rc = m_Database->Put( this->writeoptions(m_IsSync), dbkey, leveldb::Slice(value) );
+    if ( rc.ok() && m_BatchHandler != NULL )
+    {
+        m_BatchHandler->Put( dbkey, leveldb::Slice(value) );
+    }
 
 	return rc.ok();
 }
@@ -129,20 +327,152 @@ bool LevelDBEngine::set( const Key & key, const Value & value )
     }
 
     // 存档
-    leveldb::Status rc = m_Database->Put( leveldb::WriteOptions(), dbkey, dbvalue );
+    leveldb::Status rc = m_Database->Put( this->writeoptions(m_IsSync), dbkey, dbvalue );
+    if ( rc.ok() && m_BatchHandler != NULL )
+    {
+        m_BatchHandler->Put( dbkey, dbvalue );
+    }
 
     return rc.ok();
 }
 
 bool LevelDBEngine::get( const Key & key, Value & value )
 {
+    uint64_t ticket = 0;
     const leveldb::Slice dbkey( key );
 
+    // 优先从缓存中读取
+    if ( m_ValueCache != NULL
+            && m_ValueCache->get( key, value, ticket ) )
+    {
+        return true;
+    }
+
     leveldb::Status rc = m_Database->Get( leveldb::ReadOptions(), dbkey, &value );
+    if ( rc.ok() && m_ValueCache != NULL )
+    {
+        m_ValueCache->fill( key, value, ticket );
+    }
 
     return rc.ok();
 }
 
+// 按照KEY的顺序排列下标
+struct KeyIndexLess
+{
+    KeyIndexLess( const std::vector<Key> & k ) : keys(k) {}
+
+    bool operator () ( size_t a, size_t b ) const
+    {
+        return keys[a] < keys[b];
+    }
+
+    const std::vector<Key> & keys;
+};
+
+size_t LevelDBEngine::multiGet( const std::vector<Key> & keys,
+        std::vector<Value> & values, std::vector<bool> & founds )
+{
+    size_t nfound = 0;
+
+    values.resize( keys.size() );
+    founds.assign( keys.size(), false );
+
+    if ( keys.empty() )
+    {
+        return 0;
+    }
+
+    // 先查缓存, 只有未命中的KEY才读取leveldb
+    // 快照只覆盖未命中的KEY, 缓存中的数据可能比快照新
+    std::vector<size_t> order;
+    std::vector<uint64_t> tickets( keys.size(), 0 );
+    order.reserve( keys.size() );
+    for ( size_t i = 0; i < keys.size(); ++i )
+    {
+        if ( m_ValueCache != NULL
+                && m_ValueCache->get( keys[i], values[i], tickets[i] ) )
+        {
+            founds[i] = true;
+            ++nfound;
+            continue;
+        }
+
+        order.push_back( i );
+    }
+
+    if ( order.empty() )
+    {
+        return nfound;
+    }
+
+    leveldb::ReadOptions options;
+    options.snapshot = m_Database->GetSnapshot();
+
+    if ( order.size() == 1 )
+    {
+        size_t i = order[0];
+        founds[i] = m_Database->Get( options, keys[i], &values[i] ).ok();
+        m_Database->ReleaseSnapshot( options.snapshot );
+        if ( founds[i] )
+        {
+            ++nfound;
+            if ( m_ValueCache != NULL )
+            {
+                m_ValueCache->fill( keys[i], values[i], tickets[i] );
+            }
+        }
+        return nfound;
+    }
+
+    // 按照KEY排序后用一个迭代器从前往后读取
+    std::sort( order.begin(), order.end(), KeyIndexLess(keys) );
+
+    bool positioned = false;
+    leveldb::Iterator * it = m_Database->NewIterator( options );
+
+    for ( size_t n = 0; n < order.size(); ++n )
+    {
+        size_t i = order[n];
+        leveldb::Slice target( keys[i] );
+
+        // 密集的KEY顺序向后扫描, 距离太远时重新定位
+        if ( positioned )
+        {
+            for ( int32_t steps = 0;
+                    steps < eMultiGet_SweepSteps
+                    && it->Valid() && it->key().compare( target ) < 0; ++steps )
+            {
+                it->Next();
+            }
+        }
+        if ( !positioned
+                || ( it->Valid() && it->key().compare( target ) < 0 ) )
+        {
+            it->Seek( target );
+            positioned = true;
+        }
+
+        // 迭代器无效说明后面已经没有数据
+        if ( it->Valid() && it->key().compare( target ) == 0 )
+        {
+            values[i].assign( it->value().data(), it->value().size() );
+            founds[i] = true;
+            ++nfound;
+
+            if ( m_ValueCache != NULL )
+            {
+                m_ValueCache->fill( keys[i], values[i], tickets[i] );
+            }
+        }
+    }
+
+    delete it;
+    m_Database->ReleaseSnapshot( options.snapshot );
+
+    return nfound;
+}
+
 bool LevelDBEngine::del( const Key & key )
 {
     const leveldb::Slice dbkey( key );
@@ -157,7 +487,11 @@ bool LevelDBEngine::del( const Key & key )
     }
 
     // 存档
-    leveldb::Status rc = m_Database->Delete( leveldb::WriteOptions(), dbkey );
+    leveldb::Status rc = m_Database->Delete( this->writeoptions(m_IsSync), dbkey );
+    if ( rc.ok() && m_BatchHandler != NULL )
+    {
+        m_BatchHandler->Delete( dbkey );
+    }
 
     return rc.ok();
 }
@@ -166,7 +500,7 @@ bool LevelDBEngine::start( int32_t timeout )
 {
     if ( m_Transaction )
     {
-        this->commit();
+        this->commit( m_IsSync );
     }
 
     // 创建事务
@@ -180,14 +514,14 @@ bool LevelDBEngine::start( int32_t timeout )
     return false;
 }
 
-bool LevelDBEngine::commit()
+bool LevelDBEngine::commit( bool sync )
 {
     if ( m_Transaction == NULL )
     {
         return false;
     }
 
-    leveldb::Status rc = m_Database->Write( leveldb::WriteOptions(), m_Transaction );
+    leveldb::Status rc = m_Database->Write( this->writeoptions(sync), m_Transaction );
     if ( rc.ok() )
     {
         // 处理函数
@@ -205,6 +539,45 @@ bool LevelDBEngine::commit()
     return rc.ok();
 }
 
+bool LevelDBEngine::write( leveldb::WriteBatch * batch, bool sync )
+{
+    leveldb::Status rc = m_Database->Write( this->writeoptions(sync), batch );
+    if ( rc.ok() && m_BatchHandler != NULL )
+    {
+        batch->Iterate( m_BatchHandler );
+    }
+
+    return rc.ok();
+}
+
+bool LevelDBEngine::sync()
+{
+    // 空的WriteBatch也会追加一条日志记录,
+    // sync写入时会fsync整个日志文件, 覆盖当前日志中之前所有的非sync写入
+    // 之前的日志在切换时已经fsync
+    leveldb::WriteBatch batch;
+    leveldb::Status rc = m_Database->Write( this->writeoptions(true), &batch );
+
+    return rc.ok() && !m_Env->isFailed();
+}
+
+leveldb::WriteOptions LevelDBEngine::writeoptions( bool sync ) const
+{
+    leveldb::WriteOptions options;
+    options.sync = sync;
+    return options;
+}
+
+void LevelDBEngine::rollback()
+{
+    if ( m_Transaction != NULL )
+    {
+        delete m_Transaction;
+        m_TxnTimestamp = 0;
+        m_Transaction = NULL;
+    }
+}
+
 void LevelDBEngine::cleandb()
 {
     leveldb::Iterator * it = m_Database->NewIterator( leveldb::ReadOptions() );
@@ -237,6 +610,127 @@ void LevelDBEngine::compactdb()
     m_Database->CompactRange( NULL, NULL );
 }
 
+void LevelDBEngine::compactdb( const std::string & begin, const std::string & end )
+{
+    const leveldb::Slice b( begin );
+    const leveldb::Slice e( end );
+
+    m_Database->CompactRange( &b, &e );
+}
+
+void LevelDBEngine::split( const std::string & start, const std::string & limit,
+        uint32_t count, std::vector<std::string> & bounds )
+{
+    bounds.clear();
+    bounds.push_back( start );
+
+    if ( count <= 1 )
+    {
+        return;
+    }
+
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    leveldb::Iterator * it = m_Database->NewIterator( options );
+
+    // 区间中第一个和最后一个KEY
+    std::string first, last;
+    it->Seek( start );
+    if ( it->Valid() && it->key().compare( limit ) < 0 )
+    {
+        first = it->key().ToString();
+
+        it->Seek( limit );
+        if ( it->Valid() )
+        {
+            it->Prev();
+        }
+        else
+        {
+            it->SeekToLast();
+        }
+        if ( it->Valid() )
+        {
+            last = it->key().ToString();
+        }
+    }
+
+    if ( first.empty() || last <= first )
+    {
+        delete it;
+        return;
+    }
+
+    // 去掉公共前缀后, 取之后的8个字节作为整数, 均匀取样
+    size_t prefix = 0;
+    while ( prefix < first.size() && prefix < last.size() && first[prefix] == last[prefix] )
+    {
+        ++prefix;
+    }
+
+    uint64_t a = 0, b = 0;
+    std::string fa = first.substr( prefix, sizeof(uint64_t) );
+    std::string fb = last.substr( prefix, sizeof(uint64_t) );
+    fa.resize( sizeof(uint64_t), 0 );
+    fb.resize( sizeof(uint64_t), 0 );
+    memcpy( &a, fa.data(), sizeof(uint64_t) );
+    memcpy( &b, fb.data(), sizeof(uint64_t) );
+    a = be64toh( a );
+    b = be64toh( b );
+
+    std::vector<std::string> samples;
+    samples.push_back( first );
+    for ( uint32_t i = 1; i < eSplit_Samples && b > a; ++i )
+    {
+        uint64_t v = htobe64( a + ( b - a ) / eSplit_Samples * i );
+        std::string key = first.substr( 0, prefix );
+        key.append( (const char *)&v, sizeof(uint64_t) );
+
+        if ( key > samples.back() && key < last )
+        {
+            samples.push_back( key );
+        }
+    }
+    samples.push_back( last );
+
+    // 每个取样区间的大小
+    size_t n = samples.size() - 1;
+    std::vector<leveldb::Range> ranges( n );
+    std::vector<uint64_t> sizes( n, 0 );
+    for ( size_t i = 0; i < n; ++i )
+    {
+        ranges[i] = leveldb::Range( samples[i], samples[i+1] );
+    }
+    m_Database->GetApproximateSizes( &ranges[0], (int)n, &sizes[0] );
+
+    uint64_t total = 0;
+    for ( size_t i = 0; i < n; ++i )
+    {
+        total += sizes[i];
+    }
+
+    // 累计到平均大小时切分, 切分点对齐到真实的KEY
+    uint64_t accumulated = 0;
+    for ( size_t i = 0; i + 1 < n && total > 0 && bounds.size() < count; ++i )
+    {
+        accumulated += sizes[i];
+        if ( accumulated < total / count * bounds.size() )
+        {
+            continue;
+        }
+
+        it->Seek( samples[i+1] );
+        if ( it->Valid()
+                && it->key().compare( limit ) < 0
+                && it->key().compare( bounds.back() ) > 0 )
+        {
+            bounds.push_back( it->key().ToString() );
+        }
+    }
+
+    delete it;
+}
+
 bool LevelDBEngine::autocommit()
 {
     if ( m_Transaction == NULL )
@@ -255,7 +749,7 @@ bool LevelDBEngine::autocommit()
         return false;
     }
 
-    return this->commit();
+    return this->commit( m_IsSync );
 }
 
 int32_t LevelDBEngine::diskusage() const
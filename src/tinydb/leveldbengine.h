@@ -2,6 +2,8 @@
 #ifndef __SRC_TINYDB_LEVELDBENGINE_H__
 #define __SRC_TINYDB_LEVELDBENGINE_H__
 
+#include <vector>
+
 #include <leveldb/db.h>
 #include <leveldb/env.h>
 #include <leveldb/cache.h>
@@ -11,9 +13,40 @@
 namespace tinydb
 {
 
+class ValueCache;
+class LogSyncEnv;
+
 typedef std::string Key;
 typedef std::string Value;
 
+//
+// KEY的通配符匹配, 只支持*
+// 第一个*之前是字面前缀, 遍历时只需要查找这个范围,
+// 之后的部分按照*拆分成多段, 依次查找, 最后一段必须在末尾
+//
+class KeyPattern
+{
+public :
+    KeyPattern( const std::string & pattern );
+    ~KeyPattern();
+
+public :
+    // 是否包含通配符
+    bool isWildcard() const { return m_IsWildcard; }
+    // 所有匹配的KEY都以此开头
+    const std::string & prefix() const { return m_Prefix; }
+
+    // 匹配
+    bool match( const leveldb::Slice & key ) const;
+
+private :
+    bool                        m_IsWildcard;
+    bool                        m_IsPrefixOnly;     // 只有末尾一个*, 前缀相同即匹配
+    std::string                 m_Pattern;
+    std::string                 m_Prefix;
+    std::vector<std::string>    m_Segments;         // 前缀之后以*分隔的各段
+};
+
 class LevelDBEngine
 {
 public :
@@ -23,8 +56,14 @@ public :
 public :
     // 设置缓存大小
     bool setCacheSize( size_t capacity );
+    // 设置写缓冲区的大小, 初始化之前设置
+    void setWriteBufferSize( size_t size ) { m_WriteBufferSize = size; }
     // 设置事务回调函数
     void setBatchHandler( leveldb::WriteBatch::Handler * cb );
+    // 设置事务之外的写入是否fsync
+    void setSync( bool sync ) { m_IsSync = sync; }
+    // 设置热点数据缓存, 同时需要作为事务回调函数以便在写入后更新
+    void setValueCache( ValueCache * cache ) { m_ValueCache = cache; }
 
     // 初始化
     bool initialize();
@@ -37,15 +76,30 @@ public :
     bool set( const Key & key, const Value & value );
     // 查询
     bool get( const Key & key, Value & value );
+    // 批量查询, 先查热点缓存, 未命中的KEY在同一个快照中按照KEY的顺序读取
+    // 缓存命中的数据不在快照中, 可能比快照新, 整体不保证是同一时刻的数据
+    // values和founds与keys一一对应, 返回命中的个数
+    size_t multiGet( const std::vector<Key> & keys,
+            std::vector<Value> & values, std::vector<bool> & founds );
     // 删除
     bool del( const Key & key );
 
     // 开启/提交事务(单位毫秒)
     // timeout = 0 : 不设置超时时间
+    // sync = true : 提交后fsync
     bool start( int32_t timeout = 0 );
-    bool commit();
+    bool commit( bool sync = false );
+    // 放弃未提交的事务
+    void rollback();
     leveldb::WriteBatch * txn() const { return m_Transaction; }
 
+    // 写入调用者自己的WriteBatch, 不影响当前的事务
+    bool write( leveldb::WriteBatch * batch, bool sync = false );
+
+    // fsync之前所有的写入
+    // 包括leveldb切换日志文件之前的旧日志, 见LogSyncEnv
+    bool sync();
+
     // 获取数据库
     leveldb::DB * getDatabase() const { return m_Database; }
 
@@ -61,26 +115,29 @@ public :
 
     // 压缩数据库
     void compactdb();
+    // 压缩[begin, end]区间
+    void compactdb( const std::string & begin, const std::string & end );
+
+    // 按照数据大小把[start, limit)划分成最多count个区间
+    // bounds中是每个区间的起始KEY, 第一个是start
+    void split( const std::string & start, const std::string & limit,
+            uint32_t count, std::vector<std::string> & bounds );
 
-    // 遍历, 支持通配符*
+    // 遍历, 支持通配符*, 例如: user:*, user:*:name
+    // 只遍历字面前缀的范围, 超出后立即停止
     template<class Fn>
-        void foreach( const std::string & prefix, Fn & f )
+        void foreach( const std::string & pattern, Fn & f )
         {
-            std::string mask = prefix;
+            KeyPattern matcher( pattern );
 
-            if ( !prefix.empty() )
+            if ( !pattern.empty() && !matcher.isWildcard() )
             {
-                int32_t pos = prefix.find( "*" );
-                if ( pos == -1 )
+                Value value;
+                if ( this->get(pattern, value) )
                 {
-                    Value value;
-                    if ( this->get(prefix, value) )
-                    {
-                        f( prefix, value );
-                    }
-                    return;
+                    f( leveldb::Slice(pattern), leveldb::Slice(value) );
                 }
-                mask = prefix.substr( 0, pos );
+                return;
             }
 
             leveldb::Iterator * it = m_Database->NewIterator( leveldb::ReadOptions() );
@@ -89,28 +146,74 @@ public :
                 return;
             }
 
-            if ( !mask.empty() )
+            const leveldb::Slice prefix( matcher.prefix() );
+            for ( it->Seek( prefix );
+                    it->Valid() && it->key().starts_with( prefix ); it->Next() )
             {
-                it->Seek( mask );
+                if ( matcher.match( it->key() )
+                        && !f( it->key(), it->value() ) )
+                {
+                    break;
+                }
+            }
+            delete it;
+        }
+
+    // 按照游标分批遍历匹配的KEY, 每次最多返回count个
+    // cursor是上一次遍历到的KEY, 为空时从前缀开始
+    // f返回false时暂停, 返回false表示已经遍历完成
+    template<class Fn>
+        bool scan( const KeyPattern & matcher, std::string & cursor, size_t count, Fn & f )
+        {
+            bool more = false;
+            leveldb::Iterator * it = m_Database->NewIterator( leveldb::ReadOptions() );
+            if ( it == NULL )
+            {
+                return false;
+            }
+
+            const leveldb::Slice prefix( matcher.prefix() );
+            if ( cursor.empty() )
+            {
+                it->Seek( prefix );
             }
             else
             {
-                it->SeekToFirst();
+                // 跳过上一次已经遍历的KEY
+                it->Seek( cursor );
+                if ( it->Valid() && it->key() == leveldb::Slice( cursor ) )
+                {
+                    it->Next();
+                }
             }
-            for ( ; it->Valid(); it->Next() )
+
+            size_t n = 0, steps = 0;
+            for ( ; it->Valid() && it->key().starts_with( prefix ); it->Next() )
             {
-                if ( !mask.empty()
-                        && it->key().ToString().find(mask) != 0 )
+                // 不匹配的KEY太多时也要让出
+                if ( n >= count || steps >= eScan_MaxSteps )
+                {
+                    more = true;
+                    break;
+                }
+
+                ++steps;
+                cursor.assign( it->key().data(), it->key().size() );
+                if ( !matcher.match( it->key() ) )
                 {
                     continue;
                 }
 
-                if ( !f( it->key().ToString(), it->value().ToString() ) )
+                ++n;
+                if ( !f( it->key(), it->value() ) )
                 {
+                    more = true;
                     break;
                 }
             }
             delete it;
+
+            return more;
         }
 
 private :
@@ -120,15 +223,29 @@ private :
         eDBOptions_WriteBufferSize  = ( 64 * 1024 * 1024 ),     // 64M
     };
 
+    enum
+    {
+        eMultiGet_SweepSteps        = 8,    // 相邻的KEY之间顺序扫描的最大步数, 超过后重新定位
+        eScan_MaxSteps              = 4096, // 分批遍历时每次最多检查的KEY
+        eSplit_Samples              = 256,  // 划分区间时取样的个数
+    };
+
     // 自动提交
     bool autocommit();
 
+    // 写入选项
+    leveldb::WriteOptions writeoptions( bool sync ) const;
+
 private :
     size_t                          m_Capacity;
+    size_t                          m_WriteBufferSize;
     std::string                     m_Path;
 
     leveldb::Cache *                m_Cache;
+    LogSyncEnv *                    m_Env;
     leveldb::DB *                   m_Database;
+    bool                            m_IsSync;
+    ValueCache *                    m_ValueCache;
 
 private :
     int64_t                         m_TxnTimestamp;         // 事务超时时间
@@ -92,7 +92,20 @@ void CMasterProxy::process( SSMessage * msg )
                 }
 
                 SyncRequest * request = (SyncRequest *)msg;
-                g_BackendSync->process( request->sid, request->lastseq, request->lastkey );
+                g_BackendSync->process( request->sid,
+                        request->lastseq, request->lastkey, request->bounds, request->lastkeys );
+            }
+            break;
+
+        case eSSCommand_SyncAck :
+            {
+                if ( g_BackendSync == NULL )
+                {
+                    return;
+                }
+
+                SyncAckCommand * ack = (SyncAckCommand *)msg;
+                g_BackendSync->ack( ack->sid, ack->seq, ack->bytes );
             }
             break;
 
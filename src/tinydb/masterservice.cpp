@@ -116,6 +116,27 @@ IIOSession * CMasterService::onAccept( sid_t id, const char * host, uint16_t por
     return new CSlaveSession( this, host, port );
 }
 
+int32_t CMasterService::broadcast( SSMessage * message )
+{
+    // 序列化
+    Slice buf = message->encode();
+
+    return IIOService::broadcast( std::string( buf.data(), buf.size() ) );
+}
+
+int32_t CMasterService::broadcast( const std::vector<sid_t> & ids, SSMessage * message )
+{
+    if ( ids.empty() )
+    {
+        return 0;
+    }
+
+    // 只序列化一次, 由网络层分发给所有的会话
+    Slice buf = message->encode();
+
+    return IIOService::broadcast( ids, buf.data(), (uint32_t)buf.size() );
+}
+
 int32_t CMasterService::send( sid_t sid, SSMessage * message )
 {
     int32_t result = -1;
@@ -3,6 +3,7 @@
 #define __SRC_TINYDB_MASTERSERVICE_H__
 
 #include <string>
+#include <vector>
 
 #include "io/io.h"
 
@@ -45,6 +46,8 @@ public :
 public :
     // 广播
     int32_t broadcast( SSMessage * message );
+    // 广播给指定的会话, 只序列化一次
+    int32_t broadcast( const std::vector<sid_t> & ids, SSMessage * message );
 
     // 发送
     int32_t send( sid_t sid, SSMessage * message );
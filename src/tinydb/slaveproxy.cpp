@@ -2,8 +2,11 @@
 #include "base.h"
 #include "types.h"
 
+#include <algorithm>
+
 #include "utils/slice.h"
 #include "utils/utility.h"
+#include "utils/streambuf.h"
 #include "utils/timeutils.h"
 
 #include "leveldbengine.h"
@@ -26,7 +29,19 @@ CSlaveProxy::CSlaveProxy( int32_t percision, LevelDBEngine * engine )
       m_MetaEngine( NULL ),
       m_LastSeq( 0ULL ),
       m_CopyCount( 0ULL ),
-      m_SyncCount( 0ULL )
+      m_SyncCount( 0ULL ),
+      m_HasPartitions( false ),
+      m_ApplyInterval( 0 ),
+      m_ApplyTimestamp( 0LL ),
+      m_BatchCount( 0 ),
+      m_BatchBytes( 0 ),
+      m_Changed( false ),
+      m_RecvBytes( 0ULL ),
+      m_AckBytes( 0ULL ),
+      m_AppliedSeq( 0ULL ),
+      m_Copying( false ),
+      m_MasterSeq( 0ULL ),
+      m_FreshTimestamp( 0LL )
 {}
 
 CSlaveProxy::~CSlaveProxy()
@@ -52,9 +67,13 @@ bool CSlaveProxy::onStart()
 
     // 加载备库状态
     this->loadStatus();
+    m_AppliedSeq = m_LastSeq;
+    m_Copying = !m_LastKey.empty() || !m_Bounds.empty();
 
     // 获取当前时间片
     m_CurTimeslice = utils::TimeUtils::now();
+    m_ApplyTimestamp = m_CurTimeslice;
+    m_ApplyInterval = CDatadConfig::getInstance().getReplicationConfig()->applymilliseconds;
 
     return true;
 }
@@ -62,6 +81,7 @@ bool CSlaveProxy::onStart()
 void CSlaveProxy::onStop()
 {
     this->cleanup();
+    this->apply();
 
     if ( m_MetaEngine != NULL )
     {
@@ -74,9 +94,18 @@ void CSlaveProxy::onStop()
 
 void CSlaveProxy::onIdle()
 {
+    int64_t now = utils::TimeUtils::now();
+
+    // 合并一段时间内收到的数据
+    if ( ( m_Changed || m_RecvBytes != m_AckBytes )
+            && now - m_ApplyTimestamp >= m_ApplyInterval )
+    {
+        this->apply();
+        now = utils::TimeUtils::now();
+    }
+
     // 控制每帧的时间
     int32_t sleep_msecs = 0;
-    int64_t now = utils::TimeUtils::now();
     int32_t used_msecs = now - m_CurTimeslice;
     if ( used_msecs >= 0 && used_msecs < m_Percision )
     {
@@ -114,12 +143,31 @@ void CSlaveProxy::onTask( int32_t type, void * task )
     }
 }
 
+// 同步状态和数据保存在同一个数据库中
+static inline std::string encode_status_key()
+{
+	std::string ret;
+	ret.push_back( DataType::META );
+	ret.append( "slave.status" );
+	return ret;
+}
+
+static inline std::string encode_partitions_key()
+{
+	std::string ret;
+	ret.push_back( DataType::META );
+	ret.append( "slave.partitions" );
+	return ret;
+}
+
 void CSlaveProxy::loadStatus()
 {
 	std::string key = "new.slave.status";
 	std::string val;
 
-    bool rc = m_MetaEngine->get( key, val );
+    // 兼容之前保存在状态数据库中的同步状态
+    bool rc = m_StorageEngine->get( encode_status_key(), val )
+        || m_MetaEngine->get( key, val );
     if ( rc )
     {
 		if( val.size() < sizeof(uint64_t) )
@@ -133,15 +181,108 @@ void CSlaveProxy::loadStatus()
 		}
 
     }
+
+    // 中断的并行复制
+    m_Bounds.clear();
+    m_PartKeys.clear();
+    m_HasPartitions = m_StorageEngine->get( encode_partitions_key(), val );
+    if ( m_HasPartitions )
+    {
+        StreamBuf unpack( val.data(), val.size() );
+        if ( !unpack.decode( m_Bounds )
+                || !unpack.decode( m_PartKeys )
+                || m_Bounds.size() != m_PartKeys.size() )
+        {
+            LOG_ERROR( "invalid format of partitions.\n" );
+            m_Bounds.clear();
+            m_PartKeys.clear();
+        }
+    }
 }
 
 void CSlaveProxy::saveStatus()
 {
-	std::string key = "new.slave.status";
 	std::string val;
 	val.append( (char *)&m_LastSeq, sizeof(uint64_t) );
 	val.append( m_LastKey );
-    m_MetaEngine->set( key, val );
+    m_Batch.Put( encode_status_key(), val );
+
+    // 每个区间的复制进度
+    if ( !m_Bounds.empty() )
+    {
+        StreamBuf pack;
+        pack.encode( m_Bounds );
+        pack.encode( m_PartKeys );
+        m_Batch.Put( encode_partitions_key(), pack.string() );
+        m_HasPartitions = true;
+    }
+    else if ( m_HasPartitions )
+    {
+        m_Batch.Delete( encode_partitions_key() );
+        m_HasPartitions = false;
+    }
+}
+
+void CSlaveProxy::getApplyRate( uint64_t & entries, uint64_t & entryrate, uint64_t & byterate )
+{
+    int64_t now = utils::TimeUtils::now();
+
+    m_StatusLock.lock();
+    entries = m_ApplyEntries.total();
+    entryrate = m_ApplyEntries.rate( now );
+    byterate = m_ApplyBytes.rate( now );
+    m_StatusLock.unlock();
+}
+
+int64_t CSlaveProxy::getStaleness() const
+{
+    int64_t timestamp = m_FreshTimestamp;
+    if ( timestamp == 0 )
+    {
+        return -1;
+    }
+
+    return utils::TimeUtils::now() - timestamp;
+}
+
+void CSlaveProxy::track( uint64_t seq )
+{
+    int64_t now = utils::TimeUtils::now();
+
+    m_MasterSeq = seq;
+
+    // 已经追上, 之前的位置也都追上了
+    if ( !m_Copying && seq <= m_AppliedSeq )
+    {
+        m_FreshTimestamp = now;
+        m_MasterStatus.clear();
+        return;
+    }
+
+    // 记录过多时替换最后一个, 计算的延迟只会偏大
+    if ( m_MasterStatus.size() >= eStatus_MaxPending )
+    {
+        m_MasterStatus.back() = std::make_pair( seq, now );
+    }
+    else
+    {
+        m_MasterStatus.push_back( std::make_pair( seq, now ) );
+    }
+}
+
+void CSlaveProxy::refresh()
+{
+    if ( m_Copying )
+    {
+        return;
+    }
+
+    while ( !m_MasterStatus.empty()
+            && m_MasterStatus.front().first <= m_AppliedSeq )
+    {
+        m_FreshTimestamp = m_MasterStatus.front().second;
+        m_MasterStatus.pop_front();
+    }
 }
 
 void CSlaveProxy::onConnect()
@@ -149,6 +290,12 @@ void CSlaveProxy::onConnect()
     SyncRequest msg;
     msg.lastseq = m_LastSeq;
     msg.lastkey = m_LastKey;
+    msg.bounds = m_Bounds;
+    msg.lastkeys = m_PartKeys;
+
+    // 主机为新的连接重新计算发送窗口
+    m_RecvBytes = 0;
+    m_AckBytes = 0;
 
     g_SlaveClient->send( &msg );
 }
@@ -160,31 +307,29 @@ void CSlaveProxy::process( SSMessage * msg )
         case eSSCommand_SyncResponse :
             {
                 SyncResponse * request = (SyncResponse *)msg;
-                Binlog log;
-                if ( log.load( request->binlog ) == -1 )
-                {
-                    return;
-                }
+                this->dispatch( request->method,
+                        Slice( request->binlog ), Slice( request->value ) );
+            }
+            break;
 
-                switch ( request->method )
+        case eSSCommand_SyncStatus :
+            {
+                SyncStatusCommand * cmd = (SyncStatusCommand *)msg;
+                this->track( cmd->lastseq );
+            }
+            return;
+
+        case eSSCommand_SyncBatch :
+            {
+                size_t offset = 0;
+                uint8_t method = 0;
+                Slice binlog, value;
+                SyncBatchResponse * request = (SyncBatchResponse *)msg;
+
+                m_RecvBytes += request->entries.size();
+                while ( request->next( offset, method, binlog, value ) )
                 {
-                    case BinlogType::NOOP :
-                        {
-                            this->procNoop( log );
-                        }
-                        break;
-
-                    case BinlogType::COPY :
-                        {
-                            this->procCopy( request->method, log, request->value );
-                        }
-                        break;
-
-                    case BinlogType::SYNC :
-                        {
-                            this->procSync( request->method, log, request->value );
-                        }
-                        break;
+                    this->dispatch( method, binlog, value );
                 }
             }
             break;
@@ -193,7 +338,98 @@ void CSlaveProxy::process( SSMessage * msg )
             return;
     }
 
-    return;
+    // 积累的数据过多时立即写入
+    if ( m_BatchBytes >= eApply_MaxBytes )
+    {
+        this->apply();
+    }
+}
+
+void CSlaveProxy::dispatch( uint8_t method, const Slice & binlog, const Slice & value )
+{
+    Binlog log;
+    if ( log.load( leveldb::Slice( binlog.data(), binlog.size() ) ) == -1 )
+    {
+        return;
+    }
+
+    switch ( method )
+    {
+        case BinlogType::NOOP :
+            {
+                this->procNoop( log );
+            }
+            break;
+
+        case BinlogType::COPY :
+            {
+                this->procCopy( method, log, value );
+            }
+            break;
+
+        case BinlogType::SYNC :
+            {
+                this->procSync( method, log, value );
+            }
+            break;
+    }
+}
+
+void CSlaveProxy::apply()
+{
+    m_ApplyTimestamp = utils::TimeUtils::now();
+
+    if ( !m_Changed )
+    {
+        // 没有改变同步状态的消息(比如NOOP)也需要确认, 否则主机的发送窗口会被占满
+        if ( m_RecvBytes != m_AckBytes )
+        {
+            this->ack();
+        }
+        return;
+    }
+
+    // 同步状态和数据在同一个WriteBatch中, 要么都写入, 要么都没有写入
+    this->saveStatus();
+    bool rc = m_StorageEngine->write( &m_Batch );
+
+    if ( rc )
+    {
+        m_StatusLock.lock();
+        m_AppliedSeq = m_LastSeq;
+        m_ApplyEntries.add( m_BatchCount, m_ApplyTimestamp );
+        m_ApplyBytes.add( m_BatchBytes, m_ApplyTimestamp );
+        m_StatusLock.unlock();
+
+        // 同步状态已经写入, 通知主机
+        this->ack();
+
+        this->refresh();
+    }
+
+    m_Batch.Clear();
+    m_BatchCount = 0;
+    m_BatchBytes = 0;
+    m_Changed = false;
+
+    if ( !rc )
+    {
+        // 写入失败, 恢复到上次保存的状态, 重新同步
+        LOG_ERROR( "CSlaveProxy::apply write batch failed, lastseq = %llu.\n", m_LastSeq );
+        m_LastSeq = 0;
+        m_LastKey.clear();
+        this->loadStatus();
+    }
+}
+
+void CSlaveProxy::ack()
+{
+    SyncAckCommand cmd;
+    cmd.seq = m_AppliedSeq;
+    cmd.bytes = m_RecvBytes;
+    g_SlaveClient->send( &cmd );
+
+    m_AckBytes = m_RecvBytes;
 }
 
 int CSlaveProxy::procNoop( const Binlog & log )
@@ -203,19 +439,39 @@ int CSlaveProxy::procNoop( const Binlog & log )
     {
         LOG_DEBUG( "noop lastseq: %llu, seq: %llu", this->m_LastSeq, seq );
         this->m_LastSeq = seq;
-        this->saveStatus();
+        this->m_Changed = true;
     }
 
     return 0;
 }
 
-int CSlaveProxy::procCopy( char method, const Binlog & log, const std::string & value )
+int CSlaveProxy::procCopy( char method, const Binlog & log, const Slice & value )
 {
     switch ( log.cmd() )
     {
         case BinlogCommand::BEGIN :
             {
                 LOG_INFO( "CSlaveProxy::procCopy copy begin.\n" );
+
+                m_Bounds.clear();
+                m_PartKeys.clear();
+
+                // 复制完成之前数据不完整
+                m_Copying = true;
+                m_FreshTimestamp = 0;
+                m_MasterStatus.clear();
+
+                // 并行复制, 带有区间的划分
+                // 复制记录可能先于之前的同步记录到达, 同步位置只由同步记录更新
+                if ( !value.empty() )
+                {
+                    StreamBuf unpack( value.data(), value.size() );
+                    unpack.decode( m_Bounds );
+                    m_PartKeys.resize( m_Bounds.size() );
+                    m_LastSeq = log.seq();
+                    m_LastKey = "";
+                }
+                m_Changed = true;
             }
             break;
 
@@ -223,7 +479,10 @@ int CSlaveProxy::procCopy( char method, const Binlog & log, const std::string &
             {
                 LOG_INFO( "CSlaveProxy::procCopy lastseq = %llu, seq = %llu", m_LastSeq, log.seq() );
                 m_LastKey = "";
-                this->saveStatus();
+                m_Bounds.clear();
+                m_PartKeys.clear();
+                m_Copying = false;
+                m_Changed = true;
             }
             break;
 
@@ -237,7 +496,7 @@ int CSlaveProxy::procCopy( char method, const Binlog & log, const std::string &
     return 0;
 }
 
-int CSlaveProxy::procSync( char method, const Binlog &log, const std::string & value )
+int CSlaveProxy::procSync( char method, const Binlog &log, const Slice & value )
 {
 	switch( log.cmd() )
     {
@@ -248,13 +507,18 @@ int CSlaveProxy::procSync( char method, const Binlog &log, const std::string & v
 					break;
 				}
 
-                m_StorageEngine->set( log.key().ToString(), value );
+                m_Batch.Put( leveldb::Slice( log.key().data(), log.key().size() ),
+                        leveldb::Slice( value.data(), value.size() ) );
+                ++m_BatchCount;
+                m_BatchBytes += log.key().size() + value.size();
             }
 			break;
 
         case BinlogCommand::DEL:
 			{
-                m_StorageEngine->del( log.key().ToString() );
+                m_Batch.Delete( leveldb::Slice( log.key().data(), log.key().size() ) );
+                ++m_BatchCount;
+                m_BatchBytes += log.key().size();
 			}
 			break;
 
@@ -264,13 +528,27 @@ int CSlaveProxy::procSync( char method, const Binlog &log, const std::string & v
 	}
 
     LOG_DEBUG( "Slave::procSync seq=%llu, key=%s.\n", log.seq(), log.key().ToString().c_str() );
-    m_LastSeq = log.seq();
 	if( method == BinlogType::COPY )
     {
 		this->m_LastKey = log.key().ToString();
 	}
 
-    this->saveStatus();
+	if ( method == BinlogType::COPY && !m_Bounds.empty() )
+    {
+        // 记录区间的复制进度
+        std::vector<std::string>::iterator it =
+            std::upper_bound( m_Bounds.begin(), m_Bounds.end(), m_LastKey );
+        if ( it != m_Bounds.begin() )
+        {
+            m_PartKeys[ it - m_Bounds.begin() - 1 ] = m_LastKey;
+        }
+    }
+    else
+    {
+        m_LastSeq = log.seq();
+    }
+
+    m_Changed = true;
 
     return 0;
 }
@@ -5,10 +5,15 @@
 #include <stdint.h>
 #include <string>
 #include <pthread.h>
+#include <deque>
 #include <vector>
 
+#include <leveldb/write_batch.h>
+
+#include "utils/slice.h"
 #include "utils/thread.h"
 
+#include "status.h"
 #include "dataserver.h"
 
 namespace tinydb
@@ -38,16 +43,36 @@ public:
     // 备机连接主机成功
     void onConnect();
 
+    // 统计, 已经写入的最后一条binlog和写入的速率
+    uint64_t getAppliedSeq() const { return m_AppliedSeq; }
+    void getApplyRate( uint64_t & entries, uint64_t & entryrate, uint64_t & byterate );
+
+    // 数据的延迟(毫秒), 还没有追上主机时返回-1
+    int64_t getStaleness() const;
+    // 主机最后提交的seq
+    uint64_t getMasterSeq() const { return m_MasterSeq; }
+
 private :
     // 消息处理
     void process( SSMessage * msg );
+    void dispatch( uint8_t method, const Slice & binlog, const Slice & value );
 
-    // 数据处理
+    // 数据处理, 写入m_Batch中
     int procNoop( const Binlog & log );
-	int procSync( char method, const Binlog & log, const std::string & value );
-    int procCopy( char method, const Binlog & log, const std::string & value );
+	int procSync( char method, const Binlog & log, const Slice & value );
+    int procCopy( char method, const Binlog & log, const Slice & value );
 
-    // 加载/保存同步状态
+    // 同步状态和数据一起写入
+    void apply();
+    // 通知主机已经写入的位置和字节数
+    void ack();
+
+    // 收到主机的同步位置
+    void track( uint64_t seq );
+    // 写入之后, 更新追上的主机位置
+    void refresh();
+
+    // 加载同步状态, 保存到m_Batch中
     void loadStatus();
 	void saveStatus();
 
@@ -62,6 +87,47 @@ private :
 	std::string             m_LastKey;
 	uint64_t                m_CopyCount;
 	uint64_t                m_SyncCount;
+	// 并行复制时每个区间的起始KEY和已经复制的KEY
+	std::vector<std::string> m_Bounds;
+	std::vector<std::string> m_PartKeys;
+	bool                    m_HasPartitions;        // 是否保存过区间
+
+private :
+    enum
+    {
+        eApply_MaxBytes     = 4 * 1024 * 1024,      // 合并写入的最大长度
+    };
+
+    int32_t                 m_ApplyInterval;        // 合并写入的间隔
+    int64_t                 m_ApplyTimestamp;       // 上次写入的时间
+    leveldb::WriteBatch     m_Batch;                // 还没有写入的数据
+    uint32_t                m_BatchCount;
+    size_t                  m_BatchBytes;
+    bool                    m_Changed;              // 同步状态是否改变
+    uint64_t                m_RecvBytes;            // 本次连接收到的同步消息的字节数
+    uint64_t                m_AckBytes;             // 已经确认的字节数
+
+private :
+    utils::Mutex            m_StatusLock;
+    uint64_t                m_AppliedSeq;           // 已经写入的seq
+    RateCounter             m_ApplyEntries;         // 写入的记录数
+    RateCounter             m_ApplyBytes;           // 写入的字节数
+
+private :
+    enum
+    {
+        eStatus_MaxPending  = 64,                   // 最多记录的还没有追上的主机位置
+    };
+
+    //
+    // 数据的新旧
+    // 主机定期发送最后提交的seq, 写入到这个seq之后,
+    // 数据至少和收到的时候一样新, 延迟中不包括网络的传输时间
+    //
+    bool                    m_Copying;              // 正在全量复制, 数据不完整
+    volatile uint64_t       m_MasterSeq;
+    volatile int64_t        m_FreshTimestamp;       // 追上的主机位置收到的时间
+    std::deque< std::pair<uint64_t, int64_t> > m_MasterStatus;   // 还没有追上的主机位置和收到的时间
 };
 
 #define g_SlaveProxy    CDataServer::getInstance().getSlaveProxy()
@@ -1,14 +1,123 @@
 
+#include <string.h>
+
 #include "status.h"
 
 namespace tinydb
 {
 
+LatencyHistogram::LatencyHistogram()
+    : m_Count( 0 )
+{
+    memset( m_Buckets, 0, sizeof(m_Buckets) );
+}
+
+LatencyHistogram::~LatencyHistogram()
+{}
+
+void LatencyHistogram::add( int64_t usecs )
+{
+    uint32_t i = 0;
+
+    // 找到最高位
+    for ( ; usecs > 0 && i < eMaxBuckets-1; usecs >>= 1 )
+    {
+        ++i;
+    }
+
+    ++m_Count;
+    ++m_Buckets[i];
+}
+
+void LatencyHistogram::merge( const LatencyHistogram & h )
+{
+    m_Count += h.m_Count;
+
+    for ( uint32_t i = 0; i < eMaxBuckets; ++i )
+    {
+        m_Buckets[i] += h.m_Buckets[i];
+    }
+}
+
+uint64_t LatencyHistogram::percentile( double p ) const
+{
+    uint64_t sum = 0;
+    uint64_t threshold = (uint64_t)( m_Count * p );
+
+    if ( m_Count == 0 )
+    {
+        return 0;
+    }
+
+    for ( uint32_t i = 0; i < eMaxBuckets; ++i )
+    {
+        sum += m_Buckets[i];
+        if ( sum > threshold )
+        {
+            return bound( i );
+        }
+    }
+
+    return bound( eMaxBuckets-1 );
+}
+
+RateCounter::RateCounter()
+    : m_Total( 0ULL ),
+      m_Base( 0ULL ),
+      m_Start( 0LL ),
+      m_Rate( 0ULL )
+{}
+
+RateCounter::~RateCounter()
+{}
+
+void RateCounter::add( uint64_t n, int64_t now )
+{
+    if ( m_Start == 0 )
+    {
+        m_Start = now;
+    }
+
+    m_Total += n;
+
+    // 区间结束, 计算速率
+    if ( now - m_Start >= eInterval )
+    {
+        m_Rate = ( m_Total - m_Base ) * 1000 / ( now - m_Start );
+        m_Base = m_Total;
+        m_Start = now;
+    }
+}
+
+uint64_t RateCounter::rate( int64_t now ) const
+{
+    if ( m_Start == 0 )
+    {
+        return 0;
+    }
+
+    if ( now - m_Start >= 2 * eInterval )
+    {
+        return ( m_Total - m_Base ) * 1000 / ( now - m_Start );
+    }
+
+    return m_Rate;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
 ServerStatus::ServerStatus()
     : m_StartTime( utils::TimeUtils::time() ),
       m_GetOps( 0 ),
+      m_GetHits( 0 ),
+      m_GetMisses( 0 ),
       m_SetOps( 0 ),
-      m_NowTime( 0ULL )
+      m_NowTime( 0ULL ),
+      m_SyncUsecs( 0ULL ),
+      m_AckTimeouts( 0ULL ),
+      m_StaleReads( 0ULL )
 {}
 
 ServerStatus::~ServerStatus()
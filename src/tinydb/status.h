@@ -14,6 +14,72 @@
 namespace tinydb
 {
 
+//
+// 延时直方图
+// 第i个桶统计耗时在[2^(i-1), 2^i)微秒之间的请求
+//
+class LatencyHistogram
+{
+public :
+    enum
+    {
+        eMaxBuckets     = 24,       // 最后一个桶统计超过4秒的请求
+    };
+
+    LatencyHistogram();
+    ~LatencyHistogram();
+
+public :
+    // 添加一次耗时
+    void add( int64_t usecs );
+    // 合并
+    void merge( const LatencyHistogram & h );
+
+    // 总次数
+    uint64_t count() const { return m_Count; }
+    // 桶
+    uint64_t bucket( uint32_t i ) const { return m_Buckets[i]; }
+    static uint64_t bound( uint32_t i ) { return 1ULL << i; }
+
+    // 百分位, 返回所在桶的上界(微秒)
+    uint64_t percentile( double p ) const;
+
+private :
+    uint64_t        m_Count;
+    uint64_t        m_Buckets[ eMaxBuckets ];
+};
+
+//
+// 速率统计
+// 每隔eInterval毫秒计算一次区间内的平均速率
+//
+class RateCounter
+{
+public :
+    enum
+    {
+        eInterval       = 1000,     // 统计区间(毫秒)
+    };
+
+    RateCounter();
+    ~RateCounter();
+
+public :
+    // 添加n个单位
+    void add( uint64_t n, int64_t now );
+
+    // 总数
+    uint64_t total() const { return m_Total; }
+    // 每秒的速率, 超过一个区间没有添加时返回之后的平均速率
+    uint64_t rate( int64_t now ) const;
+
+private :
+    uint64_t        m_Total;
+    uint64_t        m_Base;         // 区间开始时的总数
+    int64_t         m_Start;        // 区间开始的时间
+    uint64_t        m_Rate;         // 上一个区间的速率
+};
+
 class ServerStatus
 {
 public :
@@ -31,11 +97,33 @@ public :
     // 添加getops
     void addGetOps() { ++m_GetOps; }
     uint64_t getGetOps() const { return m_GetOps; }
+    // 查询命中和未命中的次数
+    void addGetHits() { ++m_GetHits; }
+    uint64_t getGetHits() const { return m_GetHits; }
+    void addGetMisses() { ++m_GetMisses; }
+    uint64_t getGetMisses() const { return m_GetMisses; }
 
     // 添加getops
     void addSetOps() { ++m_SetOps; }
     uint64_t getSetOps() const { return m_SetOps; }
 
+    // 请求的延时
+    void addLatency( int64_t usecs ) { m_Latency.add( usecs ); }
+    const LatencyHistogram & getLatency() const { return m_Latency; }
+
+    // fsync的次数和耗时
+    void addSync( int64_t usecs ) { m_SyncLatency.add( usecs ); m_SyncUsecs += usecs; }
+    const LatencyHistogram & getSyncLatency() const { return m_SyncLatency; }
+    uint64_t getSyncUsecs() const { return m_SyncUsecs; }
+
+    // 备机的数据过旧, 拒绝的读请求次数
+    void addStaleReads() { ++m_StaleReads; }
+    uint64_t getStaleReads() const { return m_StaleReads; }
+
+    // 半同步等待备机确认超时的次数
+    void addAckTimeouts() { ++m_AckTimeouts; }
+    uint64_t getAckTimeouts() const { return m_AckTimeouts; }
+
     // 获取当前时间
     time_t getNowTime() { return m_NowTime; }
 
@@ -46,9 +134,16 @@ public :
 private :
     time_t          m_StartTime;
     uint64_t        m_GetOps;
+    uint64_t        m_GetHits;
+    uint64_t        m_GetMisses;
     uint64_t        m_SetOps;
     time_t          m_NowTime;
     struct rusage   m_CpuUsage;
+    LatencyHistogram m_Latency;
+    uint64_t        m_SyncUsecs;
+    LatencyHistogram m_SyncLatency;
+    uint64_t        m_AckTimeouts;
+    uint64_t        m_StaleReads;
 };
 
 }
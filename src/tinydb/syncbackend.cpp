@@ -3,13 +3,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "utils/utility.h"
+#include "utils/streambuf.h"
+#include "utils/timeutils.h"
 
 #include "base.h"
 
 #include "message/protocol.h"
+#include "config.h"
 #include "dataserver.h"
 #include "masterservice.h"
 #include "iterator.h"
@@ -21,128 +28,402 @@ namespace tinydb
 {
 
 BackendSync::BackendSync()
-    : m_ThreadQuit( false )
-{}
+    : m_ThreadQuit( false ),
+      m_SlaveCount( 0 ),
+      m_SemiSyncSlaves( 0 ),
+      m_AckedSeq( 0ULL ),
+      m_HeartbeatInterval( 0 ),
+      m_HeartbeatTimestamp( 0LL ),
+      m_NextWorker( 0 ),
+      m_Sequence( 0 )
+{
+    pthread_cond_init( &m_ScheduleCond, NULL );
+    pthread_mutex_init( &m_ScheduleLock, NULL );
+
+    m_SemiSyncSlaves = CDatadConfig::getInstance().getReplicationConfig()->semisyncslaves;
+    m_HeartbeatInterval = CDatadConfig::getInstance().getReplicationConfig()->heartbeatmilliseconds;
+}
 
 BackendSync::~BackendSync()
 {
 	m_ThreadQuit = true;
 
-    // 等待线程关闭
-    int count = 0;
-	int maxcount = 100;
-	while( count++ < maxcount )
+    // 停止调度线程
+    this->notify();
+    for ( size_t i = 0; i < m_Threads.size(); ++i )
     {
-		// there is something wrong that sleep makes other threads
-		// unable to acquire the mutex
-		{
-            Lock lock( &m_WorkerMutex );
-            if( m_Workers.empty() )
-            {
-                break;
-			}
-		}
+        pthread_join( m_Threads[i], NULL );
+    }
+    m_Threads.clear();
 
-		usleep(50 * 1000);
-	}
+    for ( size_t i = 0; i < m_Frames.size(); ++i )
+    {
+        delete m_Frames[i].second;
+    }
+    m_Frames.clear();
 
-	if( count >= maxcount )
+    // 应用退出, 停止所有备机的同步
+    std::map<uint64_t, Client *>::iterator it;
+    for ( it = m_Clients.begin(); it != m_Clients.end(); ++it )
     {
-		LOG_INFO( "Backend worker not exit expectedly.\n" );
-	}
+        LOG_INFO( "Sync Client quit(sid=%llu, application quit).\n ", it->first );
+        delete it->second;
+    }
+    m_Clients.clear();
+    m_Workers.clear();
 
+	pthread_cond_destroy( &m_ScheduleCond );
+	pthread_mutex_destroy( &m_ScheduleLock );
 
 	LOG_DEBUG( "BackendSync finalized.\n" );
 }
 
-void BackendSync::process( uint64_t sid, uint64_t lastseq, const std::string & lastkey )
+bool BackendSync::start()
+{
+    uint32_t nthreads = CDatadConfig::getInstance().getReplicationConfig()->syncthreads;
+    if ( nthreads == 0 )
+    {
+        nthreads = 1;
+    }
+
+    for ( uint32_t i = 0; i < nthreads; ++i )
+    {
+        struct run_arg * arg = new run_arg();
+        arg->index = i;
+        arg->backend = this;
+
+        pthread_t tid;
+        int err = pthread_create( &tid, NULL, &BackendSync::sync_backend, arg );
+        if ( err != 0 )
+        {
+            LOG_ERROR( "BackendSync::start can't create thread: %s.\n", strerror(err) );
+            delete arg;
+            return false;
+        }
+
+        m_Threads.push_back( tid );
+    }
+
+    return true;
+}
+
+void BackendSync::process( uint64_t sid, uint64_t lastseq, const std::string & lastkey,
+        const std::vector<std::string> & bounds, const std::vector<std::string> & lastkeys )
 {
 	LOG_INFO( "BackendSync::process accept sync client(sid : %llu).\n", sid );
 
-	struct run_arg *arg = new run_arg();
-	arg->sid = sid;
-    arg->lastseq = lastseq;
-    arg->lastkey = lastkey;
-    arg->backend = this;
+    const BinlogQueue *logs = CDataServer::getInstance().getBinlogQueue();
 
-	pthread_t tid;
-	int err = pthread_create( &tid, NULL, &BackendSync::sync_backend, arg );
-	if(err != 0)
+    Client * client = new Client( this, sid, lastseq, lastkey );
+    client->bounds = bounds;
+    client->lastkeys = lastkeys;
+    if ( logs->getFile() != NULL )
     {
-		LOG_ERROR( " BackendSync::process can't create thread: %s.\n", strerror(err) );
-	    // TODO:关闭链接
-        return;
+        client->reader = new BinlogFile::Reader( logs->getFile() );
     }
 
-    Lock lock( &m_WorkerMutex );
-    m_Workers.insert( std::make_pair( sid, 0 ) );
+    {
+        Lock lock( &m_WorkerMutex );
+
+        if ( m_Clients.find( sid ) != m_Clients.end() )
+        {
+            LOG_ERROR( "BackendSync::process sync client(sid : %llu) already exists.\n", sid );
+            delete client;
+            return;
+        }
+
+        // 由调度线程初始化, 划分区间比较耗时
+        client->worker = m_NextWorker++ % m_Threads.size();
+        SlaveStatus status;
+        status.status = Client::INIT;
+        status.lastseq = lastseq;
+        status.lastacktime = utils::TimeUtils::now();
+        m_Workers[ sid ] = status;
+        m_SlaveCount = m_Workers.size();
+        m_Clients.insert( std::make_pair( sid, client ) );
+    }
+
+    this->notify();
+}
+
+void BackendSync::notify()
+{
+    pthread_mutex_lock( &m_ScheduleLock );
+    ++m_Sequence;
+    pthread_cond_broadcast( &m_ScheduleCond );
+    pthread_mutex_unlock( &m_ScheduleLock );
 }
 
 void BackendSync::shutdown( uint64_t sid )
 {
     Lock lock( &m_WorkerMutex );
     m_Workers.erase( sid );
+    m_SlaveCount = m_Workers.size();
 }
 
 void BackendSync::getSlaveSids( std::vector<uint64_t> & sids )
 {
     Lock lock( &m_WorkerMutex );
-    std::map<uint64_t, uint8_t>::iterator it;
+    SlaveStatusMap::iterator it;
     for ( it = m_Workers.begin(); it != m_Workers.end(); ++it )
     {
-        if ( it->second == eSlaveState_Sync )
+        if ( it->second.state == eSlaveState_Sync )
         {
             sids.push_back( it->first );
         }
     }
 }
 
-void BackendSync::send( uint64_t sid, const Binlog & log )
+void BackendSync::ack( uint64_t sid, uint64_t seq, uint64_t bytes )
 {
-    bool rc = false;
-    std::string val;
+    bool advanced = false;
+    bool released = false;
 
-    switch( log.cmd() )
     {
-		case BinlogCommand::SET:
+        Lock lock( &m_WorkerMutex );
+        SlaveStatusMap::iterator it = m_Workers.find( sid );
+        if ( it == m_Workers.end() )
+        {
+            return;
+        }
+
+        it->second.lastacktime = utils::TimeUtils::now();
+        if ( bytes > it->second.ackbytes )
+        {
+            it->second.ackbytes = bytes;
+            released = true;
+        }
+        if ( seq <= it->second.ackseq )
+        {
+            seq = 0;
+        }
+        else
+        {
+            it->second.ackseq = seq;
+        }
+
+        // 复制完成的备机才有完整的数据
+        if ( seq != 0
+                && m_SemiSyncSlaves > 0 && it->second.status == Client::SYNC )
+        {
+            std::vector<uint64_t> seqs;
+            for ( it = m_Workers.begin(); it != m_Workers.end(); ++it )
             {
-                rc = CDataServer::getInstance().getStorageEngine()->get( log.key().ToString(), val );
-                if( !rc)
+                if ( it->second.status == Client::SYNC )
                 {
-                    LOG_ERROR( "BackendSync::send get key=%s error.\n", log.key().ToString().c_str() );
-                }
-                else
-                {
-                    this->send( sid, BinlogType::SYNC, log.repr(), val );
+                    seqs.push_back( it->second.ackseq );
                 }
             }
-			break;
 
-        case BinlogCommand::DEL:
+            // 第K大的seq
+            if ( seqs.size() >= m_SemiSyncSlaves )
             {
-                this->send( sid, BinlogType::SYNC, log.repr() );
+                std::nth_element( seqs.begin(),
+                        seqs.begin() + m_SemiSyncSlaves - 1, seqs.end(), std::greater<uint64_t>() );
+                uint64_t ackedseq = seqs[ m_SemiSyncSlaves - 1 ];
+                if ( ackedseq > m_AckedSeq )
+                {
+                    m_AckedSeq = ackedseq;
+                    advanced = true;
+                }
             }
-			break;
+        }
+    }
+
+    // 唤醒等待确认的工作线程
+    if ( advanced )
+    {
+        uint8_t nworkers = CDataServer::getInstance().getClientProxyCount();
+        for ( uint8_t i = 0; i < nworkers; ++i )
+        {
+            CDataServer::getInstance().getClientProxy( i )->post( eTaskType_SyncAck, NULL );
+        }
+    }
+
+    // 发送窗口有空间, 唤醒调度线程
+    if ( released )
+    {
+        this->notify();
     }
 }
 
-void BackendSync::send( uint64_t sid, const char method, const std::string & log, const std::string & value )
+bool BackendSync::congested( uint64_t sid )
 {
-    SyncResponse response;
-    response.method = method;
-    response.binlog = log;
-    response.value = value;
-    g_MasterService->send( sid, &response );
+    Lock lock( &m_WorkerMutex );
+    SlaveStatusMap::iterator it = m_Workers.find( sid );
+    if ( it == m_Workers.end() )
+    {
+        return false;
+    }
+
+    return it->second.bytes.total() - it->second.ackbytes >= eSchedule_AckWindow;
+}
+
+void BackendSync::getSlaveStatus( SlaveStatusMap & status )
+{
+    Lock lock( &m_WorkerMutex );
+    status = m_Workers;
+}
+
+const char * BackendSync::getStatusName( int32_t status )
+{
+    switch ( status )
+    {
+        case Client::OUT_OF_SYNC :
+            return "out_of_sync";
+        case Client::COPY :
+            return "copy";
+        case Client::SYNC :
+            return "sync";
+        default :
+            break;
+    }
+
+    return "init";
+}
+
+void BackendSync::account( uint64_t sid, uint64_t lastseq, uint32_t entries, size_t bytes )
+{
+    int64_t now = utils::TimeUtils::now();
+
+    Lock lock( &m_WorkerMutex );
+    SlaveStatusMap::iterator it = m_Workers.find( sid );
+    if ( it != m_Workers.end() )
+    {
+        if ( lastseq > it->second.lastseq )
+        {
+            it->second.lastseq = lastseq;
+        }
+        it->second.entries.add( entries, now );
+        it->second.bytes.add( bytes, now );
+    }
+}
+
+void BackendSync::report( Client * client )
+{
+    uint64_t copykeys = 0;
+    uint32_t copied = 0;
+    std::string copykey;
+
+    // 复制线程只会修改区间的状态, 不会增减区间, 读取状态时需要加锁
+    for ( size_t i = 0; i < client->partitions.size(); ++i )
+    {
+        Client::Partition * p = client->partitions[i];
+
+        Lock lock( &p->lock );
+        copykeys += p->count;
+        if ( p->done )
+        {
+            ++copied;
+        }
+        if ( client->partitions.size() == 1 )
+        {
+            copykey = p->lastkey;
+        }
+    }
+
+    Lock lock( &m_WorkerMutex );
+    SlaveStatusMap::iterator it = m_Workers.find( client->sid );
+    if ( it != m_Workers.end() )
+    {
+        SlaveStatus & s = it->second;
+        s.status = client->status;
+        s.lastseq = client->lastseq;
+        if ( !client->partitions.empty() )
+        {
+            s.copykeys = copykeys;
+            s.partitions = client->partitions.size();
+            s.copied = copied;
+            s.copykey = copykey;
+        }
+    }
+}
+
+void BackendSync::publish( uint64_t lastseq, SyncBatchResponse * frame )
+{
+    pthread_mutex_lock( &m_ScheduleLock );
+    m_Frames.push_back( std::make_pair( lastseq, frame ) );
+    ++m_Sequence;
+    pthread_cond_broadcast( &m_ScheduleCond );
+    pthread_mutex_unlock( &m_ScheduleLock );
+}
+
+void BackendSync::fanout()
+{
+    std::deque< std::pair<uint64_t, SyncBatchResponse *> > frames;
+
+    pthread_mutex_lock( &m_ScheduleLock );
+    std::swap( frames, m_Frames );
+    pthread_mutex_unlock( &m_ScheduleLock );
+
+    if ( frames.empty() )
+    {
+        return;
+    }
+
+    // 按照提交的顺序发送给当前实时同步的备机
+    std::vector<uint64_t> sids;
+    this->getSlaveSids( sids );
+
+    for ( size_t i = 0; i < frames.size(); ++i )
+    {
+        SyncBatchResponse * frame = frames[i].second;
+
+        // 实时同步的数据也需要备机确认, 发送之前记录, 确认不会超过发送的字节数
+        for ( size_t j = 0; j < sids.size(); ++j )
+        {
+            this->account( sids[j], frames[i].first, frame->count, frame->entries.size() );
+        }
+
+        g_MasterService->broadcast( sids, frame );
+        delete frame;
+    }
 }
 
-Iterator* BackendSync::iterator( const std::string & start, const std::string & end, uint64_t limit ) const
+void BackendSync::heartbeat()
+{
+    int64_t now = utils::TimeUtils::now();
+    if ( m_HeartbeatInterval <= 0
+            || now - m_HeartbeatTimestamp < m_HeartbeatInterval )
+    {
+        return;
+    }
+    m_HeartbeatTimestamp = now;
+
+    std::vector<uint64_t> sids;
+    {
+        Lock lock( &m_WorkerMutex );
+        SlaveStatusMap::iterator it;
+        for ( it = m_Workers.begin(); it != m_Workers.end(); ++it )
+        {
+            sids.push_back( it->first );
+        }
+    }
+
+    if ( sids.empty() )
+    {
+        return;
+    }
+
+    // 备机写入到这个位置之后, 数据至少和现在一样新
+    SyncStatusCommand cmd;
+    BinlogQueue * binlogs = CDataServer::getInstance().getBinlogQueue();
+    binlogs->lock();
+    cmd.lastseq = binlogs->getLastSeq();
+    binlogs->unlock();
+    cmd.timestamp = now;
+    g_MasterService->broadcast( sids, &cmd );
+}
+
+Iterator* BackendSync::iterator( const std::string & start, const std::string & end,
+        uint64_t limit, bool skipstart ) const
 {
     leveldb::Iterator *it;
     leveldb::ReadOptions iterate_options;
     iterate_options.fill_cache = false;
     it = CDataServer::getInstance().getStorageEngine()->getDatabase()->NewIterator(iterate_options);
     it->Seek(start);
-    if( it->Valid() && it->key() == start )
+    if( skipstart && it->Valid() && it->key() == start )
     {
         it->Next();
     }
@@ -150,104 +431,192 @@ Iterator* BackendSync::iterator( const std::string & start, const std::string &
     return new Iterator( it, end, limit );
 }
 
-void* BackendSync::sync_backend( void *arg )
+int BackendSync::step( Client * client )
 {
-    struct run_arg *p = (struct run_arg*)arg;
-    BackendSync *backend = (BackendSync *)p->backend;
-    int64_t sid = p->sid;
-    uint64_t lastseq = p->lastseq;
-    std::string lastkey = p->lastkey;
-    delete p;
+    const BinlogQueue *logs = CDataServer::getInstance().getBinlogQueue();
+
+    // 备机断开连接时
+    {
+        Lock lock( &m_WorkerMutex );
+        if ( m_Workers.end() == m_Workers.find( client->sid ) )
+        {
+            LOG_INFO( "Sync Client Quit(sid=%llu).\n ", client->sid );
+            return -1;
+        }
+    }
 
-    const BinlogQueue *logs = g_ClientProxy->getBinlog();
+    if ( client->status == Client::INIT )
+    {
+        client->init();
+    }
+    if( client->status == Client::OUT_OF_SYNC )
+    {
+        client->reset();
+    }
+
+    // 备机还没有确认的数据过多时不再发送, 收到确认后唤醒
+    if ( this->congested( client->sid ) )
+    {
+        return 0;
+    }
 
-    Client client( backend, sid, lastseq, lastkey );
-    client.init();
+    bool isempty = true;
+    client->sentbytes = 0;
+    // WARN: MUST do first sync() before first copy(), because
+    // sync() will refresh last_seq, and copy() will not
+    if( client->sync(logs) )
+    {
+        isempty = false;
+    }
+    if( client->status == Client::COPY )
+    {
+        if( client->copy() )
+        {
+            isempty = false;
+        }
+    }
+    // 每一轮结束时发送, 记录最多等待一轮
+    client->flush();
+    this->report( client );
 
-    // sleep longer to reduce logs.find
-#define TICK_INTERVAL_MS	300
-#define NOOP_IDLES			(3000/TICK_INTERVAL_MS)
+    int64_t now = utils::TimeUtils::now();
+    if ( !isempty )
+    {
+        client->lastactive = now;
+        return 1;
+    }
 
-    int32_t idle = 0;
-    while( !backend->m_ThreadQuit )
+    if ( client->status == Client::SYNC )
     {
-        if( client.status == Client::OUT_OF_SYNC )
+        // 进入实时同步状态
+        // 持有锁再检查一次, 之后提交的binlog都由广播发送
+        Lock lock( &m_WorkerMutex );
+        if ( client->sync(logs) )
         {
-            client.reset();
-            continue;
+            client->flush();
+            return 1;
         }
 
-        bool isempty = true;
-        // WARN: MUST do first sync() before first copy(), because
-        // sync() will refresh last_seq, and copy() will not
-        if( client.sync(logs) )
+        SlaveStatusMap::iterator it = m_Workers.find( client->sid );
+        if ( it != m_Workers.end() )
         {
-            isempty = false;
+            it->second.state = eSlaveState_Sync;
+            it->second.status = Client::SYNC;
+            it->second.lastseq = client->lastseq;
         }
-        if( client.status == Client::COPY )
+
+        LOG_INFO( "Sync Client Quit( sid=%llu, lastseq=%llu ).\n ", client->sid, client->lastseq );
+        return -1;
+    }
+
+    // 空闲时定期发送NOOP
+    if ( now - client->lastactive >= eSchedule_NoopInterval )
+    {
+        client->lastactive = now;
+        client->noop();
+        client->flush();
+    }
+
+    return 0;
+}
+
+void* BackendSync::sync_backend( void *arg )
+{
+    struct run_arg *p = (struct run_arg*)arg;
+    BackendSync *backend = p->backend;
+    uint32_t index = p->index;
+    delete p;
+
+    uint64_t sequence = 0;
+    while( !backend->m_ThreadQuit )
+    {
+        sequence = backend->sequence();
+
+        // 第一个线程负责实时同步的广播和同步位置
+        if ( index == 0 )
         {
-            if( client.copy() )
-            {
-                isempty = false;
-            }
+            backend->fanout();
+            backend->heartbeat();
         }
-        if( isempty )
+
+        // 本线程负责的备机
+        std::vector<Client *> clients;
         {
-            if ( client.status == Client::SYNC )
+            Lock lock( &backend->m_WorkerMutex );
+            std::map<uint64_t, Client *>::iterator it;
+            for ( it = backend->m_Clients.begin(); it != backend->m_Clients.end(); ++it )
             {
-                // 进入实时同步状态
-                Lock lock( &backend->m_WorkerMutex );
-                std::map<uint64_t, uint8_t>::iterator it;
-                for ( it = backend->m_Workers.begin(); it != backend->m_Workers.end(); ++it )
+                if ( it->second->worker == index )
                 {
-                    if ( it->first == client.sid )
-                    {
-                        it->second = eSlaveState_Sync;
-                    }
+                    clients.push_back( it->second );
                 }
-
-                // 退出本线程,进入同步实时状态
-                LOG_INFO( "Sync Client Quit( sid=%llu, lastseq=%llu ).\n ", client.sid, client.lastseq );
-                break;
             }
+        }
 
-            if( idle >= NOOP_IDLES )
+        bool busy = false;
+        for ( size_t i = 0; i < clients.size() && !backend->m_ThreadQuit; ++i )
+        {
+            int rc = backend->step( clients[i] );
+            if ( rc > 0 )
             {
-                idle = 0;
-                client.noop();
+                busy = true;
             }
-            else
+            else if ( rc < 0 )
+            {
+                {
+                    Lock lock( &backend->m_WorkerMutex );
+                    backend->m_Clients.erase( clients[i]->sid );
+                }
+                delete clients[i];
+            }
+
+            if ( index == 0 )
             {
-                idle ++;
-                usleep( TICK_INTERVAL_MS * 1000 );
+                backend->fanout();
             }
         }
-        else
+
+        if ( busy )
         {
-            idle = 0;
+            continue;
         }
 
-        // TODO : 同步速度
-        // 备机断开连接时
-        Lock lock( &backend->m_WorkerMutex );
-        if ( backend->m_Workers.end() ==
-                backend->m_Workers.find( client.sid ) )
+        // 等待新的binlog, 新的备机, 备机的确认, 或者复制线程完成区间
+        int64_t msecs = eSchedule_IdleMilliseconds;
+        if ( index == 0 && backend->m_HeartbeatInterval > 0
+                && backend->m_HeartbeatInterval < msecs )
         {
-            LOG_INFO( "Sync Client Quit(sid=%llu).\n ", client.sid );
-            break;
+            msecs = backend->m_HeartbeatInterval;
         }
+        backend->wait( sequence, msecs );
     }
 
-    if ( backend->m_ThreadQuit )
-    {
-        LOG_INFO( "Sync Client quit(application quit).\n " );
+    return (void *)NULL;
+}
 
-        // 应用退出
-        Lock lock( &backend->m_WorkerMutex );
-        backend->m_Workers.erase( client.sid );
-    }
+uint64_t BackendSync::sequence()
+{
+    pthread_mutex_lock( &m_ScheduleLock );
+    uint64_t sequence = m_Sequence;
+    pthread_mutex_unlock( &m_ScheduleLock );
 
-    return (void *)NULL;
+    return sequence;
+}
+
+void BackendSync::wait( uint64_t sequence, int64_t msecs )
+{
+    pthread_mutex_lock( &m_ScheduleLock );
+    if ( sequence == m_Sequence && !m_ThreadQuit )
+    {
+        struct timeval now;
+        struct timespec outtime;
+        gettimeofday( &now, NULL );
+        int64_t usecs = now.tv_usec + msecs * 1000;
+        outtime.tv_sec = now.tv_sec + usecs / 1000000;
+        outtime.tv_nsec = ( usecs % 1000000 ) * 1000;
+        pthread_cond_timedwait( &m_ScheduleCond, &m_ScheduleLock, &outtime );
+    }
+    pthread_mutex_unlock( &m_ScheduleLock );
 }
 
 
@@ -261,21 +630,32 @@ BackendSync::Client::Client( BackendSync *backend, int64_t sid, uint64_t lastseq
 	this->lastseq = lastseq;
     this->lastnoopseq = 0ULL;
 	this->lastkey = lastkey;
-    iter = NULL;
+    reader = NULL;
+    worker = 0;
+    lastactive = utils::TimeUtils::now();
+    sentbytes = 0;
+    nextpartition = 0;
+    copyquit = false;
+    copyseq = 0ULL;
+    copylimit = 0ULL;
+    copytimeslice = 0LL;
+    copybytes = 0ULL;
 }
 
 BackendSync::Client::~Client()
 {
-	if( iter )
+    this->stopCopy();
+
+	if( reader )
     {
-		delete iter;
-		iter = NULL;
-	}
+        delete reader;
+        reader = NULL;
+    }
 }
 
 void BackendSync::Client::init()
 {
-	if( lastkey == "" && lastseq != 0 )
+	if( lastkey == "" && lastseq != 0 && bounds.empty() )
     {
 		this->status = Client::SYNC;
 	}
@@ -283,25 +663,33 @@ void BackendSync::Client::init()
     {
 		// a slave must reset its last_key when receiving 'copy_end' command
 		this->status = Client::COPY;
+
+		// 继续中断的复制, 在第一次sync()之前恢复区间,
+		// 已经复制过的KEY需要同步binlog
+		if ( lastkey != "" || !bounds.empty() )
+        {
+            this->plan();
+        }
 	}
 
     Lock lock( &backend->m_WorkerMutex );
-    std::map<uint64_t, uint8_t>::iterator it;
-    for ( it = backend->m_Workers.begin(); it != backend->m_Workers.end(); ++it )
+    SlaveStatusMap::iterator it = backend->m_Workers.find( sid );
+    if ( it != backend->m_Workers.end() )
     {
-        if ( it->first == sid )
-        {
-            it->second = eSlaveState_Copy;
-        }
+        it->second.state = eSlaveState_Copy;
+        it->second.status = this->status;
     }
 }
 
 void BackendSync::Client::reset()
 {
 	LOG_INFO( " BackendSync::Client::reset copy begin.\n" );
+	this->stopCopy();
 	this->status = Client::COPY;
 	this->lastseq = 0;
 	this->lastkey = "";
+	this->bounds.clear();
+	this->lastkeys.clear();
 
 	Binlog log( this->lastseq, BinlogCommand::BEGIN, "" );
     this->send( BinlogType::COPY, log.repr() );
@@ -310,7 +698,7 @@ void BackendSync::Client::reset()
 void BackendSync::Client::noop()
 {
 	uint64_t seq;
-	if( this->status == Client::COPY && this->lastkey.empty() )
+	if( this->status == Client::COPY && this->lastkey.empty() && this->partitions.empty() )
     {
 		seq = 0;
 	}
@@ -326,92 +714,356 @@ void BackendSync::Client::noop()
 
 int BackendSync::Client::copy()
 {
-    if( this->iter == NULL )
+    if ( this->partitions.empty() )
     {
-        LOG_INFO( "new iterator, lastkey: '%s'.\n", utils::Utility::hexmem(lastkey.data(), lastkey.size()).c_str() );
-        std::string key = this->lastkey;
-        if( this->lastkey.empty() )
+        this->plan();
+        this->startCopy();
+        return 1;
+    }
+
+    if ( this->copythreads.empty() )
+    {
+        // 没有复制线程, 在同步线程中逐个区间复制
+        for ( size_t i = 0; i < this->partitions.size(); ++i )
+        {
+            if ( !this->partitions[i]->done )
+            {
+                this->copyPartition( this->partitions[i] );
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        for ( size_t i = 0; i < this->partitions.size(); ++i )
+        {
+            Lock lock( &this->partitions[i]->lock );
+            if ( !this->partitions[i]->done )
+            {
+                return 0;
+            }
+        }
+    }
+
+    // 所有区间复制完成
+    this->stopCopy();
+    this->status = Client::SYNC;
+    this->lastkey = "";
+
+    Binlog log( this->lastseq, BinlogCommand::END, "" );
+    this->send( BinlogType::COPY, log.repr() );
+
+    return 1;
+}
+
+void BackendSync::Client::plan()
+{
+    std::string start( 1, DataType::KV );
+    std::string end( 1, DataType::KV + 1 );
+    uint32_t nthreads = CDatadConfig::getInstance().getReplicationConfig()->copythreads;
+
+    if ( this->bounds.empty() )
+    {
+        if ( this->lastkey.empty() )
+        {
+            // 新的复制, 按照数据大小划分区间, 并且通知备机
+            CDataServer::getInstance().getStorageEngine()->split( start, end,
+                    ( nthreads > 0 ? nthreads : 1 ) * PARTITIONS_PER_THREAD, this->bounds );
+
+            StreamBuf pack;
+            pack.encode( this->bounds );
+
+            Binlog log( this->lastseq, BinlogCommand::BEGIN, "" );
+            this->send( BinlogType::COPY, log.repr(), pack.string() );
+            this->flush();
+        }
+        else
         {
-            key.push_back( DataType::KV );
+            // 兼容只记录了lastkey的备机
+            this->bounds.push_back( start );
+            this->lastkeys.push_back( this->lastkey );
         }
+    }
 
-        this->iter = backend->iterator( key, "", -1 );
-        LOG_INFO( "iterator created, lastkey: '%s'.\n", utils::Utility::hexmem(lastkey.data(), lastkey.size()).c_str());
+    this->lastkeys.resize( this->bounds.size() );
+    for ( size_t i = 0; i < this->bounds.size(); ++i )
+    {
+        Partition * p = new Partition();
+        p->start = this->bounds[i];
+        p->end = i + 1 < this->bounds.size() ? this->bounds[i+1] : "";
+        p->lastkey = this->lastkeys[i];
+        this->partitions.push_back( p );
     }
 
-    int ret = 0;
-    int count = 0;
-    while( true )
+    LOG_INFO( "BackendSync::Client::plan(sid:%llu) copy %lu partitions from seq %llu.\n",
+            this->sid, this->partitions.size(), this->lastseq );
+
+    this->copyseq = this->lastseq;
+    this->nextpartition = 0;
+    this->bounds.clear();
+    this->lastkeys.clear();
+}
+
+void BackendSync::Client::startCopy()
+{
+    uint32_t nthreads = CDatadConfig::getInstance().getReplicationConfig()->copythreads;
+
+    this->copyquit = false;
+    this->copylimit = CDatadConfig::getInstance().getReplicationConfig()->copyratelimit;
+    this->copytimeslice = utils::TimeUtils::now();
+    this->copybytes = 0;
+
+    for ( uint32_t i = 0; i < nthreads && i < this->partitions.size(); ++i )
     {
-        // Prevent copy() from blocking too long
-        if( ++count > 1000 )
+        pthread_t tid;
+        int err = pthread_create( &tid, NULL, &BackendSync::Client::copy_thread, this );
+        if ( err != 0 )
         {
+            LOG_ERROR( "BackendSync::Client::startCopy can't create thread: %s.\n", strerror(err) );
             break;
         }
 
-        if( !iter->next() )
+        this->copythreads.push_back( tid );
+    }
+}
+
+void BackendSync::Client::stopCopy()
+{
+    this->copyquit = true;
+    for ( size_t i = 0; i < this->copythreads.size(); ++i )
+    {
+        pthread_join( this->copythreads[i], NULL );
+    }
+    this->copythreads.clear();
+
+    for ( size_t i = 0; i < this->partitions.size(); ++i )
+    {
+        delete this->partitions[i]->iter;
+        delete this->partitions[i];
+    }
+    this->partitions.clear();
+    this->nextpartition = 0;
+    this->copyquit = false;
+}
+
+BackendSync::Client::Partition * BackendSync::Client::locate( const std::string & key ) const
+{
+    Partition * p = NULL;
+
+    // 区间按照起始KEY排序
+    for ( size_t i = 0; i < this->partitions.size(); ++i )
+    {
+        if ( key < this->partitions[i]->start )
         {
-            goto copy_end;
+            break;
         }
 
-        leveldb::Slice key = iter->key();
-        if( key.size() == 0 )
+        p = this->partitions[i];
+    }
+
+    return p;
+}
+
+bool BackendSync::Client::copyPartition( Partition * p )
+{
+    bool done = false;
+    size_t bytes = 0;
+
+    p->lock.lock();
+
+    // WARN: iterator只能看到创建之前的写入,
+    // 还没有复制到的KEY有新的写入时, 需要重新创建
+    if ( p->reset && p->iter != NULL )
+    {
+        delete p->iter;
+        p->iter = NULL;
+    }
+    p->reset = false;
+
+    if ( p->iter == NULL )
+    {
+        if ( p->lastkey.empty() )
         {
-            continue;
+            p->iter = backend->iterator( p->start, "", -1, false );
         }
-        // finish copying all valid data types
-        if( key.data()[0] > DataType::KV )
+        else
         {
-            goto copy_end;
+            p->iter = backend->iterator( p->lastkey, "", -1 );
         }
+    }
 
-        leveldb::Slice val = iter->val();
+    for ( int count = 0; count < SYNC_BATCH; ++count )
+    {
+        if ( !p->iter->next() )
+        {
+            done = true;
+            break;
+        }
 
-        char cmd = 0;
-        char data_type = key.data()[0];
-        if( data_type == DataType::KV )
+        leveldb::Slice key = p->iter->key();
+        if ( key.size() == 0 )
         {
-            cmd = BinlogCommand::SET;
+            continue;
         }
-        else
+        // 超出区间, 或者复制完所有的数据
+        if ( key.data()[0] > DataType::KV
+                || ( !p->end.empty() && key.compare( p->end ) >= 0 ) )
+        {
+            done = true;
+            break;
+        }
+        if ( key.data()[0] != DataType::KV )
         {
             continue;
         }
 
-        ret = 1;
+        leveldb::Slice val = p->iter->val();
+        p->lastkey = key.ToString();
+        ++p->count;
+        bytes += key.size() + val.size();
+
+        Binlog log( this->copyseq, BinlogCommand::SET, p->lastkey );
+        p->batch.append( BinlogType::COPY, log.repr(), val.ToString() );
+        if ( p->batch.size() >= BATCH_BYTES )
+        {
+            this->flush( p->batch );
+        }
+    }
 
-        // 重置lastkey
-        this->lastkey = key.ToString();
+    // 区间完成之前发送所有的复制记录
+    this->flush( p->batch );
+    if ( done )
+    {
+        delete p->iter;
+        p->iter = NULL;
+        p->done = true;
+    }
+
+    p->lock.unlock();
+
+    this->throttle( bytes );
+    return done;
+}
 
-        Binlog log( this->lastseq, cmd, key.ToString() );
-        this->send( BinlogType::COPY, log.repr(), val.ToString() );
+void BackendSync::Client::throttle( size_t bytes )
+{
+    int32_t sleep_msecs = 0;
+
+    if ( this->copylimit == 0 )
+    {
+        return;
     }
 
-    return ret;
+    // 所有复制线程共享每秒的流量
+    this->copylock.lock();
+    int64_t now = utils::TimeUtils::now();
+    if ( now - this->copytimeslice >= 1000 )
+    {
+        this->copytimeslice = now;
+        this->copybytes = 0;
+    }
+    this->copybytes += bytes;
+    if ( this->copybytes >= this->copylimit )
+    {
+        sleep_msecs = this->copytimeslice + 1000 - now;
+    }
+    this->copylock.unlock();
 
-copy_end:
-    this->status = Client::SYNC;
-    delete this->iter;
-    this->iter = NULL;
+    if ( sleep_msecs > 0 )
+    {
+        utils::TimeUtils::sleep( sleep_msecs );
+    }
+}
 
-    Binlog log( this->lastseq, BinlogCommand::END, "" );
-    this->send( BinlogType::COPY, log.repr() );
+void * BackendSync::Client::copy_thread( void * arg )
+{
+    Client * client = (Client *)arg;
 
-    return 1;
+    while ( !client->copyquit )
+    {
+        Partition * p = NULL;
+
+        client->copylock.lock();
+        if ( client->nextpartition < client->partitions.size() )
+        {
+            p = client->partitions[ client->nextpartition++ ];
+        }
+        client->copylock.unlock();
+
+        if ( p == NULL )
+        {
+            break;
+        }
+
+        while ( !client->copyquit )
+        {
+            // 备机还没有确认的数据过多时等待, 避免发送队列无限增长
+            uint64_t sequence = client->backend->sequence();
+            if ( client->backend->congested( client->sid ) )
+            {
+                client->backend->wait( sequence, eSchedule_IdleMilliseconds );
+                continue;
+            }
+
+            if ( client->copyPartition( p ) )
+            {
+                break;
+            }
+        }
+
+        // 区间完成, 唤醒调度线程检查是否全部完成
+        client->backend->notify();
+    }
+
+    return (void *)NULL;
 }
 
 int BackendSync::Client::sync( const BinlogQueue *logs )
+{
+    int ret = 0;
+
+    // 连续的binlog一次同步一批, 超出发送窗口时让出调度线程
+    for ( int count = 0;
+            count < SYNC_BATCH && this->sentbytes < SEND_WINDOW; ++count )
+    {
+        if ( this->syncnext( logs ) == 0 )
+        {
+            break;
+        }
+
+        ret = 1;
+        if ( this->status == Client::OUT_OF_SYNC )
+        {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+int BackendSync::Client::syncnext( const BinlogQueue *logs )
 {
 	Binlog log;
+	BinlogRecord record;
+	bool hasvalue = false;
 
     while( 1 )
     {
 		int ret = 0;
 		uint64_t expect_seq = this->lastseq + 1;
+
+		hasvalue = false;
 		if( this->status == Client::COPY && this->lastseq == 0 )
         {
 			ret = logs->findLast( &log );
 		}
+        else if ( this->reader != NULL && this->reader->read( expect_seq, record ) )
+        {
+            // 分段文件中带有数据
+            log = Binlog( record.seq, record.cmd, record.key.ToString() );
+            hasvalue = true;
+            ret = 1;
+        }
         else
         {
 			ret = logs->findNext( expect_seq, &log );
@@ -420,20 +1072,43 @@ int BackendSync::Client::sync( const BinlogQueue *logs )
         {
 			return 0;
 		}
-		if( this->status == Client::COPY && log.key().ToString() > this->lastkey )
+		if( this->status == Client::COPY && this->partitions.empty()
+                && log.key().ToString() > this->lastkey )
         {
+			// 还没有开始复制
 			this->lastseq = log.seq();
-			// WARN: When there are writes behind last_key, we MUST create
-			// a new iterator, because iterator will not know this key.
-			// Because iterator ONLY iterates throught keys written before
-			// iterator is created.
-			if( this->iter )
+            continue;
+		}
+		if( this->status == Client::COPY && !this->partitions.empty() )
+        {
+            bool skip = false;
+            std::string key = log.key().ToString();
+            Partition * p = this->locate( key );
+
+            if ( p != NULL )
             {
-				delete this->iter;
-				this->iter = NULL;
-			}
+                Lock lock( &p->lock );
+                if ( !p->done && ( p->lastkey.empty() || key > p->lastkey ) )
+                {
+                    // WARN: When there are writes behind last_key, we MUST create
+                    // a new iterator, because iterator will not know this key.
+                    // Because iterator ONLY iterates throught keys written before
+                    // iterator is created.
+                    p->reset = true;
+                    skip = true;
+                }
+                else
+                {
+                    // 已经读取的复制记录先发送, 保证同步记录在之后到达
+                    this->flush( p->batch );
+                }
+            }
 
-            continue;
+            if ( skip )
+            {
+                this->lastseq = log.seq();
+                continue;
+            }
 		}
 		if( this->lastseq != 0 && log.seq() != expect_seq )
         {
@@ -452,6 +1127,17 @@ int BackendSync::Client::sync( const BinlogQueue *logs )
 	switch( log.cmd() )
     {
 		case BinlogCommand::SET:
+			if ( hasvalue )
+            {
+                this->send( BinlogType::SYNC, log.repr(), record.value.ToString() );
+                break;
+            }
+			if ( log.hasValue() )
+            {
+                this->send( BinlogType::SYNC, log.repr(), log.value().ToString() );
+                break;
+            }
+
 			rc = CDataServer::getInstance().getStorageEngine()->get( log.key().ToString(), val );
 			if( !rc)
             {
@@ -474,10 +1160,38 @@ int BackendSync::Client::sync( const BinlogQueue *logs )
 
 void BackendSync::Client::send( const char method, const std::string & log, const std::string & value )
 {
-    SyncResponse response;
-    response.method = method;
-    response.binlog = log;
-    response.value = value;
+    batch.append( method, log, value );
+
+    if ( batch.size() >= BATCH_BYTES )
+    {
+        this->flush();
+    }
+}
+
+void BackendSync::Client::flush()
+{
+    this->flush( batch );
+}
+
+void BackendSync::Client::flush( SyncBatchResponse & b )
+{
+    if ( b.empty() )
+    {
+        return;
+    }
+
+    // 序列化后的缓冲区交给网络层释放, 每次使用新的消息
+    SyncBatchResponse response;
+    response.count = b.count;
+    response.entries.swap( b.entries );
+    b.count = 0;
+    b.entries.clear();
+
+    if ( &b == &batch )
+    {
+        this->sentbytes += response.entries.size();
+    }
+    backend->account( sid, 0, response.count, response.entries.size() );
     g_MasterService->send( sid, &response );
 }
 }
@@ -2,13 +2,17 @@
 #ifndef __SRC_TINYDB_SYNCBACKEND_H_
 #define __SRC_TINYDB_SYNCBACKEND_H_
 
+#include <deque>
 #include <vector>
 #include <string>
 #include <map>
+#include <pthread.h>
 
 #include "utils/thread.h"
 
 #include "types.h"
+#include "status.h"
+#include "message/protocol.h"
 
 #include "binlog.h"
 
@@ -24,38 +28,120 @@ public :
 	~BackendSync();
 
 public :
-    void process( uint64_t sid, uint64_t lastseq, const std::string & lastkey );
+    // 备机的同步状态
+    struct SlaveStatus
+    {
+        uint8_t         state;          // eSlaveState, 0表示还没有开始同步
+        int32_t         status;         // 同步的状态, 实时同步时是SYNC
+        uint64_t        lastseq;        // 已经发送的最后一条binlog
+        uint64_t        ackseq;         // 备机确认已经写入的binlog
+        RateCounter     entries;        // 发送的记录数
+        RateCounter     bytes;          // 发送的字节数
+        uint64_t        copykeys;       // 已经复制的KEY的个数
+        uint32_t        partitions;     // 并行复制的区间数
+        uint32_t        copied;         // 复制完成的区间数
+        std::string     copykey;        // 单区间复制时已经复制到的KEY
+        int64_t         lastacktime;    // 最后一次收到备机消息的时间
+        uint64_t        ackbytes;       // 备机确认已经写入的字节数, 和bytes一起计算发送窗口
+
+        SlaveStatus()
+            : state( 0 ), status( 0 ), lastseq( 0 ), ackseq( 0 ),
+              copykeys( 0 ), partitions( 0 ), copied( 0 ), lastacktime( 0 ),
+              ackbytes( 0 )
+        {}
+    };
+
+    typedef std::map<uint64_t, SlaveStatus> SlaveStatusMap;
+
+public :
+    // 启动调度线程
+    bool start();
+
+    // bounds/lastkeys : 备机中断的并行复制, 每个区间的起始KEY和已经复制的KEY
+    void process( uint64_t sid, uint64_t lastseq, const std::string & lastkey,
+            const std::vector<std::string> & bounds, const std::vector<std::string> & lastkeys );
 
     // 处理备机断开连接
     void shutdown( uint64_t sid );
 
     // 获即时同步的备机
     void getSlaveSids( std::vector<uint64_t> & sids );
+    // 是否有连接的备机
+    bool hasSlaves() const { return m_SlaveCount > 0; }
 
-    // 同步数据
-    void send( uint64_t sid, const Binlog & log );
+    // 备机确认已经写入seq之前的binlog, 以及本次连接收到的bytes字节
+    void ack( uint64_t sid, uint64_t seq, uint64_t bytes );
+    // 半同步, 至少有指定个数的备机确认的seq
+    uint32_t getSemiSyncSlaves() const { return m_SemiSyncSlaves; }
+    uint64_t getAckedSeq() const { return m_AckedSeq; }
+    // 所有备机的同步状态
+    void getSlaveStatus( SlaveStatusMap & status );
+    static const char * getStatusName( int32_t status );
 
-    Iterator* iterator( const std::string & start, const std::string & end, uint64_t limit ) const;
+    // 有新的binlog或者复制完成, 唤醒调度线程
+    void notify();
+
+    // 一次事务中的binlog, 由调度线程序列化一次后发送给所有实时同步的备机
+    // lastseq : 事务的最后一条binlog
+    void publish( uint64_t lastseq, SyncBatchResponse * frame );
+
+    // skipstart : 跳过等于start的KEY
+    Iterator* iterator( const std::string & start, const std::string & end,
+            uint64_t limit, bool skipstart = true ) const;
 
 private :
-    void send( uint64_t sid, const char method, const std::string & log, const std::string & value = "" );
+	struct Client;
+
+    enum
+    {
+        eSchedule_IdleMilliseconds  = 300,      // 空闲时的最长等待时间
+        eSchedule_NoopInterval      = 3000,     // 空闲时发送NOOP的间隔
+        eSchedule_AckWindow         = 16 * 1024 * 1024,     // 备机还没有确认的最大字节数
+    };
+
+    // 广播实时同步的binlog
+    void fanout();
+    // 定期向所有备机发送同步位置
+    void heartbeat();
+    // 统计发送的记录
+    void account( uint64_t sid, uint64_t lastseq, uint32_t entries, size_t bytes );
+    // 更新追赶中的备机的同步状态
+    void report( Client * client );
+    // 同步一个备机, 返回1表示还有数据, 0表示空闲, -1表示结束
+    int step( Client * client );
+    // 备机还没有确认的数据超出发送窗口
+    bool congested( uint64_t sid );
+
+    // 等待唤醒, sequence是等待之前的唤醒次数
+    uint64_t sequence();
+    void wait( uint64_t sequence, int64_t msecs );
 
     static void* sync_backend( void *arg );
 
 private:
-	struct Client;
-
     struct run_arg
     {
-		uint64_t            sid;
-        uint64_t            lastseq;
-        std::string         lastkey;
-        const BackendSync * backend;
+        uint32_t            index;
+        BackendSync *       backend;
 	};
 
     utils::Mutex                    m_WorkerMutex;
     volatile bool                   m_ThreadQuit;
-    std::map<uint64_t, uint8_t>     m_Workers;
+    SlaveStatusMap                  m_Workers;      // 连接的备机
+    volatile uint32_t               m_SlaveCount;
+    uint32_t                        m_SemiSyncSlaves;
+    volatile uint64_t               m_AckedSeq;
+    int32_t                         m_HeartbeatInterval;
+    int64_t                         m_HeartbeatTimestamp;
+    std::map<uint64_t, Client *>    m_Clients;      // 追赶中的备机
+    uint32_t                        m_NextWorker;
+
+    // 调度线程, 第一个线程同时负责实时同步的广播
+    std::vector<pthread_t>          m_Threads;
+    pthread_mutex_t                 m_ScheduleLock;
+    pthread_cond_t                  m_ScheduleCond;
+    uint64_t                        m_Sequence;     // 每次唤醒递增
+    std::deque< std::pair<uint64_t, SyncBatchResponse *> > m_Frames;
 };
 
 struct BackendSync::Client
@@ -65,13 +151,55 @@ struct BackendSync::Client
 	static const int COPY = 2;
 	static const int SYNC = 4;
 
+	// 每次最多同步的binlog个数
+	static const int SYNC_BATCH = 1000;
+	// 每一轮最多发送的字节数, 避免一个备机占用调度线程
+	static const size_t SEND_WINDOW = 1024 * 1024;
+	// 批量同步消息的最大长度
+	static const size_t BATCH_BYTES = 256 * 1024;
+	// 每个复制线程平均分到的区间个数
+	static const uint32_t PARTITIONS_PER_THREAD = 4;
+
+	// 并行复制的区间[start, end)
+	struct Partition
+	{
+		std::string             start;
+		std::string             end;        // 空表示到最后
+		std::string             lastkey;    // 已经读取的最后一个KEY
+		bool                    done;
+		bool                    reset;      // 有新的写入, 需要重新创建迭代器
+		Iterator *              iter;
+		uint64_t                count;      // 已经复制的KEY的个数
+		SyncBatchResponse       batch;      // 还没有发送的复制记录
+		utils::Mutex            lock;
+
+		Partition() : done( false ), reset( false ), iter( NULL ), count( 0 ) {}
+	};
+
 	int                     status;
 	uint64_t                sid;
     uint64_t                lastseq;
 	uint64_t                lastnoopseq;
 	std::string             lastkey;
 	BackendSync *           backend;
-	Iterator *              iter;
+	BinlogFile::Reader *    reader;     // 从分段文件中读取binlog和数据
+	SyncBatchResponse       batch;      // 待发送的同步记录
+	uint32_t                worker;     // 负责的调度线程
+	int64_t                 lastactive; // 最后一次发送的时间
+	size_t                  sentbytes;  // 本轮已经发送的字节数
+
+	// 并行复制
+	std::vector<std::string>    bounds;     // 备机中断时的区间划分
+	std::vector<std::string>    lastkeys;
+	std::vector<Partition *>    partitions;
+	std::vector<pthread_t>      copythreads;
+	size_t                      nextpartition;  // 下一个待复制的区间
+	volatile bool               copyquit;
+	utils::Mutex                copylock;
+	uint64_t                    copyseq;        // 开始复制时的seq
+	uint64_t                    copylimit;      // 每秒最多复制的字节数
+	int64_t                     copytimeslice;
+	uint64_t                    copybytes;
 
 	Client( BackendSync *backend, int64_t sid, uint64_t lastseq, const std::string & lastkey );
 	~Client();
@@ -80,7 +208,25 @@ struct BackendSync::Client
 	void noop();
 	int copy();
     int sync( const BinlogQueue *logs );
+    int syncnext( const BinlogQueue *logs );
     void send( const char method, const std::string & log, const std::string & value = "" );
+    // 发送积累的同步记录
+    void flush();
+    void flush( SyncBatchResponse & b );
+
+    // 划分区间, 启动/停止复制线程
+    void plan();
+    void startCopy();
+    void stopCopy();
+    // KEY所在的区间
+    Partition * locate( const std::string & key ) const;
+    // 复制区间中的一批数据, 复制完成时返回true
+    // 复制线程在备机确认之前最多发送一个发送窗口的数据
+    bool copyPartition( Partition * p );
+    // 复制限速
+    void throttle( size_t bytes );
+
+    static void * copy_thread( void * arg );
 };
 
 class Lock
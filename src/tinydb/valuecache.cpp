@@ -0,0 +1,175 @@
+
+#include "types.h"
+#include "utils/hashfunc.h"
+
+#include "valuecache.h"
+
+namespace tinydb
+{
+
+ValueCache::ValueCache( size_t capacity )
+    : m_Capacity( capacity ),
+      m_ShardCapacity( capacity / eShardsCount )
+{}
+
+ValueCache::~ValueCache()
+{}
+
+ValueCache::Shard & ValueCache::shard( const char * key, size_t len )
+{
+    return m_Shards[ utils::HashFunction::murmur32( key, len ) % eShardsCount ];
+}
+
+bool ValueCache::get( const std::string & key, std::string & value, uint64_t & ticket )
+{
+    bool rc = false;
+    Shard & s = this->shard( key.data(), key.size() );
+
+    s.lock.lock();
+    EntryIndex::iterator it = s.index.find( key );
+    if ( it != s.index.end() )
+    {
+        // 移到头部
+        s.lru.splice( s.lru.begin(), s.lru, it->second );
+        value = it->second->value;
+        ++s.hits;
+        rc = true;
+    }
+    else
+    {
+        ticket = s.version;
+        ++s.misses;
+    }
+    s.lock.unlock();
+
+    return rc;
+}
+
+void ValueCache::fill( const std::string & key, const std::string & value, uint64_t ticket )
+{
+    Shard & s = this->shard( key.data(), key.size() );
+
+    s.lock.lock();
+    // 读取期间有写入, 读到的可能是旧数据
+    if ( s.version == ticket )
+    {
+        this->update( s, key, value, true );
+    }
+    s.lock.unlock();
+}
+
+void ValueCache::Put( const leveldb::Slice & key, const leveldb::Slice & value )
+{
+    // 只缓存真正的数据
+    if ( key.empty() || key[0] != DataType::KV )
+    {
+        return;
+    }
+
+    Shard & s = this->shard( key.data(), key.size() );
+
+    s.lock.lock();
+    ++s.version;
+    // 只更新已经缓存的数据, 由读取决定是否是热点
+    this->update( s, key, value, false );
+    s.lock.unlock();
+}
+
+void ValueCache::Delete( const leveldb::Slice & key )
+{
+    if ( key.empty() || key[0] != DataType::KV )
+    {
+        return;
+    }
+
+    Shard & s = this->shard( key.data(), key.size() );
+
+    s.lock.lock();
+    ++s.version;
+    EntryIndex::iterator it = s.index.find( key.ToString() );
+    if ( it != s.index.end() )
+    {
+        this->erase( s, it );
+    }
+    s.lock.unlock();
+}
+
+void ValueCache::update( Shard & s, const leveldb::Slice & key, const leveldb::Slice & value, bool insert )
+{
+    size_t size = key.size() + value.size() + eEntryOverhead;
+
+    EntryIndex::iterator it = s.index.find( key.ToString() );
+    if ( it != s.index.end() )
+    {
+        Entry & e = *( it->second );
+        s.bytes -= e.key.size() + e.value.size() + eEntryOverhead;
+        e.value.assign( value.data(), value.size() );
+        s.bytes += size;
+        s.lru.splice( s.lru.begin(), s.lru, it->second );
+    }
+    else if ( insert && size <= m_ShardCapacity )
+    {
+        s.lru.push_front( Entry() );
+        s.lru.front().key.assign( key.data(), key.size() );
+        s.lru.front().value.assign( value.data(), value.size() );
+        s.index.insert( std::make_pair( s.lru.front().key, s.lru.begin() ) );
+        s.bytes += size;
+    }
+
+    // 淘汰最久未访问的
+    while ( s.bytes > m_ShardCapacity && !s.lru.empty() )
+    {
+        this->erase( s, s.index.find( s.lru.back().key ) );
+    }
+}
+
+void ValueCache::erase( Shard & s, EntryIndex::iterator it )
+{
+    LRUList::iterator e = it->second;
+
+    s.bytes -= e->key.size() + e->value.size() + eEntryOverhead;
+    s.index.erase( it );
+    s.lru.erase( e );
+}
+
+size_t ValueCache::getBytes() const
+{
+    size_t bytes = 0;
+    for ( size_t i = 0; i < eShardsCount; ++i )
+    {
+        bytes += m_Shards[i].bytes;
+    }
+    return bytes;
+}
+
+size_t ValueCache::getCount() const
+{
+    size_t count = 0;
+    for ( size_t i = 0; i < eShardsCount; ++i )
+    {
+        count += m_Shards[i].index.size();
+    }
+    return count;
+}
+
+uint64_t ValueCache::getHits() const
+{
+    uint64_t hits = 0;
+    for ( size_t i = 0; i < eShardsCount; ++i )
+    {
+        hits += m_Shards[i].hits;
+    }
+    return hits;
+}
+
+uint64_t ValueCache::getMisses() const
+{
+    uint64_t misses = 0;
+    for ( size_t i = 0; i < eShardsCount; ++i )
+    {
+        misses += m_Shards[i].misses;
+    }
+    return misses;
+}
+
+}
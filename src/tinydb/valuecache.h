@@ -0,0 +1,93 @@
+
+#ifndef __SRC_TINYDB_VALUECACHE_H__
+#define __SRC_TINYDB_VALUECACHE_H__
+
+#include <map>
+#include <list>
+#include <string>
+
+#include <leveldb/slice.h>
+#include <leveldb/write_batch.h>
+
+#include "utils/thread.h"
+
+namespace tinydb
+{
+
+//
+// 热点数据缓存
+// 按照KEY的哈希值分片, 每个分片独立加锁, 按照LRU淘汰
+// 作为LevelDBEngine的WriteBatch::Handler, 写入leveldb之后更新或者删除
+//
+// 未命中时先取得分片的版本号, 从leveldb读取后再填充,
+// 期间分片有写入则放弃填充, 避免缓存旧数据
+//
+class ValueCache : public leveldb::WriteBatch::Handler
+{
+public :
+    ValueCache( size_t capacity );
+    virtual ~ValueCache();
+
+public :
+    // 查询, 未命中时返回填充用的版本号
+    bool get( const std::string & key, std::string & value, uint64_t & ticket );
+    // 填充从leveldb读取的数据
+    void fill( const std::string & key, const std::string & value, uint64_t ticket );
+
+    // WriteBatch::Handler
+    virtual void Put( const leveldb::Slice & key, const leveldb::Slice & value );
+    virtual void Delete( const leveldb::Slice & key );
+
+public :
+    // 统计
+    size_t getCapacity() const { return m_Capacity; }
+    size_t getBytes() const;
+    size_t getCount() const;
+    uint64_t getHits() const;
+    uint64_t getMisses() const;
+
+private :
+    enum
+    {
+        eShardsCount    = 32,       // 分片个数
+        eEntryOverhead  = 96,       // 每个元素额外占用的内存(估算)
+    };
+
+    struct Entry
+    {
+        std::string     key;
+        std::string     value;
+    };
+
+    typedef std::list<Entry> LRUList;
+    typedef std::map<std::string, LRUList::iterator> EntryIndex;
+
+    struct Shard
+    {
+        utils::Mutex    lock;
+        uint64_t        version;    // 每次写入递增
+        size_t          bytes;
+        LRUList         lru;        // 头部是最近访问的
+        EntryIndex      index;
+        uint64_t        hits;
+        uint64_t        misses;
+
+        Shard() : version( 0 ), bytes( 0 ), hits( 0 ), misses( 0 ) {}
+    };
+
+    Shard & shard( const char * key, size_t len );
+
+    // 添加或者修改, 调用者加锁
+    void update( Shard & s, const leveldb::Slice & key, const leveldb::Slice & value, bool insert );
+    // 删除, 调用者加锁
+    void erase( Shard & s, EntryIndex::iterator it );
+
+private :
+    size_t          m_Capacity;         // 总容量
+    size_t          m_ShardCapacity;    // 每个分片的容量
+    Shard           m_Shards[ eShardsCount ];
+};
+
+}
+
+#endif
@@ -70,6 +70,7 @@ enum
     eTaskType_DataSlave     = 2,    // 来自数据备库任务
     eTaskType_DataMaster    = 3,    // 来自数据主库任务
     eTaskType_Middleware    = 4,    // 中间件任务
+    eTaskType_SyncAck       = 5,    // 备机确认, 唤醒等待确认的工作线程
 };
 
 // 数据类型
@@ -77,6 +78,7 @@ class DataType
 {
 public:
     static const char SYNCLOG   = 1;        // binlog数据
+    static const char META      = 2;        // 元数据
     static const char KV        = 'k';      // 真正数据
 };
 
@@ -100,6 +102,16 @@ public:
     static const char COPY      = 2;
 };
 
+// 持久化方式, 数值越大越可靠
+class Durability
+{
+public:
+    static const int8_t DEFAULT = 0;        // 使用服务器的配置
+    static const int8_t ASYNC   = 1;        // 不等待fsync
+    static const int8_t GROUP   = 2;        // 定时或者定量fsync一次, fsync之后才回应
+    static const int8_t SYNC    = 3;        // 每次提交都fsync
+};
+
 // 备机状态
 enum
 {
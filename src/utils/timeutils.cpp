@@ -206,6 +206,19 @@ int64_t TimeUtils::now()
     return now;
 }
 
+int64_t TimeUtils::usnow()
+{
+    int64_t now = 0;
+    struct timespec ts;
+
+    if ( ::clock_gettime(CLOCK_MONOTONIC, &ts) == 0 )
+    {
+        now = (int64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+    }
+
+    return now;
+}
+
 int32_t TimeUtils::tzminutes()
 {
     struct timeval tv;
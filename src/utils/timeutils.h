@@ -86,6 +86,9 @@ public :
     // 获得当前时间的毫秒数
     static int64_t now();
 
+    // 获得单调时钟的微秒数, 用于计算耗时
+    static int64_t usnow();
+
     // 获取时区分钟数
     static int32_t tzminutes();
 